@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <CudaOperator.h>
+#include <Workspace.h>
+
+using namespace SEP;
+
+// Composition A = ops[n-1] ... ops[1] ops[0]. The intermediate results are workspace scratch,
+// released as soon as the next operator has consumed them, so a chain of any length holds at
+// most two intermediate vectors at a time.
+template <class M, class D>
+class ChainOperator : public CudaOperator<M, D> {
+public:
+	ChainOperator(const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>& range,
+	complex_vector* model = nullptr, complex_vector* data = nullptr,
+	dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE)
+	: CudaOperator<M, D>(domain, range, model, data, grid, block, stream, backend) {
+		ws = Workspace::shared(backend, stream);
+	};
+
+	// append op, applied after the operators already in the chain
+	template <class Op>
+	void append(const std::shared_ptr<Op>& op) {
+		if (op->getBackend() != this->_backend_)
+			throw std::runtime_error("ChainOperator: all the operators must run on the same backend.");
+		Link link;
+		link.op = op;
+		link.range = op->getRange();
+		link.forward = [op](bool add, complex_vector* model, complex_vector* data) {op->cu_forward(add, model, data);};
+		link.adjoint = [op](bool add, complex_vector* model, complex_vector* data) {op->cu_adjoint(add, model, data);};
+		links.push_back(link);
+	};
+
+	void cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+		if (links.empty()) throw std::runtime_error("ChainOperator: empty chain.");
+		complex_vector* in = model;
+		for (int i=0; i < int(links.size())-1; ++i) {
+			complex_vector* out = ws->acquire(links[i].range, model->_grid_, model->_block_);
+			links[i].forward(false, in, out);
+			if (in != model) ws->release(in);
+			in = out;
+		}
+		links.back().forward(add, in, data);
+		if (in != model) ws->release(in);
+	};
+
+	void cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+		if (links.empty()) throw std::runtime_error("ChainOperator: empty chain.");
+		complex_vector* in = data;
+		for (int i=int(links.size())-1; i > 0; --i) {
+			// the domain of link i is the range of link i-1
+			complex_vector* out = ws->acquire(links[i-1].range, data->_grid_, data->_block_);
+			links[i].adjoint(false, out, in);
+			if (in != data) ws->release(in);
+			in = out;
+		}
+		links.front().adjoint(add, model, in);
+		if (in != data) ws->release(in);
+	};
+
+	const std::shared_ptr<Workspace>& get_workspace() const {return ws;};
+
+private:
+	struct Link {
+		std::shared_ptr<void> op;
+		std::shared_ptr<hypercube> range;
+		std::function<void(bool, complex_vector*, complex_vector*)> forward, adjoint;
+	};
+	std::vector<Link> links;
+	std::shared_ptr<Workspace> ws;
+};
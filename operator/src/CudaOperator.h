@@ -1,5 +1,7 @@
 #pragma once
 #include <vector>
+#include <cstring>
+#include <algorithm>
 #include <floatHyper.h>
 #include <complexHyper.h>
 #include <complex_vector.h>
@@ -17,19 +19,19 @@ using RangeType = D;
 	CudaOperator(const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>& range, 
 								complex_vector* model = nullptr, complex_vector* data = nullptr, 
 								// std::shared_ptr<paramObj> launch_param
-								dim3 grid=1, dim3 block=1, cudaStream_t stream = 0) 
-	: _grid_(grid), _block_(block), _stream_(stream) {
+								dim3 grid=1, dim3 block=1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) 
+	: _grid_(grid), _block_(block), _stream_(stream), _backend_(backend) {
 		
 		setDomainRange(domain, range);
 		if (model == nullptr) {
 			model_alloc = true;
-			model_vec = make_complex_vector(domain, _grid_, _block_, _stream_);
+			model_vec = make_complex_vector(domain, _backend_, _grid_, _block_, _stream_);
 		}
 		else model_vec = model;
 
 		if (data == nullptr) {
 			data_alloc = true;
-			data_vec = make_complex_vector(range, _grid_, _block_, _stream_);
+			data_vec = make_complex_vector(range, _backend_, _grid_, _block_, _stream_);
 		}
 		else data_vec = data;
 		
@@ -37,15 +39,20 @@ using RangeType = D;
 		data_vec->set_stream(stream);
 	 };
 
+protected:
+	// for operators that manage their own (partial) buffers: model_vec and data_vec are left null
+	CudaOperator(const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>& range,
+								Backend backend, dim3 grid=1, dim3 block=1, cudaStream_t stream = 0)
+	: _grid_(grid), _block_(block), _stream_(stream), _backend_(backend) {
+		setDomainRange(domain, range);
+		model_vec = nullptr;
+		data_vec = nullptr;
+	};
+
+public:
 	virtual ~CudaOperator() {
-		if (model_alloc) {
-			model_vec->~complex_vector();
-			CHECK_CUDA_ERROR(cudaFree(model_vec));
-		}
-		if (data_alloc) {
-			data_vec->~complex_vector();
-			CHECK_CUDA_ERROR(cudaFree(data_vec));
-		}
+		if (model_alloc) free_complex_vector(model_vec);
+		if (data_alloc) free_complex_vector(data_vec);
 	};
 
 	void set_grid(dim3 grid) {_grid_ = grid;};
@@ -66,94 +73,95 @@ using RangeType = D;
 
 	virtual void forward(bool add, std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
 		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), getDomainSizeInBytes(), cudaHostRegisterDefault));
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), getRangeSizeInBytes(), cudaHostRegisterDefault));
+		pin_host(model->getVals(), getDomainSizeInBytes());
+		pin_host(data->getVals(), getRangeSizeInBytes());
 
 		if (add) {
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(data_vec->mat, data->getVals(), getRangeSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+			copy_in(data_vec->mat, data->getVals(), getRangeSizeInBytes());
 		}
 		else {
 			data->zero();
 		}
 		
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(model_vec->mat, model->getVals(), getDomainSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+		copy_in(model_vec->mat, model->getVals(), getDomainSizeInBytes());
 
 		cu_forward(add, model_vec, data_vec);
 
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(data->getVals(), data_vec->mat, getRangeSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		copy_out(data->getVals(), data_vec->mat, getRangeSizeInBytes());
 
 		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+		unpin_host(model->getVals());
+		unpin_host(data->getVals());
 	};
 
 	// this is host-to-host function
 	virtual void adjoint(bool add, std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
 		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), getDomainSizeInBytes(), cudaHostRegisterDefault));
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), getRangeSizeInBytes(), cudaHostRegisterDefault));
+		pin_host(model->getVals(), getDomainSizeInBytes());
+		pin_host(data->getVals(), getRangeSizeInBytes());
 
 		if (add) {
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(model_vec->mat, model->getVals(), getDomainSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+			copy_in(model_vec->mat, model->getVals(), getDomainSizeInBytes());
 		}
 		else {
 			model->zero();
 		}
 
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(data_vec->mat,data->getVals(), getRangeSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+		copy_in(data_vec->mat,data->getVals(), getRangeSizeInBytes());
 		cu_adjoint(add, model_vec, data_vec);
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(model->getVals(),model_vec->mat, getDomainSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		copy_out(model->getVals(),model_vec->mat, getDomainSizeInBytes());
 
 		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+		unpin_host(model->getVals());
+		unpin_host(data->getVals());
 	};
 
 	// this is host-to-host function
 	void inverse(bool add, std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
 		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), getDomainSizeInBytes(), cudaHostRegisterDefault));
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), getRangeSizeInBytes(), cudaHostRegisterDefault));
+		pin_host(model->getVals(), getDomainSizeInBytes());
+		pin_host(data->getVals(), getRangeSizeInBytes());
 
 		if (add) {
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(model_vec->mat, model->getVals(), getDomainSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+			copy_in(model_vec->mat, model->getVals(), getDomainSizeInBytes());
 		}
 		else {
 			model->zero();
 		}
 
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(data_vec->mat,data->getVals(), getRangeSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
+		copy_in(data_vec->mat,data->getVals(), getRangeSizeInBytes());
 		cu_inverse(add, model_vec, data_vec);
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(model->getVals(),model_vec->mat, getDomainSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		copy_out(model->getVals(),model_vec->mat, getDomainSizeInBytes());
 
 		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+		unpin_host(model->getVals());
+		unpin_host(data->getVals());
 	};
 
 	virtual void forward(std::shared_ptr<D>& data) {
 		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), getRangeSizeInBytes(), cudaHostRegisterDefault));
+		pin_host(data->getVals(), getRangeSizeInBytes());
 		
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(data_vec->mat, data->getVals(), getRangeSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
-		cu_forward(true, data_vec, data_vec);
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(data->getVals(), data_vec->mat, getRangeSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		copy_in(data_vec->mat, data->getVals(), getRangeSizeInBytes());
+		// in place, the two-vector overloads would add the input to the result
+		cu_forward(data_vec);
+		copy_out(data->getVals(), data_vec->mat, getRangeSizeInBytes());
 
 		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+		unpin_host(data->getVals());
 	};
 
 	// this is host-to-host function
 	virtual void adjoint(std::shared_ptr<M>& model) {
 		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), getDomainSizeInBytes(), cudaHostRegisterDefault));
+		pin_host(model->getVals(), getDomainSizeInBytes());
 		
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(model_vec->mat, model->getVals(), getDomainSizeInBytes(), cudaMemcpyHostToDevice, _stream_));
-		cu_adjoint(true, model_vec, model_vec);
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(model->getVals(), model_vec->mat, getDomainSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		copy_in(model_vec->mat, model->getVals(), getDomainSizeInBytes());
+		cu_adjoint(model_vec);
+		copy_out(model->getVals(), model_vec->mat, getDomainSizeInBytes());
 
 		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
+		unpin_host(model->getVals());
 	};
 
 	const std::shared_ptr<hypercube>& getDomain() const{
@@ -168,6 +176,9 @@ using RangeType = D;
 	const int getRangeSize() const{
 		return _range->getN123();
 	}
+	Backend getBackend() const {
+		return _backend_;
+	}
 	const size_t getDomainSizeInBytes() const{
 		return sizeof(cuFloatComplex)*_domain->getN123();
 	}
@@ -225,6 +236,42 @@ protected:
 	dim3 _grid_, _block_;
 	bool model_alloc = false, data_alloc = false;
 	cudaStream_t _stream_;
+	Backend _backend_;
+
+	// backend-aware helpers for the arrays owned by the derived operators (coordinates, labels, etc.)
+	template <typename T>
+	T* alloc_param(size_t n) {
+		T* ptr;
+		if (_backend_ == Backend::HOST) ptr = new T[n];
+		else CHECK_CUDA_ERROR(cudaMalloc((void **)&ptr, sizeof(T)*n));
+		return ptr;
+	}
+	template <typename T>
+	void free_param(T* ptr) {
+		if (_backend_ == Backend::HOST) delete[] ptr;
+		else CHECK_CUDA_ERROR(cudaFree(ptr));
+	}
+	template <typename T>
+	void upload_param(T* dst, const T* src, size_t n) {
+		if (_backend_ == Backend::HOST) std::copy(src, src + n, dst);
+		else CHECK_CUDA_ERROR(cudaMemcpyAsync(dst, src, sizeof(T)*n, cudaMemcpyHostToDevice, _stream_));
+	}
+
+	// on the host backend the vectors are already in host memory: no pinning and plain copies
+	void pin_host(void* ptr, size_t bytes) {
+		if (_backend_ == Backend::DEVICE) CHECK_CUDA_ERROR(cudaHostRegister(ptr, bytes, cudaHostRegisterDefault));
+	}
+	void unpin_host(void* ptr) {
+		if (_backend_ == Backend::DEVICE) CHECK_CUDA_ERROR(cudaHostUnregister(ptr));
+	}
+	void copy_in(void* dst, const void* src, size_t bytes) {
+		if (_backend_ == Backend::HOST) std::memcpy(dst, src, bytes);
+		else CHECK_CUDA_ERROR(cudaMemcpyAsync(dst, src, bytes, cudaMemcpyHostToDevice, _stream_));
+	}
+	void copy_out(void* dst, const void* src, size_t bytes) {
+		if (_backend_ == Backend::HOST) std::memcpy(dst, src, bytes);
+		else CHECK_CUDA_ERROR(cudaMemcpyAsync(dst, src, bytes, cudaMemcpyDeviceToHost, _stream_));
+	}
 
 };
 
@@ -1,4 +1,6 @@
 #include "FFT.h"
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 using namespace SEP;
 
@@ -12,30 +14,34 @@ dim3 grid, dim3 block, cudaStream_t stream)
   BATCH = getDomain()->getN123() / (NX*NY);
   SIZE = getDomain()->getN123();
 
-  int rank = 2;
-  int dims[2] = {NX, NY};
+  _plan_ = FFTPlanCache::instance().get_cufft(NX, NY, BATCH, stream);
+  plan = _plan_->handle;
 
-  cufftPlanMany(&plan, rank, dims, NULL, 1, 0, NULL, 1, 0, CUFFT_C2C, BATCH);
-  // set the callback to make it orthogonal
-  register_ortho_callback();
-
-  temp = make_complex_vector(domain, model_vec->_grid_, data_vec->_block_, stream);
-
-  cufftSetStream(plan, stream);
+  ws = Workspace::shared(Backend::DEVICE, stream);
 };
 
 // this is on-device function
 void cuFFT2d::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) data->zero();
+  if (!add) {
+    cufftExecC2C(plan, model->mat, data->mat, CUFFT_FORWARD);
+    return;
+  }
+  complex_vector* temp = ws->acquire(getDomain(), model->_grid_, model->_block_);
   cufftExecC2C(plan, model->mat, temp->mat, CUFFT_FORWARD);
   data->add(temp);
+  ws->release(temp);
 };
 
 // this is on-device function
 void cuFFT2d::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) model->zero();
+  if (!add) {
+    cufftExecC2C(plan, data->mat, model->mat, CUFFT_INVERSE);
+    return;
+  }
+  complex_vector* temp = ws->acquire(getDomain(), data->_grid_, data->_block_);
   cufftExecC2C(plan, data->mat, temp->mat, CUFFT_INVERSE);
   model->add(temp);
+  ws->release(temp);
 };
 
 // this is on-device function
@@ -48,3 +54,86 @@ void cuFFT2d::cu_adjoint(__restrict__ complex_vector* data) {
   cufftExecC2C(plan, data->mat, data->mat, CUFFT_INVERSE);
 };
 
+
+namespace {
+  // slices per chunk are chosen so that a chunk stays within a typical L2
+  constexpr size_t CHUNK_BYTES = 1 << 18;
+}
+
+cpuFFT2d::cpuFFT2d(const std::shared_ptr<hypercube>& domain, complex_vector* model, complex_vector* data, 
+dim3 grid, dim3 block, cudaStream_t stream)
+: CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream, Backend::HOST) {
+
+  NX = getDomain()->getAxis(1).n;
+  NY = getDomain()->getAxis(2).n;
+  BATCH = getDomain()->getN123() / (NX*NY);
+  SIZE = getDomain()->getN123();
+  _scale_ = 1.f / std::sqrt(float(NX*NY));
+
+  // largest divisor of the batch that fits in a chunk, so all chunks share one plan
+  int max_chunk = std::max<size_t>(1, CHUNK_BYTES / (sizeof(fftwf_complex)*NX*NY));
+  CHUNK = 1;
+  for (int c = std::min(max_chunk, BATCH); c > 1; --c) {
+    if (BATCH % c == 0) {
+      CHUNK = c;
+      break;
+    }
+  }
+
+  auto& cache = FFTPlanCache::instance();
+  _plans_[0] = cache.get_fftw(NX, NY, CHUNK, FFTW_FORWARD, false);
+  _plans_[1] = cache.get_fftw(NX, NY, CHUNK, FFTW_FORWARD, true);
+  _plans_[2] = cache.get_fftw(NX, NY, CHUNK, FFTW_BACKWARD, false);
+  _plans_[3] = cache.get_fftw(NX, NY, CHUNK, FFTW_BACKWARD, true);
+  for (int i=0; i < 2; ++i) {
+    fwd_plan[i] = _plans_[i].get();
+    inv_plan[i] = _plans_[2+i].get();
+  }
+};
+
+void cpuFFT2d::transform(fftwf_plan* plans, bool add, cuFloatComplex* in, cuFloatComplex* out) {
+  size_t chunk_size = size_t(NX)*NY*CHUNK;
+  float scale = _scale_;
+  tbb::parallel_for(tbb::blocked_range<int>(0, BATCH / CHUNK),
+    [&](const tbb::blocked_range<int>& r) {
+    for (int ic = r.begin(); ic < r.end(); ++ic) {
+      cuFloatComplex* x = in + ic*chunk_size;
+      cuFloatComplex* y = out + ic*chunk_size;
+
+      if (!add) {
+        fftwf_plan plan = (x == y) ? plans[1] : plans[0];
+        fftwf_execute_dft(plan, reinterpret_cast<fftwf_complex*>(x), reinterpret_cast<fftwf_complex*>(y));
+        for (size_t i = 0; i < chunk_size; ++i) {
+          y[i].x *= scale;
+          y[i].y *= scale;
+        }
+      }
+      else {
+        auto& buf = scratch.local();
+        if (buf.ptr == nullptr) buf.ptr = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*chunk_size);
+        cuFloatComplex* tmp = buf.ptr;
+        fftwf_execute_dft(plans[0], reinterpret_cast<fftwf_complex*>(x), reinterpret_cast<fftwf_complex*>(tmp));
+        for (size_t i = 0; i < chunk_size; ++i) {
+          y[i].x += scale * tmp[i].x;
+          y[i].y += scale * tmp[i].y;
+        }
+      }
+    }
+  });
+};
+
+void cpuFFT2d::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+  transform(fwd_plan, add, model->mat, data->mat);
+};
+
+void cpuFFT2d::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+  transform(inv_plan, add, data->mat, model->mat);
+};
+
+void cpuFFT2d::cu_forward(complex_vector* data) {
+  transform(fwd_plan, false, data->mat, data->mat);
+};
+
+void cpuFFT2d::cu_adjoint(complex_vector* data) {
+  transform(inv_plan, false, data->mat, data->mat);
+};
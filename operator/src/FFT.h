@@ -2,8 +2,11 @@
 #include <cufft.h>
 #include <cufftXt.h>
 #include "CudaOperator.h"
-#include "fft_callback.cuh"
+#include "FFTPlanCache.h"
+#include "Workspace.h"
 #include <complex4DReg.h>
+#include <fftw3.h>
+#include <tbb/enumerable_thread_specific.h>
 
 using namespace SEP;
 
@@ -13,11 +16,7 @@ class cuFFT2d : public CudaOperator<complex4DReg, complex4DReg> {
 		dim3 grid = 1, dim3 block = 1,
 		cudaStream_t stream = 0);
 		
-		~cuFFT2d() {
-			temp->~complex_vector();
-			CHECK_CUDA_ERROR(cudaFree(temp));
-			cufftDestroy(plan);
-		};
+		~cuFFT2d() {};
 
 		// this is on-device functions
 		void cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
@@ -26,14 +25,45 @@ class cuFFT2d : public CudaOperator<complex4DReg, complex4DReg> {
 		void cu_adjoint(complex_vector* data);
 
 	private:
+		// shared through the plan cache with every cuFFT2d of the same geometry and stream
+		std::shared_ptr<cuFFTPlan> _plan_;
 		cufftHandle plan;
 		int NX, NY, BATCH, SIZE; 
-		complex_vector* temp;
+		// scratch to accumulate (add = true) is borrowed from the stream's workspace
+		std::shared_ptr<Workspace> ws;
+};
 
-		void register_ortho_callback() { 
-			auto h_storeCallbackPtr = get_host_callback_ptr();
-			cufftXtSetCallback(plan, (void **)&h_storeCallbackPtr, CUFFT_CB_ST_COMPLEX, (void **)&(model_vec->n));
-		}
+// host counterpart of cuFFT2d (FFTW), a drop-in replacement on the host backend.
+// The (w,s) batch is split into cache-sized chunks of 2D slices that are transformed
+// in parallel; the orthonormal scaling is applied to each chunk while it is still in cache
+// (or fused into the accumulation when add = true) instead of an extra sweep over the volume.
+class cpuFFT2d : public CudaOperator<complex4DReg, complex4DReg> {
+	public:
+		cpuFFT2d(const std::shared_ptr<hypercube>& domain, complex_vector* model = nullptr, complex_vector* data = nullptr, 
+		dim3 grid = 1, dim3 block = 1,
+		cudaStream_t stream = 0);
 		
+		// these run on the host vectors
+		void cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
+		void cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
+		void cu_forward(complex_vector* data);
+		void cu_adjoint(complex_vector* data);
+
+	private:
+		// [0] out-of-place, [1] in-place; owned by the plan cache
+		std::shared_ptr<fftwf_plan_s> _plans_[4];
+		fftwf_plan fwd_plan[2], inv_plan[2];
+		int NX, NY, BATCH, SIZE, CHUNK;
+		float _scale_;
+
+		// per-thread chunk buffer (FFTW-aligned) used when accumulating into the output
+		struct ChunkBuffer {
+			cuFloatComplex* ptr = nullptr;
+			ChunkBuffer() = default;
+			ChunkBuffer(const ChunkBuffer&) : ptr(nullptr) {};
+			~ChunkBuffer() { if (ptr) fftwf_free(ptr); };
+		};
+		tbb::enumerable_thread_specific<ChunkBuffer> scratch;
 
+		void transform(fftwf_plan* plans, bool add, cuFloatComplex* in, cuFloatComplex* out);
 };
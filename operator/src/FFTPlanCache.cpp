@@ -0,0 +1,137 @@
+#include <FFTPlanCache.h>
+#include <fft_callback.cuh>
+#include <cstdio>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+  // the FFTW planner (including plan destruction) is not thread-safe
+  std::mutex fftw_planner_mutex;
+}
+
+FFTPlanCache& FFTPlanCache::instance() {
+  static FFTPlanCache cache;
+  return cache;
+};
+
+std::shared_ptr<cuFFTPlan> FFTPlanCache::get_cufft(int nx, int ny, int batch, cudaStream_t stream) {
+  Key key(nx, ny, batch, 0, Backend::DEVICE, reinterpret_cast<size_t>(stream));
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = cufft_plans.find(key);
+  if (it != cufft_plans.end()) {
+    ++_hits_;
+    return it->second;
+  }
+  ++_misses_;
+
+  auto plan = std::shared_ptr<cuFFTPlan>(new cuFFTPlan, [](cuFFTPlan* p) {
+    cufftDestroy(p->handle);
+    CHECK_CUDA_ERROR(cudaFree(p->dims));
+    delete p;
+  });
+
+  // row-major: y is the slow and x the fast dimension
+  int rank = 2;
+  int dims[2] = {ny, nx};
+  cufftPlanMany(&plan->handle, rank, dims, NULL, 1, 0, NULL, 1, 0, CUFFT_C2C, batch);
+
+  // set the callback to make it orthogonal
+  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&plan->dims), sizeof(int) * 2));
+  plan->dims[0] = nx;
+  plan->dims[1] = ny;
+  auto h_storeCallbackPtr = get_host_callback_ptr();
+  cufftXtSetCallback(plan->handle, (void **)&h_storeCallbackPtr, CUFFT_CB_ST_COMPLEX, (void **)&(plan->dims));
+
+  cufftSetStream(plan->handle, stream);
+
+  cufft_plans[key] = plan;
+  return plan;
+};
+
+std::shared_ptr<fftwf_plan_s> FFTPlanCache::get_fftw(int nx, int ny, int batch, int direction, bool in_place) {
+  Key key(nx, ny, batch, direction, Backend::HOST, in_place);
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = fftw_plans.find(key);
+  if (it != fftw_plans.end()) {
+    ++_hits_;
+    return it->second;
+  }
+  ++_misses_;
+
+  // row-major: y is the slow and x the fast dimension
+  int dims[2] = {ny, nx};
+  int dist = nx*ny;
+  // slices of the vectors keep the SIMD alignment of the planning arrays only if a slice is a multiple of 64 bytes
+  unsigned flags = (plan_once ? FFTW_PATIENT : FFTW_ESTIMATE) | (dist % 8 ? FFTW_UNALIGNED : 0);
+
+  std::unique_lock<std::mutex> planner_lock(fftw_planner_mutex);
+  auto in = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex)*dist*batch);
+  auto out = in_place ? in : (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex)*dist*batch);
+  fftwf_plan p = nullptr;
+  if (plan_once) 
+    p = fftwf_plan_many_dft(2, dims, batch, in, NULL, 1, dist, out, NULL, 1, dist, direction, flags | FFTW_WISDOM_ONLY);
+  bool tuned = plan_once && p == nullptr;
+  if (p == nullptr)
+    p = fftwf_plan_many_dft(2, dims, batch, in, NULL, 1, dist, out, NULL, 1, dist, direction, flags);
+  if (!in_place) fftwf_free(out);
+  fftwf_free(in);
+  planner_lock.unlock();
+
+  auto plan = std::shared_ptr<fftwf_plan_s>(p, [](fftwf_plan p) {
+    std::lock_guard<std::mutex> planner_lock(fftw_planner_mutex);
+    fftwf_destroy_plan(p);
+  });
+  fftw_plans[key] = plan;
+
+  if (tuned) {
+    ++_wisdom_misses_;
+    export_fftw_wisdom();
+  }
+  return plan;
+};
+
+void FFTPlanCache::set_fftw_wisdom(const std::string& file, bool plan_once) {
+  std::map<Key, std::shared_ptr<fftwf_plan_s>> old_fftw;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::lock_guard<std::mutex> planner_lock(fftw_planner_mutex);
+    wisdom_file = file;
+    this->plan_once = plan_once;
+    // a missing file is not an error: the wisdom is created on the first export
+    if (FILE* f = file.empty() ? nullptr : std::fopen(file.c_str(), "r")) {
+      std::fclose(f);
+      if (!fftwf_import_wisdom_from_filename(file.c_str()))
+        throw std::runtime_error("Could not import FFTW wisdom from " + file);
+    }
+    old_fftw.swap(fftw_plans);
+  }
+};
+
+void FFTPlanCache::export_fftw_wisdom() {
+  std::lock_guard<std::mutex> planner_lock(fftw_planner_mutex);
+  if (wisdom_file.empty()) return;
+  // write next to the target and rename, so that concurrent jobs never read a partial file
+  std::string tmp = wisdom_file + ".tmp." + std::to_string(getpid());
+  if (!fftwf_export_wisdom_to_filename(tmp.c_str()) || std::rename(tmp.c_str(), wisdom_file.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    throw std::runtime_error("Could not export FFTW wisdom to " + wisdom_file);
+  }
+};
+
+size_t FFTPlanCache::size() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return cufft_plans.size() + fftw_plans.size();
+};
+
+void FFTPlanCache::clear() {
+  std::map<Key, std::shared_ptr<cuFFTPlan>> old_cufft;
+  std::map<Key, std::shared_ptr<fftwf_plan_s>> old_fftw;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    old_cufft.swap(cufft_plans);
+    old_fftw.swap(fftw_plans);
+  }
+  // the plans are released here, outside of the cache lock
+};
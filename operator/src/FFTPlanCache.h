@@ -0,0 +1,58 @@
+#pragma once
+#include <cufft.h>
+#include <cufftXt.h>
+#include <fftw3.h>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <complex_vector.h>
+
+// cuFFT plan with the orthonormal store callback attached; dims is the callback's (managed) argument
+struct cuFFTPlan {
+  cufftHandle handle;
+  int* dims;
+};
+
+// Process-wide cache of FFT plans keyed by the transform geometry, shared between the FFT operators.
+// cuFFT plans are also keyed by stream: a plan owns a single work area and cannot run on two streams at once.
+// FFTW plans are keyed by direction and by in-place/out-of-place, which FFTW plans separately.
+class FFTPlanCache {
+public:
+  static FFTPlanCache& instance();
+
+  std::shared_ptr<cuFFTPlan> get_cufft(int nx, int ny, int batch, cudaStream_t stream);
+  std::shared_ptr<fftwf_plan_s> get_fftw(int nx, int ny, int batch, int direction, bool in_place);
+
+  // Import FFTW wisdom from file (if it exists). With plan_once, FFTW plans are made with FFTW_PATIENT:
+  // geometries covered by the wisdom are planned instantly, new ones are tuned once and the wisdom
+  // is exported back to file. Already cached FFTW plans are dropped so later operators get tuned plans.
+  void set_fftw_wisdom(const std::string& file, bool plan_once = true);
+  // write the accumulated wisdom to the configured file
+  void export_fftw_wisdom();
+
+  size_t hits() const {return _hits_;};
+  size_t misses() const {return _misses_;};
+  // FFTW plans that had to be tuned because the wisdom did not cover them
+  size_t wisdom_misses() const {return _wisdom_misses_;};
+  size_t size();
+  // drop the cached plans; plans still held by operators are destroyed with the last of them
+  void clear();
+
+private:
+  FFTPlanCache() = default;
+  FFTPlanCache(const FFTPlanCache&) = delete;
+
+  // (NX, NY, batch, direction, backend, stream / in-place)
+  typedef std::tuple<int, int, int, int, Backend, size_t> Key;
+
+  std::mutex mutex;
+  std::map<Key, std::shared_ptr<cuFFTPlan>> cufft_plans;
+  std::map<Key, std::shared_ptr<fftwf_plan_s>> fftw_plans;
+  std::atomic<size_t> _hits_ = 0, _misses_ = 0, _wisdom_misses_ = 0;
+
+  std::string wisdom_file;
+  bool plan_once = false;
+};
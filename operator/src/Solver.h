@@ -0,0 +1,151 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <CudaOperator.h>
+
+// Iterative least-squares solvers for min ||A m - d||, running on the operator's resident vectors.
+// The data is copied in and the model copied out once per solve, not once per iteration.
+template <class M, class D>
+class Solver {
+public:
+	Solver(CudaOperator<M, D>* op, int niter, double tol = 0.) : op(op), niter(niter), tol(tol) {};
+	virtual ~Solver() = default;
+
+	// model holds the initial guess on input and the solution on output; returns the residual norm per iteration
+	virtual std::vector<double> run(complex_vector* model, const complex_vector* data) = 0;
+
+	// this is host-to-host function
+	std::vector<double> solve(std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
+		op->model_vec->upload(model->getVals());
+		op->data_vec->upload(data->getVals());
+		auto res = run(op->model_vec, op->data_vec);
+		op->model_vec->download(model->getVals());
+		return res;
+	};
+
+protected:
+	CudaOperator<M, D>* op;
+	int niter;
+	double tol;
+
+	bool converged(double res, double res0) {
+		return res0 == 0. || res / res0 <= tol;
+	};
+
+	static cuFloatComplex real(double a) {
+		return make_cuFloatComplex(float(a), 0.f);
+	};
+};
+
+// conjugate gradients on the normal equations
+template <class M, class D>
+class CGLS : public Solver<M, D> {
+public:
+	using Solver<M, D>::Solver;
+
+	std::vector<double> run(complex_vector* x, const complex_vector* b) {
+		auto op = this->op;
+		complex_vector* r = b->cloneSpace();
+		complex_vector* q = b->cloneSpace();
+		complex_vector* s = x->cloneSpace();
+		complex_vector* p = x->cloneSpace();
+
+		// r = b - A x
+		r->copy(b);
+		op->cu_forward(false, x, q);
+		r->axpy(this->real(-1.), q);
+		// p = s = A' r
+		op->cu_adjoint(false, s, r);
+		p->copy(s);
+		double gamma = std::real(s->dot(s));
+
+		std::vector<double> res = {r->norm()};
+		for (int iter = 0; iter < this->niter && !this->converged(res.back(), res[0]); ++iter) {
+			op->cu_forward(false, p, q);
+			double qq = std::real(q->dot(q));
+			if (qq == 0.) break;
+			double alpha = gamma / qq;
+			x->axpy(this->real(alpha), p);
+			r->axpy(this->real(-alpha), q);
+
+			op->cu_adjoint(false, s, r);
+			double gamma_new = std::real(s->dot(s));
+			// p = s + beta p
+			p->axpby(this->real(1.), s, this->real(gamma_new / gamma));
+			gamma = gamma_new;
+
+			res.push_back(r->norm());
+		}
+
+		free_complex_vector(r);
+		free_complex_vector(q);
+		free_complex_vector(s);
+		free_complex_vector(p);
+		return res;
+	};
+};
+
+// Paige & Saunders' LSQR (Golub-Kahan bidiagonalization); the residual norm is the running estimate phibar
+template <class M, class D>
+class LSQR : public Solver<M, D> {
+public:
+	using Solver<M, D>::Solver;
+
+	std::vector<double> run(complex_vector* x, const complex_vector* b) {
+		auto op = this->op;
+		complex_vector* u = b->cloneSpace();
+		complex_vector* v = x->cloneSpace();
+		complex_vector* w = x->cloneSpace();
+
+		// beta u = b - A x
+		u->copy(b);
+		u->scale(this->real(-1.));
+		op->cu_forward(true, x, u);
+		u->scale(this->real(-1.));
+		double beta = u->norm();
+		if (beta > 0.) u->scale(this->real(1. / beta));
+		// alpha v = A' u
+		op->cu_adjoint(false, v, u);
+		double alpha = v->norm();
+		if (alpha > 0.) v->scale(this->real(1. / alpha));
+		w->copy(v);
+
+		double phibar = beta;
+		double rhobar = alpha;
+
+		std::vector<double> res = {phibar};
+		for (int iter = 0; iter < this->niter && alpha > 0. && !this->converged(res.back(), res[0]); ++iter) {
+			// beta u = A v - alpha u
+			u->scale(this->real(-alpha));
+			op->cu_forward(true, v, u);
+			beta = u->norm();
+			if (beta > 0.) u->scale(this->real(1. / beta));
+
+			// alpha v = A' u - beta v
+			v->scale(this->real(-beta));
+			op->cu_adjoint(true, v, u);
+			alpha = v->norm();
+			if (alpha > 0.) v->scale(this->real(1. / alpha));
+
+			// plane rotation
+			double rho = std::hypot(rhobar, beta);
+			double c = rhobar / rho;
+			double s = beta / rho;
+			double theta = s * alpha;
+			rhobar = -c * alpha;
+			double phi = c * phibar;
+			phibar = s * phibar;
+
+			// x += phi/rho w, w = v - theta/rho w
+			x->axpy(this->real(phi / rho), w);
+			w->axpby(this->real(1.), v, this->real(-theta / rho));
+
+			res.push_back(phibar);
+		}
+
+		free_complex_vector(u);
+		free_complex_vector(v);
+		free_complex_vector(w);
+		return res;
+	};
+};
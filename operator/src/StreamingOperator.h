@@ -1,105 +1,77 @@
 #pragma once
 #include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
 #include <floatHyper.h>
 #include <complexHyper.h>
 #include <complex_vector.h>
 #include "CudaOperator.h"
 #include <cuda_runtime.h>
+#include <tbb/parallel_pipeline.h>
 
 using namespace SEP;
 
+struct StreamingOptions {
+	// axis the model and the data are chunked along (0 is the fastest); -1 is the last axis.
+	// For the (x,y,w,s) wavefields 2 streams frequencies and 3 streams sources.
+	int split_axis = -1;
+	// samples of the split axis per chunk; 0 spreads the axis evenly over the buffers
+	int chunk = 0;
+	// chunks in flight: 2 is double, 3 triple buffering
+	int nbuffers = 2;
+	Backend backend = Backend::DEVICE;
+};
+
+// Runs an operator chunk by chunk over host arrays that do not have to fit in device memory.
+// Every buffer slot owns an operator on its own stream, its device vectors and pinned staging
+// buffers, all allocated once. While one slot computes, the next one is being packed and
+// uploaded, and the previous one downloaded and unpacked. On the host backend the same
+// pack / compute / unpack stages run as a TBB pipeline.
 template <class Operator>
 class StreamingOperator : public CudaOperator<typename Operator::DomainType, typename Operator::RangeType>
 {
+	using M = typename Operator::DomainType;
+	using D = typename Operator::RangeType;
 public:
+	// builds the operator of one chunk, allocating its own vectors on the given stream
+	typedef std::function<std::unique_ptr<Operator>(const std::shared_ptr<hypercube>& domain,
+		const std::shared_ptr<hypercube>& range, cudaStream_t stream)> Factory;
 
-	StreamingOperator(const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>& range, 
-								dim3 grid=1, dim3 block=1, int nstreams = 1) 
-	: CudaOperator<typename Operator::DomainType, typename Operator::RangeType>(domain, range) {
-
-		auto ax = domain->getAxes();
-		// Calculate the base number of items per batch
-		int base = ax.back().n / nstreams;
-		// Calculate the remainder
-		int remainder = ax.back().n % nstreams;
-		// Create a vector to store the batches
-		std::vector<axis> last_axes;
-		for (int i=0; i < nstreams; ++i) {
-			float o = ax.back().o + i*base*ax.back().d;
-			last_axes.push_back(axis(base, o, ax.back().d));
-		}
-		// Distribute the remainder
-		for (int i = 0; i < remainder; ++i) {
-			last_axes[i].n++;
-			last_axes[i+1].o += last_axes[i].d;
-		}
-				
-		for (int i=0; i < nstreams; ++i) {
-			// create subrange hypercube 
-			ax.back() = last_axes[i];
-			subrange.push_back(std::make_shared<hypercube>(ax));
-			// and subdata
-			data_view.push_back(this->data_vec->make_view());
-			int offset = i * last_axes[i].n;
-			this->data_vec->view_at(data_view[i], offset);
-			// create a new stream
-			cudaStream_t s;
-			CHECK_CUDA_ERROR(cudaStreamCreate(&s));
-			stream.push_back(s);
-			// create operators
-			ops.push_back(Operator(domain, subrange[i], this->model_vec, data_view[i], grid, block, stream[i]));
-		}
-	}
-
-	StreamingOperator(const std::shared_ptr<hypercube>& domain, 
-								dim3 grid=1, dim3 block=1, int nstreams = 1) 
-	: CudaOperator<typename Operator::DomainType, typename Operator::DomainType>(domain, domain, nullptr, nullptr, grid, block) {
-				
-		auto ax = domain->getAxes();
-		// Calculate the base number of items per batch
-		int base = ax.back().n / nstreams;
-		// Calculate the remainder
-		int remainder = ax.back().n % nstreams;
-		// Create a vector to store the batches
-		std::vector<axis> last_axes;
-		for (int i=0; i < nstreams; ++i) {
-			float o = ax.back().o + i*base*ax.back().d;
-			last_axes.push_back(axis(base, o, ax.back().d));
-		}
-		// Distribute the remainder
-		for (int i = 0; i < remainder; ++i) {
-			last_axes[i].n++;
-			last_axes[i+1].o += last_axes[i].d;
-		}
-		
-		int start = 0;
-		int end = 0;
-		for (int i=0; i < nstreams; ++i) {
-			// create subrange hypercube 
-			ax.back() = last_axes[i];
-			auto subrange = std::make_shared<hypercube>(ax);
-			auto subdomain = std::make_shared<hypercube>(ax);
-			// and subdata
-			end += last_axes[i].n;
-			data_view.push_back(this->data_vec->make_view(start, end));
-			model_view.push_back(this->model_vec->make_view(start, end));
-			start = end;
-			// create a new stream
-			cudaStream_t s;
-			CHECK_CUDA_ERROR(cudaStreamCreate(&s));
-			stream.push_back(s);
-			// create operators
-			ops.push_back(std::make_unique<Operator>(subdomain, model_view[i], data_view[i], grid, block, stream[i]));
-		}
-	}
+	StreamingOperator(const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>& range,
+								Factory factory, StreamingOptions opts = StreamingOptions())
+	: CudaOperator<M, D>(domain, range, opts.backend) {
+		init(factory, opts);
+	};
+
+	// operators over a single space (e.g. the FFTs), built as Operator(domain, model, data, grid, block, stream)
+	StreamingOperator(const std::shared_ptr<hypercube>& domain, StreamingOptions opts,
+								dim3 grid=1, dim3 block=1)
+	: CudaOperator<M, D>(domain, domain, opts.backend, grid, block) {
+		init(default_factory(grid, block), opts);
+	};
+
+	// split the last axis over nstreams buffers
+	StreamingOperator(const std::shared_ptr<hypercube>& domain,
+								dim3 grid=1, dim3 block=1, int nstreams = 1)
+	: CudaOperator<M, D>(domain, domain, Backend::DEVICE, grid, block) {
+		StreamingOptions opts;
+		opts.nbuffers = nstreams;
+		init(default_factory(grid, block), opts);
+	};
 
 	~StreamingOperator() {
-		for (int i=0; i < stream.size(); ++i) {
-			CHECK_CUDA_ERROR(cudaStreamDestroy(stream[i]));
-			data_view[i]->~complex_vector();
-    	CHECK_CUDA_ERROR(cudaFree(data_view[i]));
-			model_view[i]->~complex_vector();
-    	CHECK_CUDA_ERROR(cudaFree(model_view[i]));
+		// the operators release their vectors on their streams
+		rem.reset();
+		for (auto& s : slots) s.op.reset();
+		for (auto& s : slots) {
+			if (this->_backend_ == Backend::HOST) continue;
+			CHECK_CUDA_ERROR(cudaEventDestroy(s.done));
+			CHECK_CUDA_ERROR(cudaStreamDestroy(s.stream));
+			CHECK_CUDA_ERROR(cudaFreeHost(s.model_stage));
+			CHECK_CUDA_ERROR(cudaFreeHost(s.data_stage));
 		}
 	};
 
@@ -110,68 +82,186 @@ public:
 		throw std::runtime_error("Should call the host forward function instead.");
 	};
 
-	void forward(bool add, std::shared_ptr<typename Operator::DomainType>& model, 
-						std::shared_ptr<typename Operator::RangeType>& data) {
-		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), this->getDomainSizeInBytes(), cudaHostRegisterDefault));
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), this->getRangeSizeInBytes(), cudaHostRegisterDefault));
-		if (!add) data->zero();
-		int offset = 0;
+	void forward(bool add, std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
+		run(true, add, reinterpret_cast<cuFloatComplex*>(model->getVals()), reinterpret_cast<cuFloatComplex*>(data->getVals()));
+	};
 
-		for (int i=0; i < stream.size(); ++i) {
+	void adjoint(bool add, std::shared_ptr<M>& model, std::shared_ptr<D>& data) {
+		run(false, add, reinterpret_cast<cuFloatComplex*>(data->getVals()), reinterpret_cast<cuFloatComplex*>(model->getVals()));
+	};
 
-			if (add) {
-				CHECK_CUDA_ERROR(cudaMemcpyAsync(data_view[i]->mat, data->getVals()+offset, ops[i]->getRangeSizeInBytes(), cudaMemcpyHostToDevice, stream[i]));
-			}
+	int get_nchunks() const {return chunks.size();};
+	int get_nbuffers() const {return slots.size();};
 
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(model_view[i]->mat, model->getVals()+offset, ops[i]->getDomainSizeInBytes(), cudaMemcpyHostToDevice, stream[i]));
+private:
+	// a chunk is a range of the split axis; in memory it is `outer` blocks of len*inner samples
+	struct Chunk {int start, len;};
+	struct Layout {size_t inner, n, outer;};
 
-			ops[i]->cu_forward(add, model_view[i], data_view[i]);
+	struct Slot {
+		std::unique_ptr<Operator> op;
+		cudaStream_t stream = 0;
+		cudaEvent_t done = nullptr;
+		// pinned, device backend only
+		cuFloatComplex *model_stage = nullptr, *data_stage = nullptr;
+		// chunk whose output has not been unpacked yet
+		int pending = -1;
+	};
 
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(data->getVals()+offset, data_view[i]->mat, ops[i]->getRangeSizeInBytes(), cudaMemcpyDeviceToHost, stream[i]));
-			
-			offset += ops[i]->getRangeSize();
-		}
+	std::vector<Chunk> chunks;
+	std::vector<Slot> slots;
+	// for the last, shorter chunk when the chunk size does not divide the axis
+	std::unique_ptr<Operator> rem;
+	Layout model_layout, data_layout;
+	int chunk_len;
 
-		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
-		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+	static Factory default_factory(dim3 grid, dim3 block) {
+		return [grid, block](const std::shared_ptr<hypercube>& domain, const std::shared_ptr<hypercube>&, cudaStream_t stream) {
+			return std::make_unique<Operator>(domain, nullptr, nullptr, grid, block, stream);
+		};
 	};
 
-	void adjoint(bool add, std::shared_ptr<typename Operator::DomainType>& model, 
-						std::shared_ptr<typename Operator::RangeType>& data) {
-		// pin the host memory
-		CHECK_CUDA_ERROR(cudaHostRegister(model->getVals(), this->getDomainSizeInBytes(), cudaHostRegisterDefault));
-		CHECK_CUDA_ERROR(cudaHostRegister(data->getVals(), this->getRangeSizeInBytes(), cudaHostRegisterDefault));
-		if (!add) model->zero();
-		int offset = 0;
+	static Layout layout(const std::vector<axis>& ax, int iax) {
+		Layout l = {1, size_t(ax[iax].n), 1};
+		for (int i=0; i < iax; ++i) l.inner *= ax[i].n;
+		for (int i=iax+1; i < int(ax.size()); ++i) l.outer *= ax[i].n;
+		return l;
+	};
 
-		for (int i=0; i < stream.size(); ++i) {
+	static std::shared_ptr<hypercube> sub_hyper(std::vector<axis> ax, int iax, const Chunk& c) {
+		ax[iax] = axis(c.len, ax[iax].o + c.start*ax[iax].d, ax[iax].d);
+		return std::make_shared<hypercube>(ax);
+	};
 
-			if (add) {
-				CHECK_CUDA_ERROR(cudaMemcpyAsync(model_view[i]->mat, model->getVals()+offset, ops[i]->getDomainSizeInBytes(), cudaMemcpyHostToDevice, stream[i]));
+	void init(const Factory& factory, StreamingOptions opts) {
+		auto dom_ax = this->_domain->getAxes();
+		auto rng_ax = this->_range->getAxes();
+		int iax = opts.split_axis < 0 ? int(dom_ax.size()) - 1 : opts.split_axis;
+		if (iax >= int(dom_ax.size()) || iax >= int(rng_ax.size()) || dom_ax[iax].n != rng_ax[iax].n)
+			throw std::runtime_error("StreamingOperator: the model and the data must share the split axis.");
+		if (opts.nbuffers < 1) throw std::runtime_error("StreamingOperator: nbuffers must be positive.");
+
+		model_layout = layout(dom_ax, iax);
+		data_layout = layout(rng_ax, iax);
+		int n = dom_ax[iax].n;
+		chunk_len = opts.chunk > 0 ? std::min(opts.chunk, n) : (n + opts.nbuffers - 1) / opts.nbuffers;
+		for (int start = 0; start < n; start += chunk_len)
+			chunks.push_back({start, std::min(chunk_len, n - start)});
+
+		// no more buffers than chunks
+		slots.resize(std::min<int>(opts.nbuffers, chunks.size()));
+		for (auto& s : slots) {
+			if (this->_backend_ == Backend::DEVICE) {
+				CHECK_CUDA_ERROR(cudaStreamCreate(&s.stream));
+				CHECK_CUDA_ERROR(cudaEventCreateWithFlags(&s.done, cudaEventDisableTiming));
+				CHECK_CUDA_ERROR(cudaMallocHost((void**)&s.model_stage, chunk_bytes(model_layout, chunk_len)));
+				CHECK_CUDA_ERROR(cudaMallocHost((void**)&s.data_stage, chunk_bytes(data_layout, chunk_len)));
 			}
+			s.op = factory(sub_hyper(dom_ax, iax, chunks[0]), sub_hyper(rng_ax, iax, chunks[0]), s.stream);
+			if (s.op->getBackend() != this->_backend_)
+				throw std::runtime_error("StreamingOperator: the chunk operator runs on a different backend.");
+		}
+		const Chunk& last = chunks.back();
+		if (last.len != chunk_len) {
+			const Slot& s = slots[(chunks.size() - 1) % slots.size()];
+			rem = factory(sub_hyper(dom_ax, iax, last), sub_hyper(rng_ax, iax, last), s.stream);
+		}
+	};
 
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(data_view[i]->mat, data->getVals()+offset, ops[i]->getRangeSizeInBytes(), cudaMemcpyHostToDevice, stream[i]));
+	static size_t chunk_bytes(const Layout& l, int len) {
+		return sizeof(cuFloatComplex) * l.inner * len * l.outer;
+	};
 
-			ops[i]->cu_adjoint(add, model_view[i], data_view[i]);
+	Operator* chunk_op(int c) {
+		return chunks[c].len == chunk_len ? slots[c % slots.size()].op.get() : rem.get();
+	};
 
-			CHECK_CUDA_ERROR(cudaMemcpyAsync(model->getVals()+offset, model_view[i]->mat, ops[i]->getDomainSizeInBytes(), cudaMemcpyDeviceToHost, stream[i]));
-			
-			offset += ops[i]->getDomainSize();
-		}
+	// full array <-> packed chunk
+	static void pack(cuFloatComplex* dst, const cuFloatComplex* full, const Layout& l, const Chunk& c) {
+		size_t block = l.inner * c.len;
+		for (size_t o=0; o < l.outer; ++o)
+			std::memcpy(dst + o*block, full + (o*l.n + c.start)*l.inner, sizeof(cuFloatComplex)*block);
+	};
+	static void unpack(cuFloatComplex* full, const cuFloatComplex* src, const Layout& l, const Chunk& c) {
+		size_t block = l.inner * c.len;
+		for (size_t o=0; o < l.outer; ++o)
+			std::memcpy(full + (o*l.n + c.start)*l.inner, src + o*block, sizeof(cuFloatComplex)*block);
+	};
 
-		CHECK_CUDA_ERROR(cudaDeviceSynchronize());
-		// unpin the memory
-		CHECK_CUDA_ERROR(cudaHostUnregister(model->getVals()));
-		CHECK_CUDA_ERROR(cudaHostUnregister(data->getVals()));
+	void apply(Operator* op, bool fwd, bool add) {
+		if (fwd) op->cu_forward(add, op->model_vec, op->data_vec);
+		else op->cu_adjoint(add, op->model_vec, op->data_vec);
 	};
 
-private:
-	std::vector<cudaStream_t> stream;
-	std::vector<std::unique_ptr<Operator>> ops;
-	std::vector<hypercube> subrange, subdomain;
-	std::vector<complex_vector*> data_view, model_view;
-};
+	// in/out are the model/data (forward) or data/model (adjoint) arrays
+	void run(bool fwd, bool add, cuFloatComplex* in, cuFloatComplex* out) {
+		const Layout& in_l = fwd ? model_layout : data_layout;
+		const Layout& out_l = fwd ? data_layout : model_layout;
+		if (this->_backend_ == Backend::HOST) run_host(fwd, add, in, out, in_l, out_l);
+		else run_device(fwd, add, in, out, in_l, out_l);
+	};
+
+	void run_device(bool fwd, bool add, cuFloatComplex* in, cuFloatComplex* out, const Layout& in_l, const Layout& out_l) {
+		auto finish = [&](Slot& s) {
+			CHECK_CUDA_ERROR(cudaEventSynchronize(s.done));
+			unpack(out, fwd ? s.data_stage : s.model_stage, out_l, chunks[s.pending]);
+			s.pending = -1;
+		};
+
+		for (int c=0; c < int(chunks.size()); ++c) {
+			Slot& s = slots[c % slots.size()];
+			// the slot is free once its previous chunk is back on the host
+			if (s.pending >= 0) finish(s);
 
+			Operator* op = chunk_op(c);
+			complex_vector* vin = fwd ? op->model_vec : op->data_vec;
+			complex_vector* vout = fwd ? op->data_vec : op->model_vec;
+			cuFloatComplex* in_stage = fwd ? s.model_stage : s.data_stage;
+			cuFloatComplex* out_stage = fwd ? s.data_stage : s.model_stage;
+
+			pack(in_stage, in, in_l, chunks[c]);
+			CHECK_CUDA_ERROR(cudaMemcpyAsync(vin->mat, in_stage, sizeof(cuFloatComplex)*vin->nelem, cudaMemcpyHostToDevice, s.stream));
+			if (add) {
+				pack(out_stage, out, out_l, chunks[c]);
+				CHECK_CUDA_ERROR(cudaMemcpyAsync(vout->mat, out_stage, sizeof(cuFloatComplex)*vout->nelem, cudaMemcpyHostToDevice, s.stream));
+			}
+			apply(op, fwd, add);
+			CHECK_CUDA_ERROR(cudaMemcpyAsync(out_stage, vout->mat, sizeof(cuFloatComplex)*vout->nelem, cudaMemcpyDeviceToHost, s.stream));
+			CHECK_CUDA_ERROR(cudaEventRecord(s.done, s.stream));
+			s.pending = c;
+		}
+		// drain in chunk order
+		for (int c=std::max<int>(0, chunks.size() - slots.size()); c < int(chunks.size()); ++c)
+			finish(slots[c % slots.size()]);
+	};
+
+	// at most nbuffers chunks in flight and in-order pack/unpack, so chunk c can reuse the
+	// buffers of chunk c - nbuffers
+	void run_host(bool fwd, bool add, cuFloatComplex* in, cuFloatComplex* out, const Layout& in_l, const Layout& out_l) {
+		int next = 0;
+		tbb::parallel_pipeline(slots.size(),
+			tbb::make_filter<void, int>(tbb::filter_mode::serial_in_order,
+				[&](tbb::flow_control& fc) -> int {
+					if (next == int(chunks.size())) {
+						fc.stop();
+						return -1;
+					}
+					int c = next++;
+					Operator* op = chunk_op(c);
+					pack((fwd ? op->model_vec : op->data_vec)->mat, in, in_l, chunks[c]);
+					if (add) pack((fwd ? op->data_vec : op->model_vec)->mat, out, out_l, chunks[c]);
+					return c;
+				}) &
+			tbb::make_filter<int, int>(tbb::filter_mode::parallel,
+				[&](int c) -> int {
+					apply(chunk_op(c), fwd, add);
+					return c;
+				}) &
+			tbb::make_filter<int, void>(tbb::filter_mode::serial_in_order,
+				[&](int c) {
+					Operator* op = chunk_op(c);
+					unpack(out, (fwd ? op->data_vec : op->model_vec)->mat, out_l, chunks[c]);
+				})
+		);
+	};
+};
@@ -0,0 +1,93 @@
+#include <Workspace.h>
+#include <algorithm>
+#include <tuple>
+
+namespace {
+  size_t size_in_bytes(const complex_vector* vec) {
+    return sizeof(cuFloatComplex) * vec->nelem;
+  }
+}
+
+Workspace::~Workspace() {
+  trim();
+};
+
+std::shared_ptr<Workspace> Workspace::shared(Backend backend, cudaStream_t stream) {
+  static std::mutex registry_mutex;
+  static std::map<std::tuple<Backend, cudaStream_t>, std::weak_ptr<Workspace>> registry;
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  auto& entry = registry[{backend, stream}];
+  auto ws = entry.lock();
+  if (!ws) {
+    ws = std::make_shared<Workspace>(backend, stream);
+    entry = ws;
+  }
+  return ws;
+};
+
+complex_vector* Workspace::acquire(const std::shared_ptr<hypercube>& hyper, dim3 grid, dim3 block) {
+  size_t nelem = hyper->getN123();
+  complex_vector* vec = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find_if(idle.begin(), idle.end(), [&](complex_vector* v) {return size_t(v->nelem) == nelem;});
+    if (it != idle.end()) {
+      vec = *it;
+      idle.erase(it);
+    }
+  }
+
+  if (vec == nullptr) {
+    vec = make_complex_vector(hyper, _backend_, grid, block, _stream_);
+    std::lock_guard<std::mutex> lock(mutex);
+    held_bytes += size_in_bytes(vec);
+  }
+  else {
+    // same size, possibly different shape
+    vec->ndim = hyper->getNdim();
+    for (int i=0; i < vec->ndim; ++i) {
+      vec->n[i] = hyper->getAxis(i+1).n;
+      vec->d[i] = hyper->getAxis(i+1).d;
+      vec->o[i] = hyper->getAxis(i+1).o;
+    }
+    vec->set_grid_block(grid, block);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  live_bytes += size_in_bytes(vec);
+  _peak_ = std::max(_peak_, live_bytes);
+  return vec;
+};
+
+void Workspace::release(complex_vector* vec) {
+  if (vec == nullptr) return;
+  std::lock_guard<std::mutex> lock(mutex);
+  live_bytes -= size_in_bytes(vec);
+  idle.push_back(vec);
+};
+
+size_t Workspace::bytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return held_bytes;
+};
+
+size_t Workspace::peak_bytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _peak_;
+};
+
+void Workspace::reset_peak() {
+  std::lock_guard<std::mutex> lock(mutex);
+  _peak_ = live_bytes;
+};
+
+void Workspace::trim() {
+  std::vector<complex_vector*> old;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    old.swap(idle);
+    for (auto vec : old) held_bytes -= size_in_bytes(vec);
+  }
+  for (auto vec : old) free_complex_vector(vec);
+};
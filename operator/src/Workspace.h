@@ -0,0 +1,37 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <complex_vector.h>
+
+// Scratch vectors shared by the operators working on one stream. A buffer is held only for the
+// lifetime of a computation (acquire ... release) and is then handed to the next request of the
+// same size, so the footprint is the peak number of simultaneously live scratch vectors rather
+// than one set per operator. Work on a single stream is ordered, so recycling needs no sync.
+class Workspace {
+public:
+  Workspace(Backend backend = Backend::DEVICE, cudaStream_t stream = 0) : _backend_(backend), _stream_(stream) {};
+  ~Workspace();
+
+  // the workspace shared by all the operators on (backend, stream)
+  static std::shared_ptr<Workspace> shared(Backend backend, cudaStream_t stream);
+
+  complex_vector* acquire(const std::shared_ptr<hypercube>& hyper, dim3 grid = 1, dim3 block = 1);
+  void release(complex_vector* vec);
+
+  // bytes of scratch held (live and idle) and the peak of the live ones
+  size_t bytes();
+  size_t peak_bytes();
+  void reset_peak();
+  // free the idle buffers
+  void trim();
+
+private:
+  Backend _backend_;
+  cudaStream_t _stream_;
+
+  std::mutex mutex;
+  std::vector<complex_vector*> idle;
+  size_t live_bytes = 0, held_bytes = 0, _peak_ = 0;
+};
@@ -1,62 +1,269 @@
 #include <complex_vector.h>
 #include <complex_vector.cuh>
+#include <complex_vector_host.h>
+#include <vector_expr.h>
 #include <iostream>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cmath>
+
+namespace {
+  // host buffers are 64-byte aligned so that FFTW and the vectorized loops get full-width access
+  void* host_alloc(size_t bytes) {
+    size_t align = 64;
+    void* ptr = std::aligned_alloc(align, (bytes + align - 1) / align * align);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+  }
+
+  // Recycles vector structs and data buffers so that views and scratch vectors do not go to the
+  // system allocator. Structs are carved out of slabs (managed memory for device vectors, since
+  // kernels read them); data buffers are kept per exact byte size, as scratch vectors are
+  // recreated with the same geometry. Index 0 is the device, 1 the host.
+  class VectorPool {
+  public:
+    complex_vector* get_struct(bool on_host) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto& structs = free_structs[on_host];
+      if (structs.empty()) {
+        complex_vector* slab;
+        if (on_host) slab = static_cast<complex_vector*>(host_alloc(sizeof(complex_vector) * SLAB));
+        else CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&slab), sizeof(complex_vector) * SLAB));
+        ++allocations;
+        for (int i = SLAB-1; i >= 0; --i) structs.push_back(slab + i);
+      }
+      complex_vector* vec = structs.back();
+      structs.pop_back();
+      return vec;
+    }
+
+    void put_struct(complex_vector* vec) {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_structs[vec->on_host].push_back(vec);
+    }
+
+    cuFloatComplex* get_data(size_t bytes, bool on_host) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = free_data[on_host].find(bytes);
+        if (it != free_data[on_host].end() && !it->second.empty()) {
+          cuFloatComplex* ptr = it->second.back();
+          it->second.pop_back();
+          cached_bytes[on_host] -= bytes;
+          return ptr;
+        }
+        ++allocations;
+      }
+      cuFloatComplex* ptr;
+      if (on_host) ptr = static_cast<cuFloatComplex*>(host_alloc(bytes));
+      else CHECK_CUDA_ERROR(cudaMalloc(reinterpret_cast<void **>(&ptr), bytes));
+      return ptr;
+    }
+
+    void put_data(cuFloatComplex* ptr, size_t bytes, bool on_host) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cached_bytes[on_host] + bytes <= limit) {
+          free_data[on_host][bytes].push_back(ptr);
+          cached_bytes[on_host] += bytes;
+          return;
+        }
+      }
+      release(ptr, on_host);
+    }
+
+    void trim() {
+      std::unordered_map<size_t, std::vector<cuFloatComplex*>> old[2];
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i=0; i < 2; ++i) {
+          old[i].swap(free_data[i]);
+          cached_bytes[i] = 0;
+        }
+      }
+      for (int i=0; i < 2; ++i)
+        for (auto& bucket : old[i])
+          for (auto ptr : bucket.second) release(ptr, i);
+    }
+
+    void set_limit(size_t bytes) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = bytes;
+      }
+      trim();
+    }
+
+    std::atomic<size_t> allocations = 0;
+
+  private:
+    static constexpr int SLAB = 64;
+
+    std::mutex mutex;
+    std::vector<complex_vector*> free_structs[2];
+    std::unordered_map<size_t, std::vector<cuFloatComplex*>> free_data[2];
+    size_t cached_bytes[2] = {0, 0};
+    size_t limit = size_t(1) << 30;
+
+    static void release(cuFloatComplex* ptr, bool on_host) {
+      if (on_host) std::free(ptr);
+      else CHECK_CUDA_ERROR(cudaFree(ptr));
+    }
+  };
+
+  // never destroyed: vectors may be freed during static destruction
+  VectorPool& pool() {
+    static VectorPool* pool = new VectorPool;
+    return *pool;
+  }
+
+  complex_vector* new_vector(int ndim, bool on_host) {
+    if (ndim > complex_vector::MAX_NDIM) 
+      throw std::runtime_error("complex_vector supports up to " + std::to_string(complex_vector::MAX_NDIM) + " dimensions");
+    complex_vector* vec = new (pool().get_struct(on_host)) complex_vector();
+    vec->on_host = on_host;
+    vec->ndim = ndim;
+    return vec;
+  }
+
+  void alloc_data(complex_vector* vec) {
+    vec->mat = pool().get_data(sizeof(cuFloatComplex) * vec->nelem, vec->on_host);
+    vec->allocated = true;
+  }
+}
 
 complex_vector* make_complex_vector(const std::shared_ptr<hypercube>& hyper, dim3 grid, dim3 block, cudaStream_t stream) {
-  complex_vector* vec;
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec), sizeof(complex_vector)));
+  complex_vector* vec = new_vector(hyper->getNdim(), false);
 
   vec->set_grid_block(grid, block);
   vec->stream = stream;
 
-  int nelem = vec->nelem = hyper->getN123();
-  int ndim = vec->ndim = hyper->getNdim();
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->n), sizeof(int) * ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->d), sizeof(float) * ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->o), sizeof(float) * ndim));
-  CHECK_CUDA_ERROR(cudaMalloc(reinterpret_cast<void **>(&vec->mat), sizeof(cuFloatComplex) * nelem));
+  vec->nelem = hyper->getN123();
+  for (int i=0; i < vec->ndim; ++i) {
+    vec->n[i] = hyper->getAxis(i+1).n;
+    vec->d[i] = hyper->getAxis(i+1).d;
+    vec->o[i] = hyper->getAxis(i+1).o;
+  }
+  alloc_data(vec);
 
-  for (int i=0; i < ndim; ++i) {
+  return vec;
+};
+
+complex_vector* make_host_complex_vector(const std::shared_ptr<hypercube>& hyper) {
+  complex_vector* vec = new_vector(hyper->getNdim(), true);
+
+  vec->nelem = hyper->getN123();
+  for (int i=0; i < vec->ndim; ++i) {
     vec->n[i] = hyper->getAxis(i+1).n;
     vec->d[i] = hyper->getAxis(i+1).d;
     vec->o[i] = hyper->getAxis(i+1).o;
   }
-  vec->allocated = true;
+  alloc_data(vec);
 
   return vec;
 };
 
-complex_vector* complex_vector::cloneSpace() {
-  complex_vector* vec;
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec), sizeof(complex_vector)));
+complex_vector* make_complex_vector(const std::shared_ptr<hypercube>& hyper, Backend backend, dim3 grid, dim3 block, cudaStream_t stream) {
+  if (backend == Backend::HOST) return make_host_complex_vector(hyper);
+  return make_complex_vector(hyper, grid, block, stream);
+};
+
+void free_complex_vector(complex_vector* vec) {
+  if (vec == nullptr) return;
+  // kernels queued on the vector's stream may still use the struct or the data 
+  if (!vec->on_host) CHECK_CUDA_ERROR(cudaStreamSynchronize(vec->stream));
+  if (vec->allocated) pool().put_data(vec->mat, sizeof(cuFloatComplex) * vec->nelem, vec->on_host);
+  vec->allocated = false;
+  pool().put_struct(vec);
+};
+
+size_t complex_vector_allocations() {
+  return pool().allocations;
+};
+
+void set_complex_vector_pool_limit(size_t bytes) {
+  pool().set_limit(bytes);
+};
+
+void trim_complex_vector_pool() {
+  pool().trim();
+};
+
+void complex_vector::zero() {
+  if (on_host) std::memset(mat, 0, sizeof(cuFloatComplex)*nelem);
+  else CHECK_CUDA_ERROR(cudaMemset(mat, 0, sizeof(cuFloatComplex)*nelem));
+};
+
+complex_vector* complex_vector::cloneSpace() const {
+  complex_vector* vec = new_vector(ndim, on_host);
 
   vec->set_grid_block(this->_grid_, this->_block_);
   vec->stream = stream;
 
-  int nelem = vec->nelem = this->nelem;
-  int ndim = vec->ndim = this->ndim;
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->n), sizeof(int) * ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->d), sizeof(float) * ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&vec->o), sizeof(float) * ndim));
-  CHECK_CUDA_ERROR(cudaMalloc(reinterpret_cast<void **>(&vec->mat), sizeof(cuFloatComplex) * nelem));
-
+  vec->nelem = this->nelem;
   for (int i=0; i < ndim; ++i) {
     vec->n[i] = this->n[i];
     vec->d[i] = this->d[i];
     vec->o[i] = this->o[i];
   }
-  vec->allocated = true;
+  alloc_data(vec);
 
   return vec;
 };
 
 void complex_vector::add(complex_vector* vec){
-  launch_add(this, vec, _grid_, _block_, this->stream);
+  if (on_host) host_add(this, vec);
+  else launch_add(this, vec, _grid_, _block_, this->stream);
 }
 
+std::complex<double> complex_vector::dot(const complex_vector* vec) const {
+  if (on_host) return host_dot(this, vec);
+  return launch_dot(this, vec, _grid_, _block_, stream);
+};
+
+double complex_vector::norm() const {
+  return std::sqrt(std::real(dot(this)));
+};
+
+void complex_vector::axpy(cuFloatComplex alpha, const complex_vector* vec) {
+  if (on_host) host_axpy(this, alpha, vec);
+  else launch_axpy(this, alpha, vec, _grid_, _block_, stream);
+};
+
+void complex_vector::axpby(cuFloatComplex alpha, const complex_vector* vec, cuFloatComplex beta) {
+  if (on_host) expr::assign(this, alpha * expr::ref(vec) + beta * expr::ref(this));
+  else launch_axpby(this, alpha, vec, beta, _grid_, _block_, stream);
+};
+
+void complex_vector::scale(cuFloatComplex alpha) {
+  if (on_host) host_scale(this, alpha);
+  else launch_scale(this, alpha, _grid_, _block_, stream);
+};
+
+void complex_vector::copy(const complex_vector* vec) {
+  if (on_host) std::memcpy(mat, vec->mat, sizeof(cuFloatComplex)*nelem);
+  else CHECK_CUDA_ERROR(cudaMemcpyAsync(mat, vec->mat, sizeof(cuFloatComplex)*nelem, cudaMemcpyDeviceToDevice, stream));
+};
+
+void complex_vector::upload(const void* src) {
+  if (on_host) std::memcpy(mat, src, sizeof(cuFloatComplex)*nelem);
+  else CHECK_CUDA_ERROR(cudaMemcpyAsync(mat, src, sizeof(cuFloatComplex)*nelem, cudaMemcpyHostToDevice, stream));
+};
+
+void complex_vector::download(void* dst) const {
+  if (on_host) std::memcpy(dst, mat, sizeof(cuFloatComplex)*nelem);
+  else {
+    CHECK_CUDA_ERROR(cudaMemcpyAsync(dst, mat, sizeof(cuFloatComplex)*nelem, cudaMemcpyDeviceToHost, stream));
+    CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+  }
+};
+
 complex_vector*  complex_vector::make_view(int start, int end) {
-  complex_vector* view;
-  CHECK_CUDA_ERROR(cudaMallocManaged(&view, sizeof(complex_vector)));
+  complex_vector* view = new_vector(ndim, on_host);
 
   view->set_grid_block(_grid_, _block_);
   view->set_stream(stream);
@@ -71,10 +278,6 @@ complex_vector*  complex_vector::make_view(int start, int end) {
   }
   view->nelem *= end - start; // Account for the range of slices
 
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&view->n), sizeof(int) * view->ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&view->d), sizeof(float) * view->ndim));
-  CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&view->o), sizeof(float) * view->ndim));
-
   // Copy dimensions, adjusting the slowest dimension
   for (int i = 0; i < view->ndim - 1; ++i) {
     view->n[i] = this->n[i];
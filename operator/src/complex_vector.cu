@@ -1,5 +1,6 @@
 #include <complex_vector.h>
 #include <cuComplex.h>
+#include <vector_expr.cuh>
 
 __global__ void add(cuFloatComplex* vec1, cuFloatComplex* vec2, int N) {
 
@@ -13,3 +14,73 @@ void launch_add(complex_vector* vec1, complex_vector* vec2, dim3 grid, dim3 bloc
   add<<<grid, block, 0, stream>>>(vec1->mat, vec2->mat, vec1->nelem);
 };
 
+
+// block-wise tree reduction of conj(vec1) * vec2, one atomic per block
+__global__ void dot(const cuFloatComplex* __restrict__ vec1, const cuFloatComplex* __restrict__ vec2, int N, double2* result) {
+  extern __shared__ double2 partial[];
+
+  int i0 = threadIdx.x + blockDim.x*blockIdx.x;
+  int j = blockDim.x * gridDim.x;
+
+  double re = 0., im = 0.;
+  for (int i=i0; i < N; i += j) {
+    cuFloatComplex a = vec1[i];
+    cuFloatComplex b = vec2[i];
+    re += double(a.x) * b.x + double(a.y) * b.y;
+    im += double(a.x) * b.y - double(a.y) * b.x;
+  }
+  partial[threadIdx.x] = make_double2(re, im);
+  __syncthreads();
+
+  for (int s = 1; s < blockDim.x; s *= 2) {
+    int t = 2 * s * threadIdx.x;
+    if (t + s < blockDim.x) {
+      partial[t].x += partial[t+s].x;
+      partial[t].y += partial[t+s].y;
+    }
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0) {
+    atomicAdd(&result->x, partial[0].x);
+    atomicAdd(&result->y, partial[0].y);
+  }
+};
+std::complex<double> launch_dot(const complex_vector* vec1, const complex_vector* vec2, dim3 grid, dim3 block, cudaStream_t stream) {
+  // one result slot per host thread, reused across calls
+  thread_local double2* result = nullptr;
+  if (result == nullptr) CHECK_CUDA_ERROR(cudaMallocManaged(reinterpret_cast<void **>(&result), sizeof(double2)));
+
+  CHECK_CUDA_ERROR(cudaMemsetAsync(result, 0, sizeof(double2), stream));
+  dot<<<grid, block, sizeof(double2) * block.x, stream>>>(vec1->mat, vec2->mat, vec1->nelem, result);
+  CHECK_CUDA_ERROR(cudaStreamSynchronize(stream));
+  return {result->x, result->y};
+};
+
+__global__ void axpy(cuFloatComplex* vec1, cuFloatComplex alpha, const cuFloatComplex* vec2, int N) {
+
+  int i0 = threadIdx.x + blockDim.x*blockIdx.x;
+  int j = blockDim.x * gridDim.x;
+
+  for (int i=i0; i < N; i += j)
+    vec1[i] = cuCfmaf(alpha, vec2[i], vec1[i]);
+};
+void launch_axpy(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2, dim3 grid, dim3 block, cudaStream_t stream) {
+  axpy<<<grid, block, 0, stream>>>(vec1->mat, alpha, vec2->mat, vec1->nelem);
+};
+
+void launch_axpby(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2, cuFloatComplex beta, dim3 grid, dim3 block, cudaStream_t stream) {
+  expr::launch_expr(vec1, alpha * expr::ref(vec2) + beta * expr::ref(vec1), false, grid, block, stream);
+};
+
+__global__ void scale(cuFloatComplex* vec, cuFloatComplex alpha, int N) {
+
+  int i0 = threadIdx.x + blockDim.x*blockIdx.x;
+  int j = blockDim.x * gridDim.x;
+
+  for (int i=i0; i < N; i += j)
+    vec[i] = cuCmulf(alpha, vec[i]);
+};
+void launch_scale(complex_vector* vec, cuFloatComplex alpha, dim3 grid, dim3 block, cudaStream_t stream) {
+  scale<<<grid, block, 0, stream>>>(vec->mat, alpha, vec->nelem);
+};
@@ -3,3 +3,8 @@
 
 __global__ void add(complex_vector* vec1, complex_vector* vec2);
 void launch_add(complex_vector* vec1, complex_vector* vec2, dim3 grid, dim3 block, cudaStream_t stream);
+
+std::complex<double> launch_dot(const complex_vector* vec1, const complex_vector* vec2, dim3 grid, dim3 block, cudaStream_t stream);
+void launch_axpy(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2, dim3 grid, dim3 block, cudaStream_t stream);
+void launch_axpby(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2, cuFloatComplex beta, dim3 grid, dim3 block, cudaStream_t stream);
+void launch_scale(complex_vector* vec, cuFloatComplex alpha, dim3 grid, dim3 block, cudaStream_t stream);
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <cuComplex.h>
 #include <unordered_map>
+#include <cstdlib>
 
 // thanks to Google's AI Bard
 #define ND_TO_FLAT(idx, dims) ( \
@@ -31,13 +32,20 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort=t
 
 using namespace SEP;
 
+// where the data of a vector (and the operator working on it) lives
+enum class Backend { DEVICE, HOST };
+
 typedef struct complex_vector
 {
+    // axis metadata is stored inline, so a vector (or a view) is a single pooled allocation
+    static constexpr int MAX_NDIM = 7;
+
     cuFloatComplex* mat;
     bool allocated = false;
-    int* n;
-    float* d;
-    float* o;
+    bool on_host = false;
+    int n[MAX_NDIM];
+    float d[MAX_NDIM];
+    float o[MAX_NDIM];
     int nelem, ndim;
     // for kernels
     dim3 _grid_, _block_;
@@ -52,33 +60,48 @@ typedef struct complex_vector
       this->stream = stream;
     }
 
-    void zero() {
-      CHECK_CUDA_ERROR(cudaMemset(mat, 0, sizeof(cuFloatComplex)*nelem));
-    }
+    void zero();
 
-    complex_vector* cloneSpace();
+    complex_vector* cloneSpace() const;
 
     void add(complex_vector* vec);
 
+    // linear algebra for the iterative solvers; the reductions return on the host
+    // <this, vec> = sum conj(this) * vec, accumulated in double
+    std::complex<double> dot(const complex_vector* vec) const;
+    double norm() const;
+    // this += alpha * vec
+    void axpy(cuFloatComplex alpha, const complex_vector* vec);
+    // this = alpha * vec + beta * this, in one pass
+    void axpby(cuFloatComplex alpha, const complex_vector* vec, cuFloatComplex beta);
+    void scale(cuFloatComplex alpha);
+    void copy(const complex_vector* vec);
+    // from/to a host array (e.g. the values of a complexNDReg)
+    void upload(const void* src);
+    void download(void* dst) const;
+
     complex_vector* make_view(int start, int end);
     // const complex_vector* make_const_view();
 
     // to slice the multi-d array along the last axis and return (ndim-1)-d array
     // void view_at(complex_vector* view, int index);
     // void view_at(const complex_vector* view, int index);
-
-    ~complex_vector() {
-      if (allocated) {
-        CHECK_CUDA_ERROR(cudaFree(mat));
-        allocated = false;
-      }
-      CHECK_CUDA_ERROR(cudaFree(n)); 
-      CHECK_CUDA_ERROR(cudaFree(d));
-      CHECK_CUDA_ERROR(cudaFree(o));
-    };
 } complex_vector;
 
 complex_vector* make_complex_vector(const std::shared_ptr<hypercube>& hyper, dim3 grid=1, dim3 block=1, cudaStream_t stream = 0);
+// same as above but the data lives in (64-byte aligned) host memory
+complex_vector* make_host_complex_vector(const std::shared_ptr<hypercube>& hyper);
+complex_vector* make_complex_vector(const std::shared_ptr<hypercube>& hyper, Backend backend, dim3 grid=1, dim3 block=1, cudaStream_t stream = 0);
+// destroy and release a vector created by any of the functions above (or a view);
+// the struct and the data buffer go back to the pool for reuse
+void free_complex_vector(complex_vector* vec);
+
+// number of system allocations (cudaMallocManaged / cudaMalloc / host) made by the vector pool so far
+size_t complex_vector_allocations();
+// cap on the bytes of data buffers the pool keeps for reuse (per backend); buffers beyond it are freed
+void set_complex_vector_pool_limit(size_t bytes);
+// free all cached data buffers
+void trim_complex_vector_pool();
 // create the view (only slice through last axis)
 complex_vector* make_view(complex_vector* parent);
 
@@ -0,0 +1,48 @@
+#include <complex_vector_host.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+
+void host_add(complex_vector* vec1, complex_vector* vec2) {
+  cuFloatComplex* __restrict__ v1 = vec1->mat;
+  const cuFloatComplex* __restrict__ v2 = vec2->mat;
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, vec1->nelem),
+    [=](const tbb::blocked_range<size_t>& r) {
+      for (size_t i = r.begin(); i < r.end(); ++i)
+        v1[i] = cuCaddf(v1[i], v2[i]);
+  });
+};
+
+std::complex<double> host_dot(const complex_vector* vec1, const complex_vector* vec2) {
+  const cuFloatComplex* __restrict__ v1 = vec1->mat;
+  const cuFloatComplex* __restrict__ v2 = vec2->mat;
+  return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, vec1->nelem), std::complex<double>(0.),
+    [=](const tbb::blocked_range<size_t>& r, std::complex<double> sum) {
+      double re = 0., im = 0.;
+      for (size_t i = r.begin(); i < r.end(); ++i) {
+        re += double(v1[i].x) * v2[i].x + double(v1[i].y) * v2[i].y;
+        im += double(v1[i].x) * v2[i].y - double(v1[i].y) * v2[i].x;
+      }
+      return sum + std::complex<double>(re, im);
+    },
+    std::plus<std::complex<double>>());
+};
+
+void host_axpy(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2) {
+  cuFloatComplex* __restrict__ v1 = vec1->mat;
+  const cuFloatComplex* __restrict__ v2 = vec2->mat;
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, vec1->nelem),
+    [=](const tbb::blocked_range<size_t>& r) {
+      for (size_t i = r.begin(); i < r.end(); ++i)
+        v1[i] = cuCfmaf(alpha, v2[i], v1[i]);
+  });
+};
+
+void host_scale(complex_vector* vec, cuFloatComplex alpha) {
+  cuFloatComplex* __restrict__ v = vec->mat;
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, vec->nelem),
+    [=](const tbb::blocked_range<size_t>& r) {
+      for (size_t i = r.begin(); i < r.end(); ++i)
+        v[i] = cuCmulf(alpha, v[i]);
+  });
+};
@@ -0,0 +1,8 @@
+#pragma once
+#include <complex_vector.h>
+
+// host (TBB) counterparts of the kernels in complex_vector.cu
+void host_add(complex_vector* vec1, complex_vector* vec2);
+std::complex<double> host_dot(const complex_vector* vec1, const complex_vector* vec2);
+void host_axpy(complex_vector* vec1, cuFloatComplex alpha, const complex_vector* vec2);
+void host_scale(complex_vector* vec, cuFloatComplex alpha);
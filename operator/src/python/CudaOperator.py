@@ -24,3 +24,19 @@ class cuFFT2d(CudaOperator):
 
 	
 
+
+class cpuFFT2d(Op.Operator):
+	def __init__(self,model,data):
+		self.setDomainRange(model,data)
+		self.cppMode = pyCudaOperator.cpuFFT2d(model.getHyper().cppMode)
+
+	def forward(self,add,model,data):
+		self.cppMode.forward(add, model.cppMode, data.cppMode)
+
+	def adjoint(self,add,model,data):
+		self.cppMode.adjoint(add, model.cppMode, data.cppMode)
+
+
+def set_fftw_wisdom(file, plan_once=True):
+	"""Persist FFTW wisdom in file; with plan_once the CPU FFT plans are tuned once and reused by later runs"""
+	pyCudaOperator.set_fftw_wisdom(file, plan_once)
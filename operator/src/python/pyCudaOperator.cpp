@@ -27,5 +27,26 @@ PYBIND11_MODULE(pyCudaOperator, clsOps) {
             cuFFT2d::adjoint,
             "Adjoint operator of cuFFT2d");
 
+  py::class_<cpuFFT2d, std::shared_ptr<cpuFFT2d>>(clsOps, "cpuFFT2d")
+      .def(py::init<std::shared_ptr<hypercube>&>(),
+          "Initialize cpuFFT2d")
+
+      .def("forward",
+            (void (cpuFFT2d::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
+            cpuFFT2d::forward,
+            "Forward operator of cpuFFT2d")
+
+      .def("adjoint",
+            (void (cpuFFT2d::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
+            cpuFFT2d::adjoint,
+            "Adjoint operator of cpuFFT2d");
+
+  clsOps.def("set_fftw_wisdom",
+            [](const std::string& file, bool plan_once) {
+              FFTPlanCache::instance().set_fftw_wisdom(file, plan_once);
+            },
+            py::arg("file"), py::arg("plan_once") = true,
+            "Import FFTW wisdom from file and tune new CPU FFT plans once, exporting them back to file");
+
 }
 
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector_expr.h>
+
+// device evaluation of the expressions in vector_expr.h; include in the .cu file that instantiates them
+
+namespace expr {
+
+  template <class E>
+  __global__ void eval_expr(cuFloatComplex* out, E e, int N, bool add) {
+
+    int i0 = threadIdx.x + blockDim.x*blockIdx.x;
+    int j = blockDim.x * gridDim.x;
+
+    if (add) for (int i=i0; i < N; i += j) out[i] = cuCaddf(out[i], e[i]);
+    else for (int i=i0; i < N; i += j) out[i] = e[i];
+  };
+
+  template <class E>
+  void launch_expr(complex_vector* dst, const Expr<E>& e, bool add, dim3 grid, dim3 block, cudaStream_t stream) {
+    eval_expr<<<grid, block, 0, stream>>>(dst->mat, e.e, dst->nelem, add);
+    CHECK_CUDA_ERROR( cudaPeekAtLastError() );
+  };
+}
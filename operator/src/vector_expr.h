@@ -0,0 +1,128 @@
+#pragma once
+#include <complex_vector.h>
+#include <cuComplex.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <stdexcept>
+#include <cstdint>
+
+// Lazy element-wise expressions on complex_vectors. An expression such as
+//   assign(a, ref(b) * ref(phase) + ref(c));
+// builds a small tree of value types and is evaluated in a single pass over the output:
+// one fused TBB loop for host vectors, one kernel for device vectors.
+// The device evaluation (launch_expr) is defined in vector_expr.cuh, so device vectors can only be
+// assigned from .cu translation units; host-only code can evaluate host vectors.
+
+#ifdef __CUDACC__
+#define EXPR_HD __host__ __device__ __forceinline__
+#else
+#define EXPR_HD inline
+#endif
+
+namespace expr {
+
+  // leaves
+  struct Ref {
+    const cuFloatComplex* p;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return p[i];};
+  };
+
+  struct Const {
+    cuFloatComplex v;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return v;};
+  };
+
+  // nodes
+  template <class L, class R>
+  struct Add {
+    L l; R r;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return cuCaddf(l[i], r[i]);};
+  };
+
+  template <class L, class R>
+  struct Sub {
+    L l; R r;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return cuCsubf(l[i], r[i]);};
+  };
+
+  template <class L, class R>
+  struct Mul {
+    L l; R r;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return cuCmulf(l[i], r[i]);};
+  };
+
+  template <class E>
+  struct Conj {
+    E e;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return cuConjf(e[i]);};
+  };
+
+  // e where the label of the point is value, 0 elsewhere, on a [ns, nw, ny, nx] vector. The labels
+  // are the RefSampler ones: one [ny, nx] uint8 slice per distinct frequency, wmap[iw] picks the slice
+  template <class E>
+  struct Masked {
+    const uint8_t* labels; const int* wmap; int value; size_t nxy; int nw;
+    E e;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {
+      size_t slice = wmap[(i / nxy) % nw];
+      return labels[slice*nxy + i % nxy] == value ? e[i] : make_cuFloatComplex(0.f, 0.f);
+    };
+  };
+
+  // wrapper that the operators below are restricted to
+  template <class E>
+  struct Expr {
+    E e;
+    EXPR_HD cuFloatComplex operator[](size_t i) const {return e[i];};
+  };
+
+  inline Expr<Ref> ref(const complex_vector* vec) {return {{vec->mat}};};
+  inline Expr<Const> scalar(cuFloatComplex v) {return {{v}};};
+  inline Expr<Const> scalar(float v) {return {{make_cuFloatComplex(v, 0.f)}};};
+
+  template <class L, class R>
+  Expr<Add<L, R>> operator+(const Expr<L>& l, const Expr<R>& r) {return {{l.e, r.e}};};
+  template <class L, class R>
+  Expr<Sub<L, R>> operator-(const Expr<L>& l, const Expr<R>& r) {return {{l.e, r.e}};};
+  template <class L, class R>
+  Expr<Mul<L, R>> operator*(const Expr<L>& l, const Expr<R>& r) {return {{l.e, r.e}};};
+  template <class R>
+  Expr<Mul<Const, R>> operator*(cuFloatComplex a, const Expr<R>& r) {return {{{a}, r.e}};};
+  template <class R>
+  Expr<Mul<Const, R>> operator*(float a, const Expr<R>& r) {return {{{make_cuFloatComplex(a, 0.f)}, r.e}};};
+
+  template <class E>
+  Expr<Conj<E>> conj(const Expr<E>& e) {return {{e.e}};};
+  template <class E>
+  Expr<Masked<E>> masked(const uint8_t* labels, const int* wmap, int value, size_t nxy, int nw, const Expr<E>& e) {
+    return {{labels, wmap, value, nxy, nw, e.e}};
+  };
+
+  // dst = e (add = false) or dst += e (add = true)
+  template <class E>
+  void host_expr(complex_vector* dst, const Expr<E>& e, bool add) {
+    cuFloatComplex* out = dst->mat;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, dst->nelem),
+      [=](const tbb::blocked_range<size_t>& r) {
+        if (add) for (size_t i = r.begin(); i < r.end(); ++i) out[i] = cuCaddf(out[i], e[i]);
+        else for (size_t i = r.begin(); i < r.end(); ++i) out[i] = e[i];
+    });
+  };
+
+  // the output may appear in the expression (e.g. p = s + beta * p): every element is read before it is written
+  template <class E>
+  void eval(complex_vector* dst, const Expr<E>& e, bool add) {
+    if (dst->on_host) host_expr(dst, e, add);
+#ifdef __CUDACC__
+    else launch_expr(dst, e, add, dst->_grid_, dst->_block_, dst->stream);
+#else
+    else throw std::runtime_error("expr: device vectors are evaluated in .cu files (include vector_expr.cuh)");
+#endif
+  };
+
+  template <class E>
+  void assign(complex_vector* dst, const Expr<E>& e) {eval(dst, e, false);};
+
+  template <class E>
+  void accumulate(complex_vector* dst, const Expr<E>& e) {eval(dst, e, true);};
+}
@@ -1,7 +1,9 @@
 #include <complex4DReg.h>
 #include <gtest/gtest.h>
 #include <complex_vector.h>
+#include <vector_expr.h>
 #include <cuda_runtime.h>
+#include <cstring>
 #include "SZ3/api/sz.hpp"
 
 class ComplexVectorTest : public testing::Test {
@@ -17,8 +19,7 @@ class ComplexVectorTest : public testing::Test {
   }
 
   void TearDown() override {
-    vec->~complex_vector();
-    CHECK_CUDA_ERROR(cudaFree(vec));
+    free_complex_vector(vec);
   }
 
   std::shared_ptr<hypercube> hyper;
@@ -79,8 +80,7 @@ TEST_F(ComplexVectorTest, make_view) {
   // Check that the view is not allocated
   ASSERT_FALSE(view->allocated);
 
-  view->~complex_vector();
-  CHECK_CUDA_ERROR(cudaFree(view));
+  free_complex_vector(view);
 }
 
 TEST_F(ComplexVectorTest, view_modify) {
@@ -110,11 +110,173 @@ TEST_F(ComplexVectorTest, view_modify) {
     }   
   }
 
-  view->~complex_vector();
-  CHECK_CUDA_ERROR(cudaFree(view));
+  free_complex_vector(view);
 
 }
 
+TEST_F(ComplexVectorTest, host_view_modify) {
+  auto cpu_vec = std::make_shared<complex4DReg>(hyper);
+  cpu_vec->set(1.f);
+  complex_vector* host_vec = make_host_complex_vector(hyper);
+  ASSERT_TRUE(host_vec->on_host);
+  std::memcpy(host_vec->mat, cpu_vec->getVals(), hyper->getN123() * sizeof(cuFloatComplex));
+
+  int index = 5;
+  complex_vector* view = host_vec->make_view(index, index+1);
+  ASSERT_TRUE(view->on_host);
+  ASSERT_FALSE(view->allocated);
+  view->zero();
+
+  // clone + add doubles everything but the zeroed slice
+  complex_vector* sum = host_vec->cloneSpace();
+  sum->zero();
+  sum->add(host_vec);
+  sum->add(host_vec);
+  for (int i = 0; i < host_vec->nelem; ++i) {
+    float expected = (i / (n1*n2*n3) == index) ? 0.f : 2.f;
+    ASSERT_EQ(cuCrealf(sum->mat[i]), expected);
+  }
+
+  free_complex_vector(view);
+  free_complex_vector(sum);
+  free_complex_vector(host_vec);
+}
+
+TEST_F(ComplexVectorTest, linear_algebra) {
+  auto cpu_vec = std::make_shared<complex4DReg>(hyper);
+  cpu_vec->random();
+  vec->upload(cpu_vec->getVals());
+  complex_vector* other = vec->cloneSpace();
+  other->copy(vec);
+
+  // <v, v> = ||v||^2, computed on the device against the host vector
+  auto expected = cpu_vec->dot(cpu_vec);
+  auto dot = vec->dot(other);
+  ASSERT_NEAR(dot.real(), std::real(expected), 1e-4 * std::abs(expected));
+  ASSERT_NEAR(dot.imag(), 0., 1e-4 * std::abs(expected));
+  ASSERT_NEAR(vec->norm(), std::sqrt(std::real(expected)), 1e-4 * std::sqrt(std::abs(expected)));
+
+  // 2i * v - i * v - i * v = 0
+  other->scale(make_cuFloatComplex(0.f, 2.f));
+  other->axpy(make_cuFloatComplex(0.f, -1.f), vec);
+  other->axpy(make_cuFloatComplex(0.f, -1.f), vec);
+  ASSERT_NEAR(other->norm(), 0., 1e-5);
+  free_complex_vector(other);
+}
+
+TEST_F(ComplexVectorTest, host_linear_algebra) {
+  complex_vector* host_vec = make_host_complex_vector(hyper);
+  complex_vector* other = host_vec->cloneSpace();
+  for (int i = 0; i < host_vec->nelem; ++i) {
+    host_vec->mat[i] = make_cuFloatComplex(1.f, 1.f);
+    other->mat[i] = make_cuFloatComplex(0.f, 2.f);
+  }
+  // conj(1 + i) * 2i = 2 + 2i
+  auto dot = host_vec->dot(other);
+  ASSERT_NEAR(dot.real(), 2. * host_vec->nelem, 1e-6);
+  ASSERT_NEAR(dot.imag(), 2. * host_vec->nelem, 1e-6);
+  ASSERT_NEAR(host_vec->norm(), std::sqrt(2. * host_vec->nelem), 1e-6);
+
+  // 2 * (1 + i) + i * 2i = 2i
+  host_vec->scale(make_cuFloatComplex(2.f, 0.f));
+  host_vec->axpy(make_cuFloatComplex(0.f, 1.f), other);
+  for (int i = 0; i < host_vec->nelem; ++i) {
+    ASSERT_EQ(cuCrealf(host_vec->mat[i]), 0.f);
+    ASSERT_EQ(cuCimagf(host_vec->mat[i]), 2.f);
+  }
+  free_complex_vector(other);
+  free_complex_vector(host_vec);
+}
+
+TEST_F(ComplexVectorTest, fused_axpby) {
+  auto cpu_vec = std::make_shared<complex4DReg>(hyper);
+  cpu_vec->random();
+  vec->upload(cpu_vec->getVals());
+  complex_vector* other = vec->cloneSpace();
+  other->copy(vec);
+
+  // i * v + (2 - i) * v - 2 * v = 0
+  other->axpby(make_cuFloatComplex(0.f, 1.f), vec, make_cuFloatComplex(2.f, -1.f));
+  other->axpy(make_cuFloatComplex(-2.f, 0.f), vec);
+  ASSERT_NEAR(other->norm(), 0., 1e-5);
+  free_complex_vector(other);
+}
+
+TEST_F(ComplexVectorTest, host_expressions) {
+  complex_vector* a = make_host_complex_vector(hyper);
+  complex_vector* b = a->cloneSpace();
+  complex_vector* phase = a->cloneSpace();
+  complex_vector* c = a->cloneSpace();
+  for (int i = 0; i < a->nelem; ++i) {
+    b->mat[i] = make_cuFloatComplex(1.f, 2.f);
+    phase->mat[i] = make_cuFloatComplex(0.f, 1.f);
+    c->mat[i] = make_cuFloatComplex(3.f, 0.f);
+  }
+  using namespace expr;
+
+  // (1 + 2i) * i + 3 = 1 + i
+  assign(a, ref(b) * ref(phase) + ref(c));
+  for (int i = 0; i < a->nelem; ++i) {
+    ASSERT_EQ(cuCrealf(a->mat[i]), 1.f);
+    ASSERT_EQ(cuCimagf(a->mat[i]), 1.f);
+  }
+
+  // a = 2 conj(a) - a = 1 - 3i, with the output on both sides
+  assign(a, 2.f * conj(ref(a)) - ref(a));
+  ASSERT_EQ(cuCrealf(a->mat[a->nelem-1]), 1.f);
+  ASSERT_EQ(cuCimagf(a->mat[a->nelem-1]), -3.f);
+
+  // accumulate b only where the label of the (x,y,w) point matches, two label slices over the frequencies
+  size_t nxy = n1 * n2;
+  std::vector<uint8_t> labels(2 * nxy);
+  for (size_t i = 0; i < labels.size(); ++i) labels[i] = i % 3;
+  std::vector<int> wmap(n3);
+  for (int iw = 0; iw < n3; ++iw) wmap[iw] = iw % 2;
+  a->zero();
+  accumulate(a, masked(labels.data(), wmap.data(), 1, nxy, n3, ref(b)));
+  accumulate(a, masked(labels.data(), wmap.data(), 1, nxy, n3, ref(b)));
+  for (int i = 0; i < a->nelem; ++i) {
+    float expected = labels[wmap[(i / nxy) % n3] * nxy + i % nxy] == 1 ? 2.f : 0.f;
+    ASSERT_EQ(cuCrealf(a->mat[i]), expected);
+    ASSERT_EQ(cuCimagf(a->mat[i]), 2.f * expected);
+  }
+
+  free_complex_vector(a);
+  free_complex_vector(b);
+  free_complex_vector(phase);
+  free_complex_vector(c);
+}
+
+TEST_F(ComplexVectorTest, pooled_allocations) {
+  // warm up the pool with one scratch vector of this geometry
+  free_complex_vector(vec->cloneSpace());
+  complex_vector* host_vec = make_host_complex_vector(hyper);
+  free_complex_vector(host_vec->make_view(0, 1));
+  free_complex_vector(host_vec);
+
+  size_t allocations = complex_vector_allocations();
+  for (int i = 0; i < 10; ++i) {
+    // views and scratch vectors of a known geometry come from the pool
+    complex_vector* view = vec->make_view(i % n4, i % n4 + 1);
+    complex_vector* scratch = vec->cloneSpace();
+    complex_vector* host_scratch = make_host_complex_vector(hyper);
+    complex_vector* host_view = host_scratch->make_view(0, 2);
+    ASSERT_EQ(view->n[view->ndim-1], 1);
+    ASSERT_EQ(host_view->n[host_view->ndim-1], 2);
+    free_complex_vector(host_view);
+    free_complex_vector(host_scratch);
+    free_complex_vector(scratch);
+    free_complex_vector(view);
+  }
+  ASSERT_EQ(complex_vector_allocations(), allocations);
+
+  // once trimmed, the data buffers have to be allocated again
+  trim_complex_vector_pool();
+  complex_vector* scratch = vec->cloneSpace();
+  ASSERT_EQ(complex_vector_allocations(), allocations + 1);
+  free_complex_vector(scratch);
+}
+
 TEST_F(ComplexVectorTest, compress_decompress) {
   auto orig = std::make_shared<complex4DReg>(hyper);
   auto decomp = std::make_shared<complex4DReg>(hyper);
@@ -4,6 +4,9 @@
 #include <complex_vector.h>
 #include <cuda_runtime.h>
 #include "StreamingOperator.h"
+#include "Solver.h"
+#include "ChainOperator.h"
+#include <fstream>
 
 bool verbose = false;
 double tolerance = 1e-6;
@@ -104,6 +107,207 @@ TEST_F(FFTTest, dotTest) {
   ASSERT_TRUE(err.second <= tolerance);
 }
 
+TEST_F(FFTTest, solvers) {
+  auto model = space4d->clone();
+  auto data = space4d->clone();
+  data->random();
+  // the orthonormal FFT is solved exactly in one iteration
+  for (int i = 0; i < 2; ++i) {
+    model->zero();
+    std::unique_ptr<Solver<complex4DReg, complex4DReg>> solver;
+    if (i == 0) solver = std::make_unique<CGLS<complex4DReg, complex4DReg>>(cuFFT.get(), 5, 1e-5);
+    else solver = std::make_unique<LSQR<complex4DReg, complex4DReg>>(cuFFT.get(), 5, 1e-5);
+    auto res = solver->solve(model, data);
+    ASSERT_LE(res.back(), 1e-4 * res[0]);
+    auto inv = space4d->clone();
+    cuFFT->adjoint(false, inv, data);
+    for (int j = 0; j < space4d->getHyper()->getN123(); ++j) {
+      EXPECT_NEAR(model->getVals()[j].real(), inv->getVals()[j].real(), 1e-4);
+      EXPECT_NEAR(model->getVals()[j].imag(), inv->getVals()[j].imag(), 1e-4);
+    }
+  }
+}
+
+TEST_F(FFTTest, plan_reuse) {
+  auto& cache = FFTPlanCache::instance();
+  size_t misses = cache.misses();
+  size_t hits = cache.hits();
+  auto fft2 = cuFFT2d(space4d->getHyper());
+  // same geometry and stream: the plan comes from the cache
+  ASSERT_EQ(cache.misses(), misses);
+  ASSERT_EQ(cache.hits(), hits + 1);
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  auto output2 = space4d->clone();
+  input->random();
+  cuFFT->forward(false, input, output);
+  fft2.forward(false, input, output2);
+  for (int i = 0; i < space4d->getHyper()->getN123(); ++i) {
+    EXPECT_EQ(output->getVals()[i], output2->getVals()[i]);
+  }
+}
+
+class cpuFFTTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    n1 = 100;
+    n2 = 80;
+    n3 = 20;
+    n4 = 10;
+    auto hyper = std::make_shared<hypercube>(n1, n2, n3, n4);
+    space4d = std::make_shared<complex4DReg>(hyper);
+    space4d->set(1.f);
+    fft = std::make_unique<cpuFFT2d>(hyper);
+  }
+
+  std::unique_ptr<cpuFFT2d> fft;
+  std::shared_ptr<complex4DReg> space4d;
+  int n1, n2, n3, n4;
+};
+
+TEST_F(cpuFFTTest, forward_inverse) {
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  auto inv = space4d->clone();
+  input->random();
+  fft->forward(false, input, output);
+  fft->adjoint(false, inv, output);
+  for (int i = 0; i < space4d->getHyper()->getN123(); ++i) {
+    EXPECT_NEAR(input->getVals()[i].real(), inv->getVals()[i].real(), 1e-5);
+    EXPECT_NEAR(input->getVals()[i].imag(), inv->getVals()[i].imag(), 1e-5);
+  }
+}
+
+TEST_F(cpuFFTTest, in_place) {
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  input->random();
+  fft->forward(false, input, output);
+  fft->forward(input);
+  for (int i = 0; i < space4d->getHyper()->getN123(); ++i) {
+    EXPECT_NEAR(input->getVals()[i].real(), output->getVals()[i].real(), 1e-5);
+    EXPECT_NEAR(input->getVals()[i].imag(), output->getVals()[i].imag(), 1e-5);
+  }
+}
+
+TEST_F(cpuFFTTest, mono_plane_wave) {
+  int k1 = 10;
+  int k2 = 20; 
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  for (int i4 = 0; i4 < n4; ++i4) {
+    for (int i3 = 0; i3 < n3; ++i3) {
+      for (int i2 = 0; i2 < n2; ++i2) {
+        for (int i1 = 0; i1 < n1; ++i1) {
+          float phase = 2 * M_PI * (float(k1*i1)/n1 + float(k2*i2)/n2);
+          (*input->_mat)[i4][i3][i2][i1] = std::exp(std::complex<float>(0, phase));
+        }
+      }
+    }
+  }
+  fft->forward(false, input, output);
+  // non-square slices: the spike has to land on (k2, k1)
+  for (int i4 = 0; i4 < n4; ++i4) {
+    for (int i3 = 0; i3 < n3; ++i3) {
+      EXPECT_NEAR((*output->_mat)[i4][i3][k2][k1].real(), n1*n2/sqrtf(n1*n2), 1e-3);
+    }
+  }
+}
+
+TEST_F(cpuFFTTest, dotTest) { 
+  auto err = fft->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(cpuFFTTest, solvers) {
+  auto model = space4d->clone();
+  auto data = space4d->clone();
+  data->random();
+  for (int i = 0; i < 2; ++i) {
+    model->zero();
+    std::unique_ptr<Solver<complex4DReg, complex4DReg>> solver;
+    if (i == 0) solver = std::make_unique<CGLS<complex4DReg, complex4DReg>>(fft.get(), 5, 1e-5);
+    else solver = std::make_unique<LSQR<complex4DReg, complex4DReg>>(fft.get(), 5, 1e-5);
+    auto res = solver->solve(model, data);
+    ASSERT_LE(res.back(), 1e-4 * res[0]);
+  }
+}
+
+TEST_F(cpuFFTTest, chain) {
+  auto hyper = space4d->getHyper();
+  auto fft1 = std::make_shared<cpuFFT2d>(hyper);
+  auto fft2 = std::make_shared<cpuFFT2d>(hyper);
+  auto fft3 = std::make_shared<cpuFFT2d>(hyper);
+  auto chain = ChainOperator<complex4DReg, complex4DReg>(hyper, hyper, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  chain.append(fft1);
+  chain.append(fft2);
+  chain.append(fft3);
+
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  auto expected = space4d->clone();
+  input->random();
+  chain.get_workspace()->reset_peak();
+  chain.forward(false, input, output);
+  fft1->forward(false, input, expected);
+  fft2->forward(expected);
+  fft3->forward(expected);
+  for (int i = 0; i < hyper->getN123(); ++i) {
+    EXPECT_NEAR(output->getVals()[i].real(), expected->getVals()[i].real(), 1e-4);
+    EXPECT_NEAR(output->getVals()[i].imag(), expected->getVals()[i].imag(), 1e-4);
+  }
+  // three operators, two intermediates, never more than both alive
+  ASSERT_LE(chain.get_workspace()->peak_bytes(), 2 * chain.getDomainSizeInBytes());
+
+  auto err = chain.dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(cpuFFTTest, plan_reuse) {
+  auto& cache = FFTPlanCache::instance();
+  size_t misses = cache.misses();
+  size_t hits = cache.hits();
+  {
+    auto fft2 = cpuFFT2d(space4d->getHyper());
+    ASSERT_EQ(cache.misses(), misses);
+    ASSERT_EQ(cache.hits(), hits + 4);
+  }
+  // plans outlive the operators that requested them
+  auto fft3 = cpuFFT2d(space4d->getHyper());
+  ASSERT_EQ(cache.misses(), misses);
+  // a new geometry is planned once
+  auto hyper = std::make_shared<hypercube>(n1+2, n2, n3, n4);
+  auto fft4 = cpuFFT2d(hyper);
+  ASSERT_GT(cache.misses(), misses);
+}
+
+TEST_F(cpuFFTTest, wisdom) {
+  auto& cache = FFTPlanCache::instance();
+  std::string file = testing::TempDir() + "cpuFFTTest.wisdom";
+  std::remove(file.c_str());
+  auto hyper = std::make_shared<hypercube>(16, 12, 4, 2);
+  size_t tuned = cache.wisdom_misses();
+
+  cache.set_fftw_wisdom(file);
+  auto fft1 = cpuFFT2d(hyper);
+  ASSERT_GT(cache.wisdom_misses(), tuned);
+  ASSERT_TRUE(std::ifstream(file).good());
+
+  // a fresh start on the same geometry is served by the wisdom
+  tuned = cache.wisdom_misses();
+  cache.set_fftw_wisdom(file);
+  auto fft2 = cpuFFT2d(hyper);
+  ASSERT_EQ(cache.wisdom_misses(), tuned);
+  auto err = fft2.dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+
+  cache.set_fftw_wisdom("", false);
+  std::remove(file.c_str());
+}
+
 class StreamingTest : public testing::Test {
  protected:
   void SetUp() override {
@@ -163,6 +367,56 @@ TEST_F(StreamingTest, dotTest) {
   ASSERT_TRUE(err.second <= tolerance);
 }
 
+TEST_F(StreamingTest, frequency_chunks) {
+  // 20 frequencies in chunks of 6 (the last one is shorter), triple buffered
+  StreamingOptions opts;
+  opts.split_axis = 2;
+  opts.chunk = 6;
+  opts.nbuffers = 3;
+  auto fft = StreamingOperator<cuFFT2d>(space4d->getHyper(), opts, {32, 4, 4}, {16, 16, 4});
+  ASSERT_EQ(fft.get_nchunks(), 4);
+  ASSERT_EQ(fft.get_nbuffers(), 3);
+
+  auto ref = cuFFT2d(space4d->getHyper());
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  input->random();
+  output->random();
+  auto expected = output->clone();
+  fft.forward(true, input, output);
+  ref.forward(true, input, expected);
+  for (int i = 0; i < space4d->getHyper()->getN123(); ++i) {
+    EXPECT_NEAR(output->getVals()[i].real(), expected->getVals()[i].real(), 1e-5);
+    EXPECT_NEAR(output->getVals()[i].imag(), expected->getVals()[i].imag(), 1e-5);
+  }
+  auto err = fft.dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(StreamingTest, host_pipeline) {
+  StreamingOptions opts;
+  opts.split_axis = 3;
+  opts.chunk = 4;
+  opts.backend = Backend::HOST;
+  auto fft = StreamingOperator<cpuFFT2d>(space4d->getHyper(), opts);
+
+  auto ref = cpuFFT2d(space4d->getHyper());
+  auto input = space4d->clone();
+  auto output = space4d->clone();
+  auto expected = space4d->clone();
+  input->random();
+  fft.forward(false, input, output);
+  ref.forward(false, input, expected);
+  for (int i = 0; i < space4d->getHyper()->getN123(); ++i) {
+    EXPECT_NEAR(output->getVals()[i].real(), expected->getVals()[i].real(), 1e-5);
+    EXPECT_NEAR(output->getVals()[i].imag(), expected->getVals()[i].imag(), 1e-5);
+  }
+  auto err = fft.dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
 
 int main(int argc, char **argv) {
   for (int i = 1; i < argc; ++i) {
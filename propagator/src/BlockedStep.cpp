@@ -0,0 +1,225 @@
+#include <BlockedStep.h>
+#include <FFTPlanCache.h>
+#include <prop_kernels_host.h>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range2d.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+
+namespace {
+  // a march block (slices, propagators and work slices) is kept within a typical L2
+  constexpr size_t MARCH_BYTES = 1 << 20;
+
+  inline cuFloatComplex shift(cuFloatComplex p, cuFloatComplex x, bool conj) {
+    return conj ? cuCmulf(cuConjf(p), x) : cuCmulf(p, x);
+  }
+  inline void fft(fftwf_plan plan, cuFloatComplex* x) {
+    fftwf_execute_dft(plan, reinterpret_cast<fftwf_complex*>(x), reinterpret_cast<fftwf_complex*>(x));
+  }
+}
+
+BlockedStep::Scratch::~Scratch() {
+  if (k) fftwf_free(k);
+  if (tmp) fftwf_free(tmp);
+  if (p) fftwf_free(p);
+  if (block) fftwf_free(block);
+};
+
+BlockedStep::BlockedStep(const std::shared_ptr<hypercube>& domain, std::shared_ptr<PropagationContext> ctx, float dz, float eps)
+: _ctx_(ctx), _dz_(dz), _eps_(eps) {
+  NX = domain->getAxis(1).n;
+  NY = domain->getAxis(2).n;
+  NW = domain->getAxis(3).n;
+  NS = domain->getAxis(4).n;
+  NXY = size_t(NX)*NY;
+  _scale_ = 1.f / std::sqrt(float(NXY));
+
+  // single-slice in-place plans, shared with the other host FFTs of this geometry
+  auto& cache = FFTPlanCache::instance();
+  _plans_[0] = cache.get_fftw(NX, NY, 1, FFTW_FORWARD, true);
+  _plans_[1] = cache.get_fftw(NX, NY, 1, FFTW_BACKWARD, true);
+  fwd_plan = _plans_[0].get();
+  inv_plan = _plans_[1].get();
+};
+
+void BlockedStep::set_refs(const std::vector<std::complex<float>*>& sref, const uint8_t* labels, const int* wmap) {
+  _sref_ = sref;
+  _nref_ = sref.size();
+  _labels_ = labels;
+  _wmap_ = wmap;
+  // the propagators built for the previous depth are stale
+  ++generation;
+};
+
+BlockedStep::Scratch& BlockedStep::local() {
+  auto& s = scratch.local();
+  if (s.k == nullptr) {
+    s.k = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*NXY);
+    s.tmp = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*NXY);
+  }
+  return s;
+};
+
+void BlockedStep::fill_propagators(cuFloatComplex* p, int iw, const std::vector<std::complex<float>*>& sref) {
+  for (size_t iref=0; iref < sref.size(); ++iref) {
+    auto s = sref[iref][iw];
+    ps_slice_host(p + iref*NXY, NX, NY, _ctx_->w2()[iw], _ctx_->kx(), _ctx_->ky(),
+      make_cuFloatComplex(s.real(), s.imag()), _dz_, _eps_);
+  }
+};
+
+const cuFloatComplex* BlockedStep::propagators(Scratch& s, int iw) {
+  if (s.iw == iw && s.generation == generation) return s.p;
+  if (s.p == nullptr || s.generation != generation) {
+    // nref may have changed with the depth
+    if (s.p) fftwf_free(s.p);
+    s.p = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*NXY*std::max(_nref_, 1));
+  }
+  fill_propagators(s.p, iw, _sref_);
+  s.iw = iw;
+  s.generation = generation;
+  return s.p;
+};
+
+template <class Body>
+void BlockedStep::for_slices(Body body) {
+  // whole frequencies per task when there are enough of them, so the propagators are built once
+  // per frequency; otherwise the sources are split as well
+  int threads = tbb::this_task_arena::max_concurrency();
+  int sgrain = NW >= 2*threads ? NS : std::max(1, NS*NW / (2*threads));
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 1, 0, NS, sgrain),
+    [&](const tbb::blocked_range2d<int>& r) {
+    Scratch& s = local();
+    for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+      const cuFloatComplex* p = propagators(s, iw);
+      const uint8_t* lab = _labels_ + size_t(_wmap_[iw])*NXY;
+      for (int is=r.cols().begin(); is < r.cols().end(); ++is)
+        body(s, p, lab, (size_t(is)*NW + iw)*NXY);
+    }
+  });
+};
+
+void BlockedStep::slice_out(Scratch& s, const cuFloatComplex* p, const uint8_t* lab, int nref, bool add, bool conj,
+  const cuFloatComplex* x, cuFloatComplex* y) {
+  // both transform scalings are applied to the product
+  float s2 = _scale_*_scale_;
+  std::copy(x, x + NXY, s.k);
+  fft(fwd_plan, s.k);
+
+  // the references present in this slice
+  bool present[256] = {};
+  for (size_t i=0; i < NXY; ++i) present[lab[i]] = true;
+
+  for (int iref=0; iref < nref; ++iref) {
+    if (!present[iref]) continue;
+    const cuFloatComplex* pr = p + iref*NXY;
+    for (size_t i=0; i < NXY; ++i) {
+      cuFloatComplex v = shift(pr[i], s.k[i], conj);
+      s.tmp[i] = make_cuFloatComplex(s2*v.x, s2*v.y);
+    }
+    fft(inv_plan, s.tmp);
+    // the labels partition the slice, so without add every point is written once
+    for (size_t i=0; i < NXY; ++i)
+      if (lab[i] == iref) y[i] = add ? cuCaddf(y[i], s.tmp[i]) : s.tmp[i];
+  }
+};
+
+void BlockedStep::slice_in(Scratch& s, const cuFloatComplex* p, const uint8_t* lab, int nref, bool add, bool conj,
+  const cuFloatComplex* x, cuFloatComplex* y) {
+  bool first = true;
+  for (int iref=0; iref < nref; ++iref) {
+    bool any = false;
+    for (size_t i=0; i < NXY; ++i) {
+      bool mine = lab[i] == iref;
+      s.tmp[i] = mine ? x[i] : make_cuFloatComplex(0.f, 0.f);
+      any |= mine;
+    }
+    if (!any) continue;
+    fft(fwd_plan, s.tmp);
+    const cuFloatComplex* pr = p + iref*NXY;
+    if (first) for (size_t i=0; i < NXY; ++i) s.k[i] = shift(pr[i], s.tmp[i], conj);
+    else for (size_t i=0; i < NXY; ++i) s.k[i] = cuCaddf(s.k[i], shift(pr[i], s.tmp[i], conj));
+    first = false;
+  }
+  // all the labels are below nref, so at least one reference is present
+  fft(inv_plan, s.k);
+  float s2 = _scale_*_scale_;
+  if (add) for (size_t i=0; i < NXY; ++i) y[i] = make_cuFloatComplex(y[i].x + s2*s.k[i].x, y[i].y + s2*s.k[i].y);
+  else for (size_t i=0; i < NXY; ++i) y[i] = make_cuFloatComplex(s2*s.k[i].x, s2*s.k[i].y);
+};
+
+void BlockedStep::fan_out(bool add, bool conj, const cuFloatComplex* in, cuFloatComplex* out) {
+  for_slices([&](Scratch& s, const cuFloatComplex* p, const uint8_t* lab, size_t offset) {
+    slice_out(s, p, lab, _nref_, add, conj, in + offset, out + offset);
+  });
+};
+
+void BlockedStep::fan_in(bool add, bool conj, const cuFloatComplex* in, cuFloatComplex* out) {
+  for_slices([&](Scratch& s, const cuFloatComplex* p, const uint8_t* lab, size_t offset) {
+    slice_in(s, p, lab, _nref_, add, conj, in + offset, out + offset);
+  });
+};
+
+void BlockedStep::march(RefSampler& ref, const std::vector<int>& depths, bool adjoint, cuFloatComplex* x, cuFloatComplex* save) {
+  if (ref.is_lazy()) throw std::invalid_argument("BlockedStep: march needs an eager reference sampler.");
+  int nref = ref._nref_;
+  size_t size = NXY*NW*NS;
+
+  // sources per block: the block shares the propagators of its frequency at every depth
+  int threads = tbb::this_task_arena::max_concurrency();
+  size_t fixed = (nref + 2) * NXY * sizeof(cuFloatComplex);
+  int sblock = std::clamp<int>(MARCH_BYTES > fixed ? (MARCH_BYTES - fixed) / (NXY*sizeof(cuFloatComplex)) : 1, 1, NS);
+  // but enough blocks to feed the pool
+  sblock = std::min(sblock, std::max(1, NS*NW / (2*threads)));
+
+  // the propagators are rebuilt per depth and frequency here
+  ++generation;
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 1, 0, NS, sblock),
+    [&](const tbb::blocked_range2d<int>& r) {
+    Scratch& s = local();
+    int nb = r.cols().size();
+    if (s.block_size < nb*NXY) {
+      if (s.block) fftwf_free(s.block);
+      s.block_size = nb*NXY;
+      s.block = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*s.block_size);
+    }
+    if (s.p == nullptr || s.generation != generation) {
+      if (s.p) fftwf_free(s.p);
+      s.p = (cuFloatComplex*)fftwf_malloc(sizeof(cuFloatComplex)*NXY*std::max(nref, 1));
+      s.generation = generation;
+    }
+    // no depth-major step may reuse these propagators
+    s.iw = -1;
+
+    std::vector<std::complex<float>*> sref(nref);
+    for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+      for (int ib=0; ib < nb; ++ib) {
+        const cuFloatComplex* xs = x + (size_t(r.cols().begin() + ib)*NW + iw)*NXY;
+        std::copy(xs, xs + NXY, s.block + ib*NXY);
+      }
+
+      for (size_t k=0; k < depths.size(); ++k) {
+        int iz = depths[k];
+        for (int iref=0; iref < nref; ++iref) sref[iref] = ref.get_ref_slow(iz, iref);
+        fill_propagators(s.p, iw, sref);
+        const uint8_t* lab = ref.get_ref_labels(iz) + size_t(ref.get_ref_wmap(iz)[iw])*NXY;
+
+        for (int ib=0; ib < nb; ++ib) {
+          cuFloatComplex* slice = s.block + ib*NXY;
+          size_t offset = (size_t(r.cols().begin() + ib)*NW + iw)*NXY;
+          if (save) std::copy(slice, slice + NXY, save + k*size + offset);
+          if (adjoint) slice_in(s, s.p, lab, nref, false, true, slice, slice);
+          else slice_out(s, s.p, lab, nref, false, false, slice, slice);
+        }
+      }
+
+      for (int ib=0; ib < nb; ++ib) {
+        cuFloatComplex* xs = x + (size_t(r.cols().begin() + ib)*NW + iw)*NXY;
+        std::copy(s.block + ib*NXY, s.block + (ib+1)*NXY, xs);
+      }
+    }
+  }, tbb::simple_partitioner());
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <complex>
+#include <cstdint>
+#include <fftw3.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <hypercube.h>
+#include <complex_vector.h>
+#include <PropagationContext.h>
+#include <RefSampler.h>
+
+using namespace SEP;
+
+// Host engine for one PSPI/NSPS step that runs the whole FFT -> phase shift -> iFFT -> select chain on
+// one (s,w) slice at a time, so the slice stays in cache between the stages instead of every stage
+// streaming the volume through memory. The slices are spread over the cores; the propagators of a
+// frequency are built once per thread and reused for all its sources. With S_r the points of label r
+// and P_r the phase shift of reference r (F orthonormal, P_r^H when conj):
+//   fan_out: out (+)= sum_r S_r F^-1 P_r F in        (PSPI forward, NSPS adjoint with conj)
+//   fan_in:  out (+)= F^-1 sum_r P_r F S_r in        (NSPS forward, PSPI adjoint with conj)
+// in and out may be the same vector.
+class BlockedStep {
+public:
+  BlockedStep(const std::shared_ptr<hypercube>& domain, std::shared_ptr<PropagationContext> ctx, float dz, float eps);
+
+  // references of the current depth: sref[iref] points to nw slownesses, frequency iw reads the
+  // label slice wmap[iw] (see RefSampler). The pointers must stay valid until the next call
+  void set_refs(const std::vector<std::complex<float>*>& sref, const uint8_t* labels, const int* wmap);
+
+  void fan_out(bool add, bool conj, const cuFloatComplex* in, cuFloatComplex* out);
+  void fan_in(bool add, bool conj, const cuFloatComplex* in, cuFloatComplex* out);
+
+  // Frequency-major schedule of a whole one-way propagation: each block of (s,w) slices goes
+  // through all the depths before the next one, with no synchronization between depths. The
+  // PSPI steps of depths[0], depths[1], ... are applied in place to x (fan_out; fan_in with conj
+  // when adjoint). When save is set, the slices entering step k are also stored at save + k*size
+  // (the volume size). ref must be eager: the depths are read concurrently and out of order
+  void march(RefSampler& ref, const std::vector<int>& depths, bool adjoint, cuFloatComplex* x, cuFloatComplex* save = nullptr);
+
+private:
+  // per-thread slices (FFTW-aligned), the propagators of the last frequency it built and the
+  // block of slices of a march
+  struct Scratch {
+    cuFloatComplex *k = nullptr, *tmp = nullptr, *p = nullptr, *block = nullptr;
+    size_t block_size = 0;
+    int iw = -1;
+    uint64_t generation = 0;
+    Scratch() = default;
+    Scratch(const Scratch&) {};
+    ~Scratch();
+  };
+
+  Scratch& local();
+  const cuFloatComplex* propagators(Scratch& s, int iw);
+  void fill_propagators(cuFloatComplex* p, int iw, const std::vector<std::complex<float>*>& sref);
+  void slice_out(Scratch& s, const cuFloatComplex* p, const uint8_t* lab, int nref, bool add, bool conj,
+    const cuFloatComplex* x, cuFloatComplex* y);
+  void slice_in(Scratch& s, const cuFloatComplex* p, const uint8_t* lab, int nref, bool add, bool conj,
+    const cuFloatComplex* x, cuFloatComplex* y);
+  template <class Body>
+  void for_slices(Body body);
+
+  std::shared_ptr<PropagationContext> _ctx_;
+  std::shared_ptr<fftwf_plan_s> _plans_[2];
+  fftwf_plan fwd_plan, inv_plan;
+  int NX, NY, NW, NS, _nref_ = 0;
+  size_t NXY;
+  float _dz_, _eps_, _scale_;
+
+  std::vector<std::complex<float>*> _sref_;
+  const uint8_t* _labels_ = nullptr;
+  const int* _wmap_ = nullptr;
+  uint64_t generation = 0;
+  tbb::enumerable_thread_specific<Scratch> scratch;
+};
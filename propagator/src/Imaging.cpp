@@ -0,0 +1,74 @@
+#include <Imaging.h>
+
+Imaging::Imaging(const std::shared_ptr<hypercube>& domain, std::shared_ptr<Downward> source,
+complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream, Backend backend)
+: CudaOperator<complex3DReg, complex4DReg>(domain, source->getDomain(), model, data, grid, block, stream, backend), _source_(source) {
+
+  if (backend != source->getBackend()) throw std::invalid_argument("Imaging: the source is on another backend.");
+  prop = source->get_prop();
+  auto slow = prop->get_ref()->get_slow()->getHyper();
+  NZ = slow->getAxis(4).n;
+  NXY = size_t(domain->getAxis(1).n) * domain->getAxis(2).n;
+  if (domain->getAxis(1).n != slow->getAxis(1).n || domain->getAxis(2).n != slow->getAxis(2).n || domain->getAxis(3).n != NZ)
+    throw std::invalid_argument("Imaging: the image does not match the slowness model.");
+
+  launcher = Imaging_launcher(&img_forward, &img_adjoint, _grid_, _block_, _stream_);
+  // going down, replaying each depth from the checkpoints would cost O(nz) steps per depth
+  lockstep = dynamic_cast<CheckpointStore*>(source->get_store()) != nullptr;
+};
+
+void Imaging::image(complex_vector* src, complex_vector* rec, cuFloatComplex* img, bool adjoint) {
+  if (_backend_ == Backend::HOST) {
+    if (adjoint) img_adjoint_host(src, rec, img, true);
+    else img_forward_host(src, rec, img, true);
+  }
+  else if (adjoint) launcher.run_adj(src, rec, img, true);
+  else launcher.run_fwd(src, rec, img, true);
+};
+
+void Imaging::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+
+  auto ws = prop->get_workspace();
+  complex_vector* src = ws->acquire(getRange(), data->_grid_, data->_block_);
+  complex_vector* curr = add ? ws->acquire(getRange(), data->_grid_, data->_block_) : data;
+  curr->zero();
+
+  // from the deepest imaged depth up, each depth adds its scattered wavefield and all continue up together
+  for (int iz=NZ-2; iz >= 0; --iz) {
+    if (iz < NZ-2) {
+      prop->set_depth(iz);
+      prop->cu_forward(curr);
+    }
+    _source_->load_wfld(iz, src);
+    image(src, curr, model->mat + iz*NXY, false);
+  }
+
+  if (add) {
+    data->add(curr);
+    ws->release(curr);
+  }
+  ws->release(src);
+};
+
+void Imaging::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+
+  if (!add) model->zero();
+  auto ws = prop->get_workspace();
+  complex_vector* src = ws->acquire(getRange(), data->_grid_, data->_block_);
+  complex_vector* curr = ws->acquire(getRange(), data->_grid_, data->_block_);
+  curr->copy(data);
+
+  if (lockstep) _source_->load_wfld(0, src);
+  for (int iz=0; iz < NZ-1; ++iz) {
+    if (!lockstep) _source_->load_wfld(iz, src);
+    image(src, curr, model->mat + iz*NXY, true);
+    if (iz == NZ-2) break;
+
+    prop->set_depth(iz);
+    if (lockstep) prop->cu_forward(src);
+    prop->cu_adjoint(curr);
+  }
+
+  ws->release(curr);
+  ws->release(src);
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <CudaOperator.h>
+#include <complex3DReg.h>
+#include <complex4DReg.h>
+#include <OneWay.h>
+#include <prop_kernels.cuh>
+#include <prop_kernels_host.h>
+
+// Cross-correlation imaging with the receiver wavefields continued one depth at a time next to the
+// source wavefields of a Downward: image [nz, ny, nx] -> receiver wavefields at the surface [ns, nw, ny, nx].
+// The forward scatters the image on the source wavefields and continues them up, the adjoint continues
+// the receiver wavefields down and sums conj(source) * receiver over the sources and frequencies at each depth.
+// Only one depth of either side is held: the source comes from the store of the Downward (load_wfld) and
+// the receiver never goes through a 5d wavefield.
+// The bottom depth, below the last step, has no source wavefield and is not imaged.
+class Imaging : public CudaOperator<complex3DReg, complex4DReg> {
+public:
+  // source: forwarded before the imaging, on the same backend and stream; its propagator is shared
+  Imaging(const std::shared_ptr<hypercube>& domain, std::shared_ptr<Downward> source,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE);
+
+  void cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
+  void cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
+
+private:
+  std::shared_ptr<Downward> _source_;
+  OneStep* prop;
+  Imaging_launcher launcher;
+  int NZ;
+  size_t NXY;
+  // the source of the adjoint is propagated along with the receiver rather than replayed per depth
+  bool lockstep;
+
+  void image(complex_vector* src, complex_vector* rec, cuFloatComplex* img, bool adjoint);
+};
@@ -2,23 +2,23 @@
 #include <prop_kernels.cuh>
 #include <cuda.h>
 
-Injection::Injection(const std::shared_ptr<hypercube>& domain,const std::shared_ptr<hypercube>& range, complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream) 
-: CudaOperator<complex2DReg, complex5DReg>(domain, range, model, data, grid, block, stream) {
+Injection::Injection(const std::shared_ptr<hypercube>& domain,const std::shared_ptr<hypercube>& range, complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream, Backend backend) 
+: CudaOperator<complex2DReg, complex5DReg>(domain, range, model, data, grid, block, stream, backend) {
 
   launcher = Injection_launcher(&inj_forward, &inj_adjoint, _grid_, _block_, _stream_);
   
   ntrace = domain->getAxis(2).n; // sources or receivers
 
-  CHECK_CUDA_ERROR(cudaMalloc((void**)&d_cx, ntrace * sizeof(float)));
-  CHECK_CUDA_ERROR(cudaMalloc((void**)&d_cy, ntrace * sizeof(float)));
-  CHECK_CUDA_ERROR(cudaMalloc((void**)&d_cz, ntrace * sizeof(float)));
-  CHECK_CUDA_ERROR(cudaMalloc((void**)&d_ids, ntrace * sizeof(int)));
+  d_cx = alloc_param<float>(ntrace);
+  d_cy = alloc_param<float>(ntrace);
+  d_cz = alloc_param<float>(ntrace);
+  d_ids = alloc_param<int>(ntrace);
 };
 
 Injection::Injection(const std::shared_ptr<hypercube>& domain,const std::shared_ptr<hypercube>& range, 
 const std::vector<float>& cx, const std::vector<float>& cy, const std::vector<float>& cz, const std::vector<int>& ids, 
-complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream) 
-: Injection(domain, range, model, data, grid, block, stream) {
+complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream, Backend backend) 
+: Injection(domain, range, model, data, grid, block, stream, backend) {
   
   set_coords(cx, cy, cz, ids);
 
@@ -27,11 +27,13 @@ complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t
 
   
 void Injection::cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+  // the forward is a scatter and cannot overwrite in place
   if (!add) data->zero();
-  launcher.run_fwd(model, data, d_cx, d_cy, d_cz, d_ids);
+  if (_backend_ == Backend::HOST) inj_forward_host(model, data, d_cx, d_cy, d_cz, d_ids, true);
+  else launcher.run_fwd(model, data, d_cx, d_cy, d_cz, d_ids, true);
 
 };
 void Injection::cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) model->zero();
-  launcher.run_adj(model, data, d_cx, d_cy, d_cz, d_ids);
+  if (_backend_ == Backend::HOST) inj_adjoint_host(model, data, d_cx, d_cy, d_cz, d_ids, add);
+  else launcher.run_adj(model, data, d_cx, d_cy, d_cz, d_ids, add);
 };
@@ -5,7 +5,9 @@ using namespace SEP;
 
 void NSPS::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	  if(!add) model->zero();
+		if (blocked) return blocked->fan_out(add, true, data->mat, model->mat);
+
+		acquire_scratch();
 
 		// pad->forward(model,model_pad,0);
 	  fft2d->cu_forward(0,data,model_k);
@@ -18,16 +20,20 @@ void NSPS::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vect
 			fft2d->cu_adjoint(_wfld_ref);
 			// // taper->forward(_wfld_ref,_wfld_ref,1);
 			
+			// the labels partition the volume, see PSPI::cu_forward
 			select->set_value(iref);
-			select->cu_forward(1, _wfld_ref,model);
+			select->cu_scatter(add, _wfld_ref,model);
 		}
 
+		ws->release(_wfld_ref);
+		ws->release(model_k);
 }
 
 void NSPS::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-		if(!add)  data->zero();
-		model_k->zero();
+		if (blocked) return blocked->fan_in(add, false, model->mat, data->mat);
+
+		acquire_scratch();
 
 		for (int iref=0; iref < _nref_; ++iref) {
 
@@ -37,9 +43,11 @@ void NSPS::cu_forward(bool add, complex_vector* __restrict__ model, complex_vect
 			fft2d->cu_forward(_wfld_ref);
 
 			ps->set_slow(_ref_->get_ref_slow(get_depth(),iref));
-			ps->cu_forward(1, _wfld_ref, model_k);
+			ps->cu_forward(iref > 0, _wfld_ref, model_k);
 		}
 
-		fft2d->cu_adjoint(1, data, model_k);
+		ws->release(_wfld_ref);
+		fft2d->cu_adjoint(add, data, model_k);
+		ws->release(model_k);
 
 }
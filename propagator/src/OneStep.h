@@ -6,59 +6,109 @@
 #include <PhaseShift.h>
 #include <Selector.h>
 #include <FFT.h>
+#include <Workspace.h>
+#include <PropagationContext.h>
+#include <BlockedStep.h>
+#include <stdexcept>
   // operator to propagate 2D wavefield ONCE in (x-y) for multiple sources and freqs (ns-nw) 
 class OneStep : public CudaOperator<complex4DReg, complex4DReg>  {
 public:
   OneStep (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par, 
   complex_vector* model = nullptr, complex_vector* data = nullptr, 
-  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream) {
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneStep(domain, make_sampler(slow, par), nullptr, par, model, data, grid, block, stream, backend) {};
 
-    _nref_ = par->getInt("nref",1);
-    _ref_ = std::make_unique<RefSampler>(slow, _nref_);
-    ps = std::make_unique<PhaseShift>(domain, slow->getHyper()->getAxis(4).d, par->getFloat("eps",0.04), model_vec, data_vec, grid, block, stream);
+  // ref and ctx are shared with the other operators on the same slowness and domain, so running
+  // more of them only costs their wavefields. The sampler is only read: it has to be eager, a lazy
+  // one serves one propagator at a time and throws std::invalid_argument here when already in use
+  // (see RefSampler::attach). ctx may be null
+  OneStep (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx,
+  std::shared_ptr<paramObj> par, complex_vector* model = nullptr, complex_vector* data = nullptr, 
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream, backend), _ref_(ref) {
 
-    _wfld_ref = model_vec->cloneSpace();
+    if (_ref_ == nullptr) throw std::invalid_argument("OneStep: missing reference sampler.");
+    _nref_ = _ref_->_nref_;
+    auto slow = _ref_->get_slow();
+    ps = std::make_unique<PhaseShift>(domain, slow->getHyper()->getAxis(4).d, par->getFloat("eps",0.04), model_vec, data_vec, grid, block, stream, backend, ctx);
+    // phase-shift tables reused across depths and calls, within ps_cache_mb megabytes
+    size_t cache_mb = par->getInt("ps_cache_mb", 0);
+    if (cache_mb > 0) ps->set_table_cache(cache_mb << 20, par->getFloat("ps_cache_tol", 0.f));
+    // host backend: the whole step one (s,w) slice at a time (host_blocked = 0 for the volume sweeps,
+    // which can use the table cache)
+    if (backend == Backend::HOST && par->getInt("host_blocked", 1) && cache_mb == 0)
+      blocked = std::make_unique<BlockedStep>(domain, ps->get_context(), slow->getHyper()->getAxis(4).d, par->getFloat("eps",0.04));
 
-    model_k = model_vec->cloneSpace();
+    // the scratch wavefields are borrowed per call from the workspace shared by all operators on this stream
+    ws = Workspace::shared(backend, stream);
 
-    fft2d = std::make_unique<cuFFT2d>(domain, model_vec, data_vec, grid, block, stream);
-    select = std::make_unique<Selector>(domain, model_vec, data_vec, grid, block, stream);
+    if (backend == Backend::HOST) fft2d = std::make_unique<cpuFFT2d>(domain, model_vec, data_vec, grid, block, stream);
+    else fft2d = std::make_unique<cuFFT2d>(domain, model_vec, data_vec, grid, block, stream);
+    select = std::make_unique<Selector>(domain, model_vec, data_vec, grid, block, stream, backend);
+    _ref_->attach();
   };
 
   virtual ~OneStep() {
-    _wfld_ref->~complex_vector();
-    CHECK_CUDA_ERROR(cudaFree(_wfld_ref));
-    model_k->~complex_vector();
-    CHECK_CUDA_ERROR(cudaFree(model_k));
+    _ref_->detach();
+  };
+
+  static std::shared_ptr<RefSampler> make_sampler(const std::shared_ptr<complex4DReg>& slow, const std::shared_ptr<paramObj>& par) {
+    auto method = par->getString("ref_method", "histogram") == "opencv" ? RefSampler::Clustering::OPENCV : RefSampler::Clustering::HISTOGRAM;
+    // ref_cache: directory of the clustering results reused across runs of the same model
+    // ref_lazy: number of depths clustered ahead in the background instead of all up front
+    return std::make_shared<RefSampler>(slow, par->getInt("nref",1), method, par->getString("ref_cache", ""), par->getInt("ref_lazy", 0));
   };
 
   void set_depth(int iz) {
     _iz_ = iz;
-    select->set_labels(_ref_->get_ref_labels(iz));
+    if (blocked) {
+      std::vector<std::complex<float>*> sref(_nref_);
+      for (int iref=0; iref < _nref_; ++iref) sref[iref] = _ref_->get_ref_slow(iz, iref);
+      blocked->set_refs(sref, _ref_->get_ref_labels(iz), _ref_->get_ref_wmap(iz));
+    }
+    else select->set_labels(_ref_->get_ref_labels(iz), _ref_->get_ref_wmap(iz), _ref_->get_ref_offsets(iz), _nref_);
   };
   int& get_depth() {return _iz_;};
 
+  const std::shared_ptr<Workspace>& get_workspace() const {return ws;};
+  const std::shared_ptr<RefSampler>& get_ref() const {return _ref_;};
+  // the slice-blocked host engine, null on the device or with host_blocked = 0
+  BlockedStep* get_blocked() const {return blocked.get();};
+  // nullptr unless ps_cache_mb is set
+  PSTableCache* get_ps_tables() const {return ps->get_table_cache();};
+
 protected:
+  // valid between acquire_scratch and the releases at the end of each call
   complex_vector* _wfld_ref;
   complex_vector* model_k;
+  std::shared_ptr<Workspace> ws;
   int _nref_, _iz_;
   float _dz_;
-  std::unique_ptr<RefSampler> _ref_;
+  std::shared_ptr<RefSampler> _ref_;
   std::unique_ptr<PhaseShift> ps;
-  std::unique_ptr<cuFFT2d> fft2d;
+  std::unique_ptr<CudaOperator<complex4DReg, complex4DReg>> fft2d;
   std::unique_ptr<Selector> select;
+  // null unless host_blocked on the host backend
+  std::unique_ptr<BlockedStep> blocked;
   
   bool checkpoint = false;
   std::vector<complex_vector*> saved_wfld;
 
+  void acquire_scratch() {
+    model_k = ws->acquire(getDomain(), model_vec->_grid_, model_vec->_block_);
+    _wfld_ref = ws->acquire(getDomain(), model_vec->_grid_, model_vec->_block_);
+  };
+
 };
 
 class PSPI : public OneStep {
 public:
   PSPI (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par,
-  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  OneStep(domain, slow, par, model, data, grid, block, stream) {};
+  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneStep(domain, slow, par, model, data, grid, block, stream, backend) {};
+  PSPI (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx, std::shared_ptr<paramObj> par,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneStep(domain, ref, ctx, par, model, data, grid, block, stream, backend) {};
 
   void cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
   void cu_forward (complex_vector* __restrict__ model);
@@ -72,8 +122,11 @@ public:
 class NSPS : public OneStep {
 public:
   NSPS (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par,
-  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  OneStep(domain, slow, par, model, data, grid, block, stream) {};
+  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneStep(domain, slow, par, model, data, grid, block, stream, backend) {};
+  NSPS (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx, std::shared_ptr<paramObj> par,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneStep(domain, ref, ctx, par, model, data, grid, block, stream, backend) {};
 
   void cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
   void cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
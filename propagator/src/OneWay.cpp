@@ -1,28 +1,70 @@
 
 #include <OneWay.h>
+#include <numeric>
 
 using namespace SEP;
 
+void OneWay::save_wfld(int iz, complex_vector* curr) {
+	if (!store->wants(iz)) return;
+	if (auto dst = store->data(iz)) {
+		copy_out(dst, curr->mat, getDomainSizeInBytes());
+		return;
+	}
+	copy_out(staging.data(), curr->mat, getDomainSizeInBytes());
+	if (_backend_ == Backend::DEVICE) CHECK_CUDA_ERROR(cudaStreamSynchronize(_stream_));
+	store->put(iz, staging.data());
+}
+
+void OneWay::load_wfld(int iz, complex_vector* out) {
+	int c = store->restart(iz);
+	if (auto src = store->data(c)) copy_in(out->mat, src, getDomainSizeInBytes());
+	else {
+		// the staging buffer is free again once the copy is done
+		if (_backend_ == Backend::DEVICE) CHECK_CUDA_ERROR(cudaStreamSynchronize(_stream_));
+		store->get(c, staging.data());
+		copy_in(out->mat, staging.data(), getDomainSizeInBytes());
+	}
+
+	// replay from the checkpoint, leaving new ones on the way
+	for (int k=c; k < iz; ++k) {
+		if (k > c) save_wfld(k, out);
+		prop->set_depth(k);
+		prop->cu_forward(out);
+		++recomputed;
+	}
+}
+
 void Downward::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	if(!add) data->zero();
+	// propagate in the output (or a scratch vector when accumulating) to leave the model untouched
+	complex_vector* curr = add ? prop->get_workspace()->acquire(getDomain(), model->_grid_, model->_block_) : data;
+	curr->copy(model);
+	store->begin();
+	recomputed = 0;
 
-	// for (batches in z)
+	if (march()) {
+		std::vector<int> depths(m_ax[3].n-1);
+		std::iota(depths.begin(), depths.end(), 0);
+		prop->get_blocked()->march(*prop->get_ref(), depths, false, curr->mat, reinterpret_cast<cuFloatComplex*>(store->data(0)));
+	}
 
-	for (int iz=0; iz < m_ax[3].n-1; ++iz) {
+	// for (batches in z)
+	else for (int iz=0; iz < m_ax[3].n-1; ++iz) {
 	
 		// there should be an injection step here
 		// inj_src->forward(true, wavelet, temp)
 		
-		int offset = iz * this->getDomainSize();
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(wfld->getVals() + offset, model->mat, getDomainSizeInBytes(), cudaMemcpyDeviceToHost, _stream_));
+		save_wfld(iz, curr);
 		// propagate one step by changing the state of the wavefield
 		prop->set_depth(iz);
-		prop->cu_forward(model);
+		prop->cu_forward(curr);
 		
 	}
 
-	data->add(model);
+	if (add) {
+		data->add(curr);
+		prop->get_workspace()->release(curr);
+	}
 	
 	// prop->set_slow(slow->next_batch());
 	// cudaMemCpyAsync(_slow_chunk, slow->next(), H2D, stream);
@@ -32,46 +74,71 @@ void Downward::cu_forward(bool add, complex_vector* __restrict__ model, complex_
 
 void Downward::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	if(!add) model->zero();
+	complex_vector* curr = add ? prop->get_workspace()->acquire(getDomain(), data->_grid_, data->_block_) : model;
+	curr->copy(data);
 
-	for (int iz=m_ax[3].n-1; iz > 0; --iz) {
+	if (march()) {
+		std::vector<int> depths(m_ax[3].n-1);
+		std::iota(depths.rbegin(), depths.rend(), 0);
+		prop->get_blocked()->march(*prop->get_ref(), depths, true, curr->mat);
+	}
+
+	else for (int iz=m_ax[3].n-1; iz > 0; --iz) {
 		// propagate one step
 		prop->set_depth(iz-1);
-		prop->cu_adjoint(data);
+		prop->cu_adjoint(curr);
 	}
 
-	model->add(data);
-
+	if (add) {
+		model->add(curr);
+		prop->get_workspace()->release(curr);
+	}
 
 }
 
 void Upward::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	// if(!add) data->zero();
-	// for (int iz=ax[4].n-1; iz > 0; --iz) {
-	// 	// slice through 5d wfld to get 4d wfld
-	// 	model->view_at(curr, iz);
-	// 	data->view_at(next, iz-1);
-	// 	// propagate one step
-	// 	prop->set_depth(iz);
-	// 	prop->cu_forward(true, curr, next);
-	// 	CHECK_CUDA_ERROR( cudaDeviceSynchronize() );
-	// }
+	// from the bottom depth up to the surface, through the steps of Downward in reverse
+	complex_vector* curr = add ? prop->get_workspace()->acquire(getDomain(), model->_grid_, model->_block_) : data;
+	curr->copy(model);
+
+	if (march()) {
+		std::vector<int> depths(m_ax[3].n-1);
+		std::iota(depths.rbegin(), depths.rend(), 0);
+		prop->get_blocked()->march(*prop->get_ref(), depths, false, curr->mat);
+	}
+
+	else for (int iz=m_ax[3].n-1; iz > 0; --iz) {
+		prop->set_depth(iz-1);
+		prop->cu_forward(curr);
+	}
+
+	if (add) {
+		data->add(curr);
+		prop->get_workspace()->release(curr);
+	}
 
 }
 
 void Upward::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	// if(!add) model->zero();
-
-	// for (int iz=0; iz < ax[4].n-1; ++iz) {
-	// 	// slice through 5d wfld to get 4d wfld
-	// 	data->view_at(curr, iz);
-	// 	model->view_at(next, iz+1);
-	// 	// propagate one step
-	// 	prop->set_depth(iz+1);
-	// 	prop->cu_adjoint(true, next, curr);
-	// 	CHECK_CUDA_ERROR( cudaDeviceSynchronize() );
-	// }
+	complex_vector* curr = add ? prop->get_workspace()->acquire(getDomain(), data->_grid_, data->_block_) : model;
+	curr->copy(data);
+
+	if (march()) {
+		std::vector<int> depths(m_ax[3].n-1);
+		std::iota(depths.begin(), depths.end(), 0);
+		prop->get_blocked()->march(*prop->get_ref(), depths, true, curr->mat);
+	}
+
+	else for (int iz=0; iz < m_ax[3].n-1; ++iz) {
+		prop->set_depth(iz);
+		prop->cu_adjoint(curr);
+	}
+
+	if (add) {
+		model->add(curr);
+		prop->get_workspace()->release(curr);
+	}
 
 }
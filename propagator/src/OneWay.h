@@ -3,46 +3,96 @@
 #include <complex4DReg.h>
 #include <paramObj.h>
 #include <OneStep.h>
+#include <WavefieldStore.h>
+#include <cmath>
 
 // propagating wavefields in the volume [nz, ns, nw, ny, nx] from 0 to nz-1
 class OneWay : public CudaOperator<complex4DReg, complex4DReg>  {
 public:
   OneWay (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par, complex_vector* model = nullptr, complex_vector* data = nullptr, 
-  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream) {
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneWay(domain, OneStep::make_sampler(slow, par), nullptr, par, model, data, grid, block, stream, backend) {};
 
+  // ref and ctx shared with the other propagators of the same model, see OneStep
+  OneWay (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx, std::shared_ptr<paramObj> par,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, 
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream, backend) {
+
+    if (ref == nullptr) throw std::invalid_argument("OneWay: missing reference sampler.");
     auto ax = domain->getAxes();
-    m_ax = slow->getHyper()->getAxes();
-    // make a 5d wfld to store [nz, ns, nw, nx ,ny]
-    auto hyper = std::make_shared<hypercube>(ax[0], ax[1], ax[2], ax[3], m_ax[3]);
-    wfld = std::make_shared<complex5DReg>(hyper);
-    CHECK_CUDA_ERROR(cudaHostRegister(wfld->getVals(), this->getDomainSizeInBytes()*m_ax[3].n, cudaHostRegisterDefault));
+    m_ax = ref->get_slow()->getHyper()->getAxes();
+    // wfld_store: where the wavefield of every depth is kept, "memory" as a 5d wfld [nz, ns, nw, nx ,ny]
+    // or "sz3" compressed within the relative error bound wfld_eb, or "file" in a scratch file in
+    // wfld_dir written behind and read ahead through wfld_buffers host slices, or "checkpoint" keeping
+    // wfld_checkpoints of them (default log2(nz)+1) and recomputing the others (see WavefieldStore)
+    auto kind = par->getString("wfld_store", "memory");
+    if (kind == "sz3") store = std::make_unique<SZ3Store>(domain, m_ax[3].n, par->getFloat("wfld_eb", 1e-4));
+    else if (kind == "file") store = std::make_unique<FileStore>(domain, m_ax[3].n, par->getString("wfld_dir", ""), par->getInt("wfld_buffers", 4));
+    else if (kind == "checkpoint") {
+      int nslots = par->getInt("wfld_checkpoints", int(std::ceil(std::log2(std::max(m_ax[3].n, 2)))) + 1);
+      store = std::make_unique<CheckpointStore>(domain, m_ax[3].n, nslots);
+    }
+    else if (kind == "memory") store = std::make_unique<MemoryStore>(domain, m_ax[3].n, m_ax[3]);
+    else throw std::invalid_argument("OneWay: unknown wfld_store " + kind + ".");
+    // the other stores take the slices from a host staging buffer
+    if (store->data(0) == nullptr) staging.resize(store->slice_size());
+    pin_host(pinned(), store->data(0) ? this->getDomainSizeInBytes()*m_ax[3].n : this->getDomainSizeInBytes());
     // for now only support PSPI propagator
 
-    prop = std::make_unique<PSPI>(domain, slow, par, model_vec, data_vec, _grid_, _block_, _stream_);
+    prop = std::make_unique<PSPI>(domain, ref, ctx, par, model_vec, data_vec, _grid_, _block_, _stream_, _backend_);
+    // schedule = "frequency": on the host, each block of (s,w) slices goes through all the depths
+    // independently (BlockedStep::march) instead of the whole volume through one depth at a time
+    frequency_major = par->getString("schedule", "depth") == "frequency";
 
   };
 
+  // null unless the wavefields are kept in memory
   std::shared_ptr<complex5DReg> get_wfld() {
-    return wfld;
+    auto mem = dynamic_cast<MemoryStore*>(store.get());
+    return mem ? mem->get_wfld() : nullptr;
   }
+  WavefieldStore* get_store() const {return store.get();};
+  // the one-step propagator, also driven by the operators stepping alongside this one (see Imaging)
+  OneStep* get_prop() const {return prop.get();};
+
+  // the wavefield entering depth step iz, from the store or propagated from the nearest checkpoint
+  void load_wfld(int iz, complex_vector* out);
+  // steps repeated by load_wfld since the last forward propagation, per propagated step
+  double get_recompute_factor() const {return double(recomputed) / std::max(1, m_ax[3].n - 1);};
 
   virtual ~OneWay() {
-    CHECK_CUDA_ERROR(cudaHostUnregister(wfld->getVals()));
+    unpin_host(pinned());
   };
 
 protected:
   std::unique_ptr<OneStep> prop;
+  bool frequency_major;
+
+  // needs the blocked host engine, all the depths clustered up front and the wavefields in memory
+  bool march() const {
+    return frequency_major && prop->get_blocked() != nullptr && !prop->get_ref()->is_lazy() && store->data(0) != nullptr;
+  };
   std::vector<axis> m_ax;
-  std::shared_ptr<complex5DReg> wfld;
+  std::unique_ptr<WavefieldStore> store;
+  std::vector<std::complex<float>> staging;
+  size_t recomputed = 0;
+
+  void* pinned() {return store->data(0) ? (void*)store->data(0) : (void*)staging.data();};
+  // stores curr as the wavefield entering depth step iz
+  void save_wfld(int iz, complex_vector* curr);
 };
 
 class Downward : public OneWay {
 public:
   Downward (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par,
   complex_vector* model = nullptr, complex_vector* data = nullptr, 
-  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  OneWay(domain, slow, par, model, data, grid, block, stream) {};
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneWay(domain, slow, par, model, data, grid, block, stream, backend) {};
+  Downward (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx, std::shared_ptr<paramObj> par,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, 
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneWay(domain, ref, ctx, par, model, data, grid, block, stream, backend) {};
 
   void cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
   void cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
@@ -52,8 +102,12 @@ class Upward : public OneWay {
 public:
   Upward (const std::shared_ptr<hypercube>& domain, std::shared_ptr<complex4DReg> slow, std::shared_ptr<paramObj> par,
   complex_vector* model = nullptr, complex_vector* data = nullptr, 
-  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0) :
-  OneWay(domain, slow, par, model, data, grid, block, stream) {};
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneWay(domain, slow, par, model, data, grid, block, stream, backend) {};
+  Upward (const std::shared_ptr<hypercube>& domain, std::shared_ptr<RefSampler> ref, std::shared_ptr<PropagationContext> ctx, std::shared_ptr<paramObj> par,
+  complex_vector* model = nullptr, complex_vector* data = nullptr, 
+  dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) :
+  OneWay(domain, ref, ctx, par, model, data, grid, block, stream, backend) {};
 
   void cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
   void cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
@@ -5,7 +5,9 @@ using namespace SEP;
 
 void PSPI::cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-	  if(!add) data->zero();
+		if (blocked) return blocked->fan_out(add, false, model->mat, data->mat);
+
+		acquire_scratch();
 
 		// pad->forward(model,model_pad,0);
 	  fft2d->cu_forward(0,model,model_k);
@@ -18,16 +20,21 @@ void PSPI::cu_forward(bool add, complex_vector* __restrict__ model, complex_vect
 			fft2d->cu_adjoint(_wfld_ref);
 			// // taper->forward(_wfld_ref,_wfld_ref,1);
 			
+			// the labels partition the volume: each reference writes only its own points, so
+			// without add every point is still overwritten exactly once
 			select->set_value(iref);
-			select->cu_forward(1, _wfld_ref,data);
+			select->cu_scatter(add, _wfld_ref,data);
 		}
 
+		ws->release(_wfld_ref);
+		ws->release(model_k);
 }
 
 void PSPI::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
 
-		if(!add)  model->zero();
-		model_k->zero();
+		if (blocked) return blocked->fan_in(add, true, data->mat, model->mat);
+
+		acquire_scratch();
 
 		for (int iref=0; iref < _nref_; ++iref) {
 
@@ -37,10 +44,13 @@ void PSPI::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vect
 			fft2d->cu_forward(_wfld_ref);
 
 			ps->set_slow(_ref_->get_ref_slow(get_depth(),iref));
-			ps->cu_adjoint(1, model_k, _wfld_ref);
+			ps->cu_adjoint(iref > 0, model_k, _wfld_ref);
 		}
 
-		fft2d->cu_adjoint(1, model, model_k);
+		// released first, so that the FFT can reuse it to accumulate
+		ws->release(_wfld_ref);
+		fft2d->cu_adjoint(add, model, model_k);
+		ws->release(model_k);
 
 }
 
@@ -66,9 +76,12 @@ void PSPI::cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vect
 
 void PSPI::cu_forward(complex_vector* __restrict__ model) {
 
+		if (blocked) return blocked->fan_out(false, false, model->mat, model->mat);
+
+		acquire_scratch();
+
 		// pad->forward(model,model_pad,0);
 	  fft2d->cu_forward(0,model,model_k);
-		model->zero();
 
 		for (int iref=0; iref < _nref_; ++iref) {
 
@@ -79,14 +92,19 @@ void PSPI::cu_forward(complex_vector* __restrict__ model) {
 			// // taper->forward(_wfld_ref,_wfld_ref,1);
 			
 			select->set_value(iref);
-			select->cu_forward(1, _wfld_ref, model);
+			select->cu_scatter(false, _wfld_ref, model);
 		}
 
+		ws->release(_wfld_ref);
+		ws->release(model_k);
+
 }
 
 void PSPI::cu_adjoint(complex_vector* __restrict__ data) {
 
-		model_k->zero();
+		if (blocked) return blocked->fan_in(false, true, data->mat, data->mat);
+
+		acquire_scratch();
 
 		for (int iref=0; iref < _nref_; ++iref) {
 
@@ -96,9 +114,11 @@ void PSPI::cu_adjoint(complex_vector* __restrict__ data) {
 			fft2d->cu_forward(_wfld_ref);
 
 			ps->set_slow(_ref_->get_ref_slow(get_depth(),iref));
-			ps->cu_adjoint(1, model_k, _wfld_ref);
+			ps->cu_adjoint(iref > 0, model_k, _wfld_ref);
 		}
 
+		ws->release(_wfld_ref);
 		fft2d->cu_adjoint(0, data, model_k);
+		ws->release(model_k);
 
 }
@@ -0,0 +1,68 @@
+#include <PSTableCache.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+PSTableCache::PSTableCache(const std::shared_ptr<hypercube>& slice, size_t budget, float tolerance,
+  Backend backend, dim3 grid, dim3 block, cudaStream_t stream)
+: _slice_(slice), _backend_(backend), _grid_(grid), _block_(block), _stream_(stream), _budget_(budget) {
+  table_bytes = sizeof(cuFloatComplex) * slice->getN123();
+  // keep the mantissa bits that resolve the tolerance
+  _drop_ = 0;
+  if (tolerance > 0.f) _drop_ = std::clamp(23 - int(std::ceil(-std::log2(tolerance))), 0, 23);
+};
+
+PSTableCache::~PSTableCache() {
+  clear();
+};
+
+uint32_t PSTableCache::quantize(float v) const {
+  uint32_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  if (_drop_ == 0) return bits;
+  // round to nearest on the kept bits
+  return (bits + (1u << (_drop_ - 1))) >> _drop_;
+};
+
+void PSTableCache::begin() {
+  ++generation;
+};
+
+complex_vector* PSTableCache::lookup(std::complex<float> sref, int iw, bool& fresh) {
+  Key key = {quantize(sref.real()), quantize(sref.imag()), iw};
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    ++_hits_;
+    fresh = false;
+    lru.splice(lru.begin(), lru, it->second.pos);
+    it->second.used = generation;
+    return it->second.table;
+  }
+
+  ++_misses_;
+  fresh = true;
+  evict(table_bytes);
+  complex_vector* table = make_complex_vector(_slice_, _backend_, _grid_, _block_, _stream_);
+  lru.push_front(key);
+  entries[key] = {table, lru.begin(), generation};
+  return table;
+};
+
+void PSTableCache::evict(size_t needed) {
+  // the tables of the current request are in use and sit at the front
+  while (!lru.empty() && bytes() + needed > _budget_) {
+    auto it = entries.find(lru.back());
+    if (it->second.used == generation) break;
+    // syncs the stream, so a kernel still reading the table is done
+    free_complex_vector(it->second.table);
+    entries.erase(it);
+    lru.pop_back();
+    ++_evictions_;
+  }
+};
+
+void PSTableCache::clear() {
+  for (auto& e : entries) free_complex_vector(e.second.table);
+  entries.clear();
+  lru.clear();
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <list>
+#include <memory>
+#include <complex>
+#include <cstdint>
+#include <unordered_map>
+#include <complex_vector.h>
+
+// Precomputed phase-shift tables exp(-i kz dz) over one (kx, ky) slice, keyed by the reference
+// slowness and the frequency index. Layered models repeat the same reference slownesses across
+// depths and iterative imaging repeats the depths, so most tables are built only once.
+// The least recently used tables are dropped to stay within the budget, except the ones looked
+// up since the last begin(): all the frequencies of the current reference stay resident.
+class PSTableCache {
+public:
+  // tolerance: relative difference under which two slownesses share a table (0 = exact match)
+  PSTableCache(const std::shared_ptr<hypercube>& slice, size_t budget, float tolerance = 0.f,
+    Backend backend = Backend::DEVICE, dim3 grid = 1, dim3 block = 1, cudaStream_t stream = 0);
+  ~PSTableCache();
+
+  // start a new request (one set_slow)
+  void begin();
+  // the table of (sref, iw); fresh is set when it was just allocated and still has to be filled
+  complex_vector* lookup(std::complex<float> sref, int iw, bool& fresh);
+
+  size_t hits() const {return _hits_;};
+  size_t misses() const {return _misses_;};
+  size_t evictions() const {return _evictions_;};
+  double hit_rate() const {return _hits_ + _misses_ == 0 ? 0. : double(_hits_) / (_hits_ + _misses_);};
+  size_t bytes() const {return entries.size() * table_bytes;};
+  size_t size() const {return entries.size();};
+  size_t budget() const {return _budget_;};
+  void clear();
+
+private:
+  struct Key {
+    uint32_t re, im;
+    int iw;
+    bool operator==(const Key& k) const {return re == k.re && im == k.im && iw == k.iw;};
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return std::hash<uint64_t>()((uint64_t(k.re) << 32) | k.im) ^ (size_t(k.iw) * 0x9e3779b97f4a7c15ull);
+    };
+  };
+  struct Entry {
+    complex_vector* table;
+    std::list<Key>::iterator pos;
+    uint64_t used;
+  };
+
+  uint32_t quantize(float v) const;
+  void evict(size_t needed);
+
+  std::shared_ptr<hypercube> _slice_;
+  Backend _backend_;
+  dim3 _grid_, _block_;
+  cudaStream_t _stream_;
+  size_t _budget_, table_bytes;
+  // low mantissa bits dropped by the quantization
+  int _drop_;
+
+  // most recently used first
+  std::list<Key> lru;
+  std::unordered_map<Key, Entry, KeyHash> entries;
+  uint64_t generation = 0;
+  size_t _hits_ = 0, _misses_ = 0, _evictions_ = 0;
+};
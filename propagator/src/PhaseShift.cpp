@@ -1,43 +1,100 @@
 #include "PhaseShift.h"
 #include <prop_kernels.cuh>
 #include <cuda.h>
+#include <stdexcept>
 
 
 PhaseShift::PhaseShift(const std::shared_ptr<hypercube>& domain, float dz, float eps, 
-complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream) 
-: CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream), _dz_(dz), _eps_(eps) {
+complex_vector* model, complex_vector* data, dim3 grid, dim3 block, cudaStream_t stream, Backend backend,
+std::shared_ptr<PropagationContext> ctx) 
+: CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream, backend), _dz_(dz), _eps_(eps) {
 
   _grid_ = {32, 4, 4};
   _block_ = {16, 16, 4};
 
   launcher = PS_launcher(&ps_forward, &ps_adjoint, _grid_, _block_, _stream_);
   launcher_inv = PS_launcher(&ps_forward, &ps_inverse, _grid_, _block_, _stream_); 
+  table_launcher = PSTable_launcher(&ps_table_forward, &ps_table_adjoint, _grid_, _block_, _stream_);
+  table_launcher_inv = PSTable_launcher(&ps_table_forward, &ps_table_inverse, _grid_, _block_, _stream_);
 
-  d_w2 = fill_in_w(domain->getAxis(3));
-  d_ky = fill_in_k(domain->getAxis(2));
-  d_kx = fill_in_k(domain->getAxis(1));
+  if (ctx == nullptr) ctx = std::make_shared<PropagationContext>(domain, backend);
+  else if (ctx->getBackend() != backend || !ctx->matches(domain))
+    throw std::invalid_argument("PhaseShift: the propagation context belongs to another domain or backend.");
+  _ctx_ = ctx;
+  // the kernels only read them
+  d_w2 = const_cast<float*>(_ctx_->w2());
+  d_ky = const_cast<float*>(_ctx_->ky());
+  d_kx = const_cast<float*>(_ctx_->kx());
 
   _nw_ = domain->getAxis(3).n;
-  CHECK_CUDA_ERROR(cudaMalloc((void**)&_sref_, _nw_ * sizeof(std::complex<float>)));
+  _sref_ = alloc_param<cuFloatComplex>(_nw_);
+  d_tables = alloc_param<cuFloatComplex*>(_nw_);
+  d_build = alloc_param<int>(_nw_);
+  h_tables.resize(_nw_);
+  h_build.resize(_nw_);
 };
 
+void PhaseShift::set_table_cache(size_t budget, float tolerance) {
+  _tables_.reset();
+  tables_ready = false;
+  if (budget == 0) return;
+  auto ax = getDomain()->getAxes();
+  auto slice = std::make_shared<hypercube>(ax[0], ax[1]);
+  _tables_ = std::make_unique<PSTableCache>(slice, budget, tolerance, _backend_, _grid_, _block_, _stream_);
+}
+
+void PhaseShift::lookup_tables(const std::complex<float>* sref) {
+  _tables_->begin();
+  bool build = false;
+  for (int iw=0; iw < _nw_; ++iw) {
+    bool fresh;
+    h_tables[iw] = _tables_->lookup(sref[iw], iw, fresh)->mat;
+    h_build[iw] = fresh;
+    build |= fresh;
+  }
+  upload_param(d_tables, h_tables.data(), _nw_);
+  tables_ready = true;
+  if (!build) return;
+
+  // fill the new tables from the slowness just uploaded
+  int NX = getDomain()->getAxis(1).n;
+  int NY = getDomain()->getAxis(2).n;
+  upload_param(d_build, h_build.data(), _nw_);
+  if (_backend_ == Backend::HOST) ps_build_tables_host(d_tables, d_build, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, NX, NY, _nw_);
+  else launch_ps_build_tables(d_tables, d_build, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, NX, NY, _nw_, _grid_, _block_, _stream_);
+}
+
 void PhaseShift::set_grid_block(dim3 grid, dim3 block) {
   launcher.set_grid_block(grid, block);
   launcher_inv.set_grid_block(grid, block);
+  table_launcher.set_grid_block(grid, block);
+  table_launcher_inv.set_grid_block(grid, block);
 }
 
 void PhaseShift::cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) data->zero();
-  launcher.run_fwd(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_);
+  if (tables_ready) {
+    if (_backend_ == Backend::HOST) ps_table_forward_host(model, data, d_tables, add);
+    else table_launcher.run_fwd(model, data, d_tables, add);
+  }
+  else if (_backend_ == Backend::HOST) ps_forward_host(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
+  else launcher.run_fwd(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
 };
 
 
 void PhaseShift::cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) model->zero();
-  launcher.run_adj(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_);
+  if (tables_ready) {
+    if (_backend_ == Backend::HOST) ps_table_adjoint_host(model, data, d_tables, add);
+    else table_launcher.run_adj(model, data, d_tables, add);
+  }
+  else if (_backend_ == Backend::HOST) ps_adjoint_host(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
+  else launcher.run_adj(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
 }
 
 void PhaseShift::cu_inverse (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-  if (!add) model->zero();
-  launcher_inv.run_adj(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_);
+  if (tables_ready) {
+    if (_backend_ == Backend::HOST) ps_table_inverse_host(model, data, d_tables, add);
+    else table_launcher_inv.run_adj(model, data, d_tables, add);
+  }
+  else if (_backend_ == Backend::HOST) ps_inverse_host(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
+  else launcher_inv.run_adj(model, data, d_w2, d_kx, d_ky, _sref_, _dz_, _eps_, add);
 }
@@ -5,6 +5,9 @@
 #include <KernelLauncher.cuh>
 #include <cuComplex.h>
 #include <prop_kernels.cuh>
+#include <prop_kernels_host.h>
+#include <PSTableCache.h>
+#include <PropagationContext.h>
 
 using namespace SEP;
 
@@ -12,61 +15,54 @@ class PhaseShift :  public CudaOperator<complex4DReg, complex4DReg> {
 public:
     PhaseShift(const std::shared_ptr<hypercube>& domain, float dz, float eps = 0.0f, 
     complex_vector* model = nullptr, complex_vector* data = nullptr, 
-    dim3 grid=1, dim3 block=1, cudaStream_t stream = 0);
+    dim3 grid=1, dim3 block=1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE,
+    std::shared_ptr<PropagationContext> ctx = nullptr);
 
     void cu_forward (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
     void cu_adjoint (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
     void cu_inverse (bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data);
 
     void set_slow(std::complex<float>* sref) {
-        CHECK_CUDA_ERROR(cudaMemcpyAsync(_sref_, sref, _nw_*sizeof(std::complex<float>), cudaMemcpyHostToDevice, _stream_));
+        upload_param(_sref_, reinterpret_cast<cuFloatComplex*>(sref), _nw_);
+        if (_tables_) lookup_tables(sref);
     }
 
+    // Propagate with precomputed tables per (reference slowness, frequency) instead of evaluating
+    // the square roots and exponentials at every call. budget is in bytes (0 disables the cache);
+    // effective from the next set_slow.
+    void set_table_cache(size_t budget, float tolerance = 0.f);
+    PSTableCache* get_table_cache() const {return _tables_.get();};
+    const std::shared_ptr<PropagationContext>& get_context() const {return _ctx_;};
+
     virtual void set_grid_block(dim3 grid, dim3 block);
 
     ~PhaseShift() {
-        CHECK_CUDA_ERROR(cudaFree(d_w2));
-        CHECK_CUDA_ERROR(cudaFree(d_kx));
-        CHECK_CUDA_ERROR(cudaFree(d_ky));
-        CHECK_CUDA_ERROR(cudaFree(_sref_));
+        _tables_.reset();
+        free_param(_sref_);
+        free_param(d_tables);
+        free_param(d_build);
     }
 
 protected:
     PS_launcher launcher;
     PS_launcher launcher_inv;
+    PSTable_launcher table_launcher;
+    PSTable_launcher table_launcher_inv;
     cuFloatComplex* _sref_;
+    // the tables of the current reference slowness, one per frequency
+    std::unique_ptr<PSTableCache> _tables_;
+    bool tables_ready = false;
+    cuFloatComplex** d_tables;
+    int* d_build;
+    std::vector<cuFloatComplex*> h_tables;
+    std::vector<int> h_build;
+    // the axes of the domain, shared with the other operators given the same context
+    std::shared_ptr<PropagationContext> _ctx_;
     float *d_w2, *d_kx, *d_ky;
     float _dz_;
     float _eps_;
     int _nw_;
 
-    float* fill_in_k(const axis& ax) {
-        float *k;
-        CHECK_CUDA_ERROR(cudaMalloc((void **)&k, sizeof(float)*ax.n));
-        auto h_k = std::vector<float>(ax.n);
-	    int n_half = ax.n / 2;
-        float dk = 2*M_PI/(ax.d*ax.n);  // Note: changed to ax.n instead of (ax.n-1)
-        for (int ik = 0; ik <= n_half; ik++) {
-            h_k[ik] = ik * dk;
-        }
-        for (int ik = n_half + 1; ik < ax.n; ik++) {
-            h_k[ik] = (ik - ax.n) * dk;
-        }
-        CHECK_CUDA_ERROR(cudaMemcpyAsync(k, h_k.data(), sizeof(float)*ax.n, cudaMemcpyHostToDevice, _stream_));
-        return k;
-    }
-
-    float* fill_in_w(const axis& ax) {
-        float *w;
-        CHECK_CUDA_ERROR(cudaMalloc((void **)&w, sizeof(float)*ax.n));
-        auto h_w = std::vector<float>(ax.n);
-        for (int i=0; i < h_w.size(); ++i) {
-            float f = ax.o + i*ax.d;
-            f = 2*M_PI*f;
-            h_w[i] = f*f;
-        }
-        CHECK_CUDA_ERROR(cudaMemcpyAsync(w, h_w.data(), sizeof(float)*ax.n, cudaMemcpyHostToDevice, _stream_));
-        return w;
-    }
+    void lookup_tables(const std::complex<float>* sref);
 
 };
@@ -0,0 +1,62 @@
+#include <PropagationContext.h>
+#include <cmath>
+#include <vector>
+
+PropagationContext::PropagationContext(const std::shared_ptr<hypercube>& domain, Backend backend)
+: _domain_(domain), _backend_(backend) {
+  d_w2 = fill_in_w(domain->getAxis(3));
+  d_ky = fill_in_k(domain->getAxis(2));
+  d_kx = fill_in_k(domain->getAxis(1));
+};
+
+PropagationContext::~PropagationContext() {
+  for (float* p : {d_w2, d_kx, d_ky}) {
+    if (_backend_ == Backend::HOST) delete[] p;
+    else CHECK_CUDA_ERROR(cudaFree(p));
+  }
+};
+
+bool PropagationContext::matches(const std::shared_ptr<hypercube>& domain) const {
+  for (int i=1; i <= 3; ++i) {
+    const axis a = _domain_->getAxis(i), b = domain->getAxis(i);
+    if (a.n != b.n || a.o != b.o || a.d != b.d) return false;
+  }
+  return true;
+};
+
+float* PropagationContext::upload(const std::vector<float>& h) {
+  float* ptr;
+  if (_backend_ == Backend::HOST) {
+    ptr = new float[h.size()];
+    std::copy(h.begin(), h.end(), ptr);
+  }
+  else {
+    CHECK_CUDA_ERROR(cudaMalloc((void **)&ptr, sizeof(float)*h.size()));
+    // synchronous, so the operators on other streams see the values
+    CHECK_CUDA_ERROR(cudaMemcpy(ptr, h.data(), sizeof(float)*h.size(), cudaMemcpyHostToDevice));
+  }
+  return ptr;
+};
+
+float* PropagationContext::fill_in_k(const axis& ax) {
+  auto h_k = std::vector<float>(ax.n);
+  int n_half = ax.n / 2;
+  float dk = 2*M_PI/(ax.d*ax.n);  // Note: changed to ax.n instead of (ax.n-1)
+  for (int ik = 0; ik <= n_half; ik++) {
+    h_k[ik] = ik * dk;
+  }
+  for (int ik = n_half + 1; ik < ax.n; ik++) {
+    h_k[ik] = (ik - ax.n) * dk;
+  }
+  return upload(h_k);
+};
+
+float* PropagationContext::fill_in_w(const axis& ax) {
+  auto h_w = std::vector<float>(ax.n);
+  for (int i=0; i < h_w.size(); ++i) {
+    float f = ax.o + i*ax.d;
+    f = 2*M_PI*f;
+    h_w[i] = f*f;
+  }
+  return upload(h_w);
+};
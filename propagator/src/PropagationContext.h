@@ -0,0 +1,35 @@
+#pragma once
+#include <memory>
+#include <hypercube.h>
+#include <complex_vector.h>
+
+using namespace SEP;
+
+// Read-only wavenumber and frequency axes of a propagation domain [ns, nw, ny, nx]: w2 = (2 pi f)^2,
+// ky and kx in FFT order. Built once and shared by all the phase-shift operators on that domain and
+// backend, whatever their stream: the arrays are uploaded synchronously and never written again.
+class PropagationContext {
+public:
+  PropagationContext(const std::shared_ptr<hypercube>& domain, Backend backend = Backend::DEVICE);
+  ~PropagationContext();
+
+  PropagationContext(const PropagationContext&) = delete;
+  PropagationContext& operator=(const PropagationContext&) = delete;
+
+  // same (nx, ny, nw) axes, so the arrays apply to that domain
+  bool matches(const std::shared_ptr<hypercube>& domain) const;
+  Backend getBackend() const {return _backend_;};
+
+  const float* w2() const {return d_w2;};
+  const float* kx() const {return d_kx;};
+  const float* ky() const {return d_ky;};
+
+private:
+  float* fill_in_k(const axis& ax);
+  float* fill_in_w(const axis& ax);
+  float* upload(const std::vector<float>& h);
+
+  std::shared_ptr<hypercube> _domain_;
+  Backend _backend_;
+  float *d_w2, *d_kx, *d_ky;
+};
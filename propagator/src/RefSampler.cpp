@@ -4,6 +4,19 @@
 #include <functional>
 #include <vector>
 #include <utility>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "opencv2/core.hpp"
 #include <tbb/tbb.h>
 #include <tbb/blocked_range2d.h>
@@ -12,42 +25,568 @@
 using namespace SEP;
 using namespace std::placeholders;
 
-RefSampler::RefSampler(const std::shared_ptr<complex4DReg>& slow, int nref) : _slow_(slow) {
+namespace {
+
+// nearest center of every point; k outer and points inner over small blocks so that the
+// distance loop vectorizes
+void nearest(const std::complex<float>* s, size_t n, const std::complex<float>* centers, int nref, uint8_t* labels) {
+	constexpr int B = 256;
+	float re[B], im[B], best[B];
+	for (size_t i0=0; i0 < n; i0 += B) {
+		int m = std::min<size_t>(B, n - i0);
+		for (int i=0; i < m; ++i) {
+			re[i] = s[i0+i].real();
+			im[i] = s[i0+i].imag();
+			best[i] = std::numeric_limits<float>::max();
+			labels[i0+i] = 0;
+		}
+		uint8_t* lab = labels + i0;
+		for (int k=0; k < nref; ++k) {
+			float cr = centers[k].real(), ci = centers[k].imag();
+			for (int i=0; i < m; ++i) {
+				float dr = re[i] - cr, di = im[i] - ci;
+				float d = dr*dr + di*di;
+				bool closer = d < best[i];
+				best[i] = closer ? d : best[i];
+				lab[i] = closer ? k : lab[i];
+			}
+		}
+	}
+}
+
+// weighted means of the clusters; a center left without points moves to the point that is
+// furthest from its own center, the usual k-means reseeding
+void update_centers(const std::complex<float>* s, const float* w, size_t n, const uint8_t* labels,
+	std::complex<float>* centers, int nref) {
+	std::vector<double> sw(nref, 0.), sre(nref, 0.), sim(nref, 0.);
+	for (size_t i=0; i < n; ++i) {
+		float wi = w ? w[i] : 1.f;
+		sw[labels[i]] += wi;
+		sre[labels[i]] += double(wi) * s[i].real();
+		sim[labels[i]] += double(wi) * s[i].imag();
+	}
+	for (int k=0; k < nref; ++k)
+		if (sw[k] > 0.) centers[k] = std::complex<float>(sre[k] / sw[k], sim[k] / sw[k]);
+
+	for (int k=0; k < nref; ++k) {
+		if (sw[k] > 0.) continue;
+		size_t far = 0;
+		float dmax = -1.f;
+		for (size_t i=0; i < n; ++i) {
+			float d = (w ? w[i] : 1.f) * std::norm(s[i] - centers[labels[i]]);
+			if (d > dmax) {dmax = d; far = i;}
+		}
+		centers[k] = s[far];
+	}
+}
+
+// Lloyd on a histogram of the slice: the slowness takes few distinct values compared to the
+// number of points, so the iterations run on at most NBINS^2 weighted bin means instead, then
+// one exact pass gives the labels and centers from the points themselves.
+// centers is the warm start when warm is set, and returns the references
+void histogram_slice(const std::complex<float>* s, size_t n, int nref, uint8_t* labels,
+	std::complex<float>* centers, bool warm) {
+	constexpr int NBINS = 64;
+	constexpr int MAXITER = 100;
+
+	// histogram over the bounding box; a single row when the slice is real or has one attenuation
+	float re0 = s[0].real(), re1 = re0, im0 = s[0].imag(), im1 = im0;
+	for (size_t i=1; i < n; ++i) {
+		re0 = std::min(re0, s[i].real()); re1 = std::max(re1, s[i].real());
+		im0 = std::min(im0, s[i].imag()); im1 = std::max(im1, s[i].imag());
+	}
+	int nre = re1 > re0 ? NBINS : 1;
+	int nim = im1 > im0 ? NBINS : 1;
+	float sre = re1 > re0 ? nre / (re1 - re0) : 0.f;
+	float sim = im1 > im0 ? nim / (im1 - im0) : 0.f;
+	std::vector<double> hw(nre*nim, 0.), hre(nre*nim, 0.), him(nre*nim, 0.);
+	for (size_t i=0; i < n; ++i) {
+		int bre = std::min(int((s[i].real() - re0) * sre), nre - 1);
+		int bim = std::min(int((s[i].imag() - im0) * sim), nim - 1);
+		int b = bre + bim*nre;
+		hw[b] += 1.;
+		hre[b] += s[i].real();
+		him[b] += s[i].imag();
+	}
+	std::vector<std::complex<float>> bins;
+	std::vector<float> weights;
+	for (int b=0; b < nre*nim; ++b) {
+		if (hw[b] == 0.) continue;
+		bins.emplace_back(hre[b] / hw[b], him[b] / hw[b]);
+		weights.push_back(hw[b]);
+	}
+
+	if (!warm) {
+		// cold start at the weighted quantiles of the real part
+		std::vector<int> order(bins.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](int a, int b) {return bins[a].real() < bins[b].real();});
+		double cum = 0.;
+		size_t j = 0;
+		for (int k=0; k < nref; ++k) {
+			double target = (k + 0.5) * n / nref;
+			while (j + 1 < order.size() && cum + weights[order[j]] < target) cum += weights[order[j++]];
+			centers[k] = bins[order[j]];
+		}
+	}
+
+	std::vector<uint8_t> bin_labels(bins.size(), 0), prev;
+	for (int it=0; it < MAXITER; ++it) {
+		prev = bin_labels;
+		nearest(bins.data(), bins.size(), centers, nref, bin_labels.data());
+		if (it > 0 && prev == bin_labels) break;
+		update_centers(bins.data(), weights.data(), bins.size(), bin_labels.data(), centers, nref);
+	}
+
+	nearest(s, n, centers, nref, labels);
+	update_centers(s, nullptr, n, labels, centers, nref);
+}
+
+void opencv_slice(const std::complex<float>* s, size_t n, int nref, uint8_t* labels, std::complex<float>* centers) {
+	// prepare opencv matrices for processing
+	cv::Mat_<std::complex<float>> slow_slice(n, 1, const_cast<std::complex<float>*>(s));
+	// opencv labels are int, narrowed afterwards
+	std::vector<int> int_labels(n);
+	cv::Mat_<int> cv_labels(n, 1, int_labels.data());
+	cv::Mat_<std::complex<float>> cv_centers(nref, 1);
+	// stopping criteria
+	cv::TermCriteria criteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 100, 1e-12);
+	// compute centers & labels
+	cv::kmeans(slow_slice, nref, cv_labels, criteria, 1, cv::KMEANS_PP_CENTERS, cv_centers);
+	std::copy(int_labels.begin(), int_labels.end(), labels);
+	for (int iref=0; iref < nref; ++iref) centers[iref] = cv_centers.at<std::complex<float>>(iref, 0);
+}
+
+// prefix sum of the label counts over the (x,y,w) points, with the labels stored once per
+// distinct slice: frequency iw reads slice wmap[iw]
+void count_slices(const uint8_t* labels, const int* wmap, int nw, size_t n, int nref, int* offsets) {
+	int nslices = *std::max_element(wmap, wmap + nw) + 1;
+	std::vector<int> counts(size_t(nslices)*nref, 0);
+	for (int d=0; d < nslices; ++d)
+		for (size_t i=0; i < n; ++i) ++counts[d*nref + labels[d*n + i]];
+	std::fill(offsets, offsets + nref+1, 0);
+	for (int iw=0; iw < nw; ++iw)
+		for (int l=0; l < nref; ++l) offsets[l+1] += counts[wmap[iw]*nref + l];
+	std::partial_sum(offsets, offsets + nref+1, offsets);
+}
+
+uint64_t fnv1a(const void* data, size_t nbytes, uint64_t h = 0xcbf29ce484222325ull) {
+	constexpr uint64_t PRIME = 0x100000001b3ull;
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	size_t i = 0;
+	for (; i + 8 <= nbytes; i += 8) {
+		uint64_t w;
+		std::memcpy(&w, bytes + i, 8);
+		h = (h ^ w) * PRIME;
+	}
+	for (; i < nbytes; ++i) h = (h ^ bytes[i]) * PRIME;
+	return h;
+}
+
+}
+
+// lazy mode: a ring of depths clustered ahead by a background thread, in the direction of the requests
+struct RefSampler::RingSlot {
+	int iz = -1;
+	bool ready = false;
+	std::vector<uint8_t> labels;
+	std::vector<int> offsets;
+};
+
+struct RefSampler::Ring {
+	std::vector<RingSlot> slots;
+	// the slice map and references of the depth are set: later visits only relabel
+	std::vector<char> known;
+	// last references of each frequency, warm start of the next depth [nw][nref]
+	std::vector<std::complex<float>> warm;
+	bool have_warm = false;
+	int current = -1, direction = 1;
+	bool stop = false;
+	std::mutex m;
+	std::condition_variable work, done;
+	std::thread worker;
+
+	int find(int iz) const {
+		for (size_t i=0; i < slots.size(); ++i) if (slots[i].iz == iz) return i;
+		return -1;
+	}
+	bool in_window(int iz) const {
+		int k = (iz - current) * direction;
+		return iz >= 0 && k >= 0 && k < int(slots.size());
+	}
+	// next depth of the window that is not resident, and a slot outside the window for it
+	bool next_job(int nz, int& iz, int& slot) const {
+		if (current < 0) return false;
+		for (int k=0; k < int(slots.size()); ++k) {
+			int jz = current + k*direction;
+			if (jz < 0 || jz >= nz) return false;
+			if (find(jz) >= 0) continue;
+			for (size_t i=0; i < slots.size(); ++i) {
+				if (slots[i].iz >= 0 && in_window(slots[i].iz)) continue;
+				iz = jz;
+				slot = i;
+				return true;
+			}
+			return false;
+		}
+		return false;
+	}
+};
+
+RefSampler::RefSampler(const std::shared_ptr<complex4DReg>& slow, int nref, Clustering method, const std::string& cache_dir,
+	int lazy) : _slow_(slow), _method_(method) {
+			if (nref < 1 || nref > 256) throw std::invalid_argument("RefSampler: nref must be within [1, 256]");
 			_nref_ = nref;
 			_nx_ = _slow_->getHyper()->getAxis(1).n;
 			_ny_ = _slow_->getHyper()->getAxis(2).n;
 			_nw_ = _slow_->getHyper()->getAxis(3).n;
 			_nz_ = _slow_->getHyper()->getAxis(4).n;
 
-			ref_labels.resize(boost::extents[_nz_][_nw_][_ny_][_nx_]);
 			slow_ref.resize(boost::extents[_nz_][_nref_][_nw_]);
-			kmeans_sample();
+			_slow_ref_ = slow_ref.data();
+			ref_wmap.resize(size_t(_nz_)*_nw_);
+			_wmap_ = ref_wmap.data();
+			if (lazy > 0) {
+				start_ring(std::max(lazy, 2));
+				return;
+			}
+
+			std::string path;
+			uint64_t hash = 0;
+			if (!cache_dir.empty()) {
+				hash = slowness_hash();
+				path = cache_path(cache_dir, hash, method);
+				if (load_cache(path, hash, method)) return;
+			}
+
+			sample_all();
+			count_labels();
+
+			if (!path.empty()) save_cache(path, hash, method);
 		};
 
+RefSampler::~RefSampler() {
+	if (_ring_) {
+		{
+			std::lock_guard<std::mutex> lock(_ring_->m);
+			_ring_->stop = true;
+		}
+		_ring_->work.notify_one();
+		_ring_->worker.join();
+	}
+	if (_map_) munmap(_map_, _map_bytes_);
+};
 
-void RefSampler::kmeans_sample() {
-	tbb::parallel_for(tbb::blocked_range2d<int>(0,_nw_,0,_nz_),
-		[=](const tbb::blocked_range2d<int> &r) {
-		for (int iz=r.cols().begin(); iz < r.cols().end(); iz++) {
-			for (int iw=r.rows().begin(); iw < r.rows().end(); iw++) {
-				int offset = (iw + iz*_nw_)*_nx_*_ny_;
-				std::complex<float>* ptr_slow_ref = _slow_->getVals() + offset;
-				int* ptr_labels = ref_labels.data() + offset; 
-				// prepare opencv matrices for processing
-				cv::Mat_<std::complex<float>> slow_slice(_nx_*_ny_, 1, ptr_slow_ref);
-				cv::Mat_<int> labels(_nx_*_ny_, 1, ptr_labels);
-				cv::Mat_<std::complex<float>> centers(_nref_, 1);
-				// stopping criteria
-				cv::TermCriteria criteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 100, 1e-12);
-				// compute centers & labels
-				double obj = cv::kmeans(slow_slice, _nref_, labels, criteria, 1, cv::KMEANS_PP_CENTERS, centers);
-				// copy to slow_ref array
-				for (int iref=0; iref < _nref_; ++iref) {
-					std::complex<float> sref = centers.at<std::complex<float>>(iref, 0);
-					slow_ref[iz][iref][iw] = sref;
-				}
-			}
+void RefSampler::attach() {
+	if (_users_++ > 0 && is_lazy()) {
+		--_users_;
+		throw std::invalid_argument("RefSampler: a lazy sampler serves one propagator, build one per operator.");
+	}
+};
+
+void RefSampler::cluster_slice(int iz, int iw, uint8_t* labels, std::complex<float>* centers, bool warm) {
+	size_t n = size_t(_nx_)*_ny_;
+	const std::complex<float>* s = _slow_->getVals() + (iw + size_t(iz)*_nw_)*n;
+	if (_method_ == Clustering::OPENCV) opencv_slice(s, n, _nref_, labels, centers);
+	else histogram_slice(s, n, _nref_, labels, centers, warm);
+}
+
+// frequencies whose slowness slices are identical share one slice: wmap[iw] is the slice of iw,
+// numbered in order of first appearance. Returns the number of distinct slices
+int RefSampler::map_slices(int iz, int* wmap) const {
+	size_t n = size_t(_nx_)*_ny_;
+	const std::complex<float>* s = _slow_->getVals() + size_t(iz)*_nw_*n;
+	std::vector<uint64_t> hash(_nw_);
+	tbb::parallel_for(0, _nw_, [&](int iw) {hash[iw] = fnv1a(s + iw*n, sizeof(std::complex<float>)*n);});
+
+	std::vector<int> first;
+	for (int iw=0; iw < _nw_; ++iw) {
+		wmap[iw] = -1;
+		for (size_t d=0; d < first.size() && wmap[iw] < 0; ++d)
+			if (hash[first[d]] == hash[iw] && std::memcmp(s + first[d]*n, s + iw*n, sizeof(std::complex<float>)*n) == 0) wmap[iw] = d;
+		if (wmap[iw] < 0) {
+			wmap[iw] = first.size();
+			first.push_back(iw);
 		}
+	}
+	return first.size();
+}
+
+// clusters the distinct slices of depth iz into labels [nslices][ny][nx] and sets its references.
+// warm [nw][nref] holds the last references of each frequency and is updated
+void RefSampler::cluster_depth(int iz, uint8_t* labels, std::complex<float>* warm, bool use_warm) {
+	size_t n = size_t(_nx_)*_ny_;
+	const int* wmap = _wmap_ + iz*_nw_;
+	int nslices = *std::max_element(wmap, wmap + _nw_) + 1;
+	std::vector<int> first(nslices, -1);
+	for (int iw=_nw_-1; iw >= 0; --iw) first[wmap[iw]] = iw;
+
+	tbb::parallel_for(0, nslices, [&](int d) {
+		std::vector<std::complex<float>> centers(warm + first[d]*_nref_, warm + (first[d]+1)*_nref_);
+		cluster_slice(iz, first[d], labels + d*n, centers.data(), use_warm);
+		for (int iw=0; iw < _nw_; ++iw) {
+			if (wmap[iw] != d) continue;
+			std::copy(centers.begin(), centers.end(), warm + iw*_nref_);
+			for (int iref=0; iref < _nref_; ++iref) slow_ref[iz][iref][iw] = centers[iref];
+		}
+	});
+}
+
+// the histogram clustering is warm started along depth, so its depths are sequential and the
+// distinct slices of a depth run in parallel; cv::kmeans runs on all the depths at once
+void RefSampler::sample_all() {
+	size_t n = size_t(_nx_)*_ny_;
+	ref_slices.resize(_nz_+1);
+	_slices_ = ref_slices.data();
+	tbb::parallel_for(0, _nz_, [=](int iz) {ref_slices[iz+1] = map_slices(iz, ref_wmap.data() + iz*_nw_);});
+	ref_slices[0] = 0;
+	std::partial_sum(ref_slices.begin(), ref_slices.end(), ref_slices.begin());
+	ref_labels.resize(ref_slices[_nz_]*n);
+	_labels_ = ref_labels.data();
+
+	if (_method_ == Clustering::OPENCV) {
+		tbb::parallel_for(0, _nz_, [=](int iz) {
+			std::vector<std::complex<float>> warm(size_t(_nw_)*_nref_);
+			cluster_depth(iz, _labels_ + _slices_[iz]*n, warm.data(), false);
+		});
+	}
+	else {
+		std::vector<std::complex<float>> warm(size_t(_nw_)*_nref_);
+		for (int iz=0; iz < _nz_; ++iz) cluster_depth(iz, _labels_ + _slices_[iz]*n, warm.data(), iz > 0);
+	}
+}
+
+void RefSampler::start_ring(int nslots) {
+	_ring_ = std::make_unique<Ring>();
+	size_t size = size_t(_nw_)*_ny_*_nx_;
+	_ring_->slots.resize(nslots);
+	for (auto& slot : _ring_->slots) {
+		slot.labels.resize(size);
+		slot.offsets.resize(_nref_+1);
+	}
+	_ring_->known.assign(_nz_, 0);
+	_ring_->warm.resize(size_t(_nw_)*_nref_);
+	_ring_->worker = std::thread([this] {ring_worker();});
+}
+
+void RefSampler::ring_worker() {
+	Ring& r = *_ring_;
+	std::unique_lock<std::mutex> lock(r.m);
+	while (true) {
+		int iz, slot;
+		r.work.wait(lock, [&] {return r.stop || r.next_job(_nz_, iz, slot);});
+		if (r.stop) return;
+		r.slots[slot].iz = iz;
+		r.slots[slot].ready = false;
+		lock.unlock();
+		fill_slot(iz, r.slots[slot]);
+		lock.lock();
+		r.slots[slot].ready = true;
+		r.done.notify_all();
+	}
+}
+
+// clusters depth iz on its first visit; every visit labels the points with the nearest
+// reference, so a depth revisited after eviction gets the same labels
+void RefSampler::fill_slot(int iz, RingSlot& slot) {
+	Ring& r = *_ring_;
+	size_t n = size_t(_nx_)*_ny_;
+	int* wmap = _wmap_ + iz*_nw_;
+	if (!r.known[iz]) {
+		map_slices(iz, wmap);
+		cluster_depth(iz, slot.labels.data(), r.warm.data(), r.have_warm);
+		r.have_warm = true;
+		r.known[iz] = 1;
+	}
+	int nslices = *std::max_element(wmap, wmap + _nw_) + 1;
+	std::vector<int> first(nslices, -1);
+	for (int iw=_nw_-1; iw >= 0; --iw) first[wmap[iw]] = iw;
+	tbb::parallel_for(0, nslices, [&](int d) {
+		std::vector<std::complex<float>> centers(_nref_);
+		for (int iref=0; iref < _nref_; ++iref) centers[iref] = slow_ref[iz][iref][first[d]];
+		nearest(_slow_->getVals() + (first[d] + size_t(iz)*_nw_)*n, n, centers.data(), _nref_, slot.labels.data() + d*n);
 	});
+	count_slices(slot.labels.data(), wmap, _nw_, n, _nref_, slot.offsets.data());
+}
+
+// waits for depth iz and makes it the current one, whose slot stays valid until another depth is requested
+RefSampler::RingSlot& RefSampler::resident(int iz) {
+	Ring& r = *_ring_;
+	std::unique_lock<std::mutex> lock(r.m);
+	if (iz != r.current) {
+		if (r.current >= 0) r.direction = iz < r.current ? -1 : 1;
+		r.current = iz;
+		r.work.notify_one();
+	}
+	int slot;
+	r.done.wait(lock, [&] {slot = r.find(iz); return slot >= 0 && r.slots[slot].ready;});
+	return r.slots[slot];
+}
+
+std::complex<float>* RefSampler::get_ref_slow(int iz, int iref) {
+	if (_ring_) resident(iz);
+	return _slow_ref_ + (iref + iz*_nref_)*_nw_;
 }
 
+uint8_t* RefSampler::get_ref_labels(int iz) {
+	if (_ring_) return resident(iz).labels.data();
+	return _labels_ + size_t(_slices_[iz])*_ny_*_nx_;
+}
+
+int* RefSampler::get_ref_wmap(int iz) {
+	if (_ring_) resident(iz);
+	return _wmap_ + iz*_nw_;
+}
+
+int RefSampler::get_ref_nslices(int iz) {
+	const int* wmap = get_ref_wmap(iz);
+	return *std::max_element(wmap, wmap + _nw_) + 1;
+}
+
+int* RefSampler::get_ref_offsets(int iz) {
+	if (_ring_) return resident(iz).offsets.data();
+	return _offsets_ + iz*(_nref_+1);
+}
+
+double RefSampler::cluster_error() {
+	size_t n = size_t(_nx_)*_ny_;
+	double err = 0.;
+	for (int iz=0; iz < _nz_; ++iz) {
+		const uint8_t* labels = get_ref_labels(iz);
+		const int* wmap = get_ref_wmap(iz);
+		err += tbb::parallel_reduce(tbb::blocked_range<int>(0, _nw_), 0.,
+			[&](const tbb::blocked_range<int>& r, double e) {
+			for (int iw=r.begin(); iw < r.end(); ++iw) {
+				const std::complex<float>* s = _slow_->getVals() + (iw + size_t(iz)*_nw_)*n;
+				const uint8_t* lab = labels + wmap[iw]*n;
+				for (size_t i=0; i < n; ++i) e += std::norm(s[i] - _slow_ref_[(lab[i] + iz*_nref_)*_nw_ + iw]);
+			}
+			return e;
+		}, std::plus<double>());
+	}
+	return err;
+}
+
+// label counts of each depth, the selector groups the points by label from them
+void RefSampler::count_labels() {
+	size_t n = size_t(_ny_)*_nx_;
+	ref_offsets.resize(size_t(_nref_+1)*_nz_);
+	_offsets_ = ref_offsets.data();
+	tbb::parallel_for(0, _nz_, [=](int iz) {
+		count_slices(_labels_ + _slices_[iz]*n, _wmap_ + iz*_nw_, _nw_, n, _nref_, _offsets_ + iz*(_nref_+1));
+	});
+}
+
+namespace {
+
+// cache file: the header, then the reference slownesses [nz][nref][nw], the label offsets
+// [nz][nref+1], the slice maps [nz][nw], the first slice of each depth [nz+1] and the labels
+// [nslices][ny][nx], laid out as in memory
+struct CacheHeader {
+	char magic[8];
+	uint64_t hash;
+	int32_t nx, ny, nw, nz, nref, method, nslices, pad;
+};
+constexpr char CACHE_MAGIC[8] = {'F','W','I','X','R','E','F','2'};
+
+}
+
+uint64_t RefSampler::slowness_hash() const {
+	// FNV-1a over 64-bit words, on fixed chunks hashed in parallel and then combined in order,
+	// so the result does not depend on the threads
+	constexpr uint64_t PRIME = 0x100000001b3ull;
+	constexpr uint64_t BASIS = 0xcbf29ce484222325ull;
+	constexpr size_t CHUNK = 1 << 20;
+	size_t nbytes = sizeof(std::complex<float>) * _slow_->getHyper()->getN123();
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(_slow_->getVals());
+	size_t nchunks = (nbytes + CHUNK - 1) / CHUNK;
+	std::vector<uint64_t> partial(nchunks);
+
+	tbb::parallel_for(size_t(0), nchunks, [&](size_t c) {
+		size_t begin = c*CHUNK, end = std::min(nbytes, begin + CHUNK);
+		partial[c] = fnv1a(bytes + begin, end - begin, BASIS);
+	});
+
+	uint64_t h = BASIS;
+	for (uint64_t dim : {uint64_t(_nx_), uint64_t(_ny_), uint64_t(_nw_), uint64_t(_nz_)}) h = (h ^ dim) * PRIME;
+	for (uint64_t p : partial) h = (h ^ p) * PRIME;
+	return h;
+}
+
+std::string RefSampler::cache_path(const std::string& dir, uint64_t hash, Clustering method) const {
+	char name[64];
+	std::snprintf(name, sizeof(name), "refsampler_%016llx_%d_%d.bin",
+		static_cast<unsigned long long>(hash), _nref_, int(method));
+	return dir + "/" + name;
+}
+
+// maps the file read-only and points the results into it, no copy
+bool RefSampler::load_cache(const std::string& path, uint64_t hash, Clustering method) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	size_t nslow = size_t(_nz_)*_nref_*_nw_;
+	size_t noffsets = size_t(_nz_)*(_nref_+1);
+	size_t nwmap = size_t(_nz_)*_nw_;
+	size_t fixed = sizeof(CacheHeader) + sizeof(std::complex<float>)*nslow + sizeof(int)*(noffsets + nwmap + _nz_+1);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < fixed) {
+		close(fd);
+		return false;
+	}
+	size_t bytes = st.st_size;
+	void* map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	const CacheHeader* header = static_cast<const CacheHeader*>(map);
+	if (std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->hash != hash ||
+		header->nx != _nx_ || header->ny != _ny_ || header->nw != _nw_ || header->nz != _nz_ ||
+		header->nref != _nref_ || header->method != int(method) ||
+		bytes != fixed + size_t(header->nslices)*_ny_*_nx_) {
+		munmap(map, bytes);
+		return false;
+	}
+
+	char* ptr = static_cast<char*>(map) + sizeof(CacheHeader);
+	// the mapping is read-only: the results are only read after construction
+	_slow_ref_ = reinterpret_cast<std::complex<float>*>(ptr);
+	ptr += sizeof(std::complex<float>)*nslow;
+	_offsets_ = reinterpret_cast<int*>(ptr);
+	ptr += sizeof(int)*noffsets;
+	_wmap_ = reinterpret_cast<int*>(ptr);
+	ptr += sizeof(int)*nwmap;
+	_slices_ = reinterpret_cast<int*>(ptr);
+	ptr += sizeof(int)*(_nz_+1);
+	_labels_ = reinterpret_cast<uint8_t*>(ptr);
+	_map_ = map;
+	_map_bytes_ = bytes;
+	return true;
+}
+
+// written to a temporary file and renamed, so concurrent jobs never map a partial file.
+// The cache is an optimization: failing to write it is not an error
+void RefSampler::save_cache(const std::string& path, uint64_t hash, Clustering method) const {
+	std::string tmp = path + ".tmp." + std::to_string(getpid());
+	FILE* f = std::fopen(tmp.c_str(), "wb");
+	if (!f) return;
+
+	CacheHeader header;
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.hash = hash;
+	header.nx = _nx_; header.ny = _ny_; header.nw = _nw_; header.nz = _nz_;
+	header.nref = _nref_; header.method = int(method);
+	header.nslices = _slices_[_nz_]; header.pad = 0;
+
+	bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && std::fwrite(_slow_ref_, sizeof(std::complex<float>), size_t(_nz_)*_nref_*_nw_, f) == size_t(_nz_)*_nref_*_nw_;
+	ok = ok && std::fwrite(_offsets_, sizeof(int), size_t(_nz_)*(_nref_+1), f) == size_t(_nz_)*(_nref_+1);
+	ok = ok && std::fwrite(_wmap_, sizeof(int), size_t(_nz_)*_nw_, f) == size_t(_nz_)*_nw_;
+	ok = ok && std::fwrite(_slices_, sizeof(int), _nz_+1, f) == size_t(_nz_+1);
+	size_t nlabels = size_t(_slices_[_nz_])*_ny_*_nx_;
+	ok = ok && std::fwrite(_labels_, 1, nlabels, f) == nlabels;
+	ok = (std::fclose(f) == 0) && ok;
+
+	if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) std::remove(tmp.c_str());
+}
@@ -6,6 +6,11 @@
 #include "complex1DReg.h"
 #include "boost/multi_array.hpp"
 #include  "opencv2/core.hpp"
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <atomic>
 
 namespace SEP {
 
@@ -15,20 +20,81 @@ class RefSampler
 	{
 	public:
 
-		RefSampler(const std::shared_ptr<complex4DReg>& slow, int nref);
+		// HISTOGRAM: Lloyd iterations on a 2D histogram of each (w,z) slowness slice, warm started
+		// from the centers of the previous depth, then one exact pass over the points.
+		// OPENCV: cv::kmeans with k-means++ seeding on every slice
+		enum class Clustering {HISTOGRAM, OPENCV};
 
-		inline std::complex<float>* get_ref_slow(int iz, int iref) {return slow_ref.data() + (iref + iz*_nref_)*_nw_;}
-		inline int* get_ref_labels(int iz) { return ref_labels.data() + iz*_nw_*_ny_*_nx_;}
+		// cache_dir: when set, the results are saved there under a hash of the slowness, nref and
+		// method, and later samplers of the same model map that file instead of clustering again.
+		// lazy: when > 0, nothing is clustered up front; a background thread keeps a ring of that
+		// many depths ready ahead of the last requested one, in the direction of the requests.
+		// The labels of a depth then stay valid until another depth is requested, so a lazy
+		// sampler serves one propagator at a time. The cache is not used in lazy mode
+		RefSampler(const std::shared_ptr<complex4DReg>& slow, int nref, Clustering method = Clustering::HISTOGRAM,
+			const std::string& cache_dir = "", int lazy = 0);
+		~RefSampler();
+
+		std::complex<float>* get_ref_slow(int iz, int iref);
+		// frequencies with identical slowness slices share their labels: depth iz stores
+		// get_ref_nslices(iz) label slices [nslices][ny][nx], and frequency iw reads slice wmap[iw].
+		// One byte per point, so at most 256 references
+		uint8_t* get_ref_labels(int iz);
+		int* get_ref_wmap(int iz);
+		int get_ref_nslices(int iz);
+		// prefix sum of the label counts over the (x,y,w) points of depth iz: the points of iref would take
+		// offsets[iref] ... offsets[iref+1]-1 in a list grouped by label
+		int* get_ref_offsets(int iz);
+
+		const std::shared_ptr<complex4DReg>& get_slow() const {return _slow_;};
+
+		// sum over all the points of |s - sref|^2, to compare the clusterings
+		double cluster_error();
+		bool is_lazy() const {return _ring_ != nullptr;};
+		// every propagator reading the sampler attaches once and detaches when destroyed. An eager
+		// sampler is read-only and takes any number; a lazy one moves its ring on every request,
+		// so a second attach throws
+		void attach();
+		void detach() {--_users_;};
+		int users() const {return _users_;};
+		// the results were mapped from the cache file
+		bool from_cache() const {return _map_ != nullptr;};
+		// 64-bit hash of the slowness values and their dimensions
+		uint64_t slowness_hash() const;
 
 		int _nx_, _ny_, _nref_, _nz_, _nw_;
 
 	private:
 
-		void kmeans_sample();
+		struct Ring;
+		struct RingSlot;
+
+		int map_slices(int iz, int* wmap) const;
+		void cluster_slice(int iz, int iw, uint8_t* labels, std::complex<float>* centers, bool warm);
+		void cluster_depth(int iz, uint8_t* labels, std::complex<float>* warm, bool use_warm);
+		void sample_all();
+		void count_labels();
+		void start_ring(int nslots);
+		void ring_worker();
+		void fill_slot(int iz, RingSlot& slot);
+		RingSlot& resident(int iz);
+		std::string cache_path(const std::string& dir, uint64_t hash, Clustering method) const;
+		bool load_cache(const std::string& path, uint64_t hash, Clustering method);
+		void save_cache(const std::string& path, uint64_t hash, Clustering method) const;
 
-		const std::shared_ptr<complex4DReg>& _slow_;
-		boost::multi_array<int, 4> ref_labels;
+		std::shared_ptr<complex4DReg> _slow_;
+		Clustering _method_;
+		std::vector<uint8_t> ref_labels;
+		std::vector<int> ref_offsets, ref_wmap, ref_slices;
 		boost::multi_array<std::complex<float>, 3> slow_ref;
+		// the results, in the arrays above or in the mapped cache file
+		uint8_t* _labels_ = nullptr;
+		int *_offsets_ = nullptr, *_wmap_ = nullptr, *_slices_ = nullptr;
+		std::complex<float>* _slow_ref_;
+		void* _map_ = nullptr;
+		size_t _map_bytes_ = 0;
+		std::unique_ptr<Ring> _ring_;
+		std::atomic<int> _users_{0};
 
 		
 
@@ -2,6 +2,9 @@
 #include <CudaOperator.h>
 #include <complex4DReg.h>
 #include <prop_kernels.cuh>
+#include <prop_kernels_host.h>
+#include <vector>
+#include <algorithm>
 
 using namespace SEP;
 
@@ -12,40 +15,71 @@ public:
 
 	Selector(const std::shared_ptr<hypercube>& domain, 
 	complex_vector* model = nullptr, complex_vector* data = nullptr, 
-	dim3 grid=1, dim3 block=1, cudaStream_t stream = 0) 
-	: CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream) {
+	dim3 grid=1, dim3 block=1, cudaStream_t stream = 0, Backend backend = Backend::DEVICE) 
+	: CudaOperator<complex4DReg, complex4DReg>(domain, domain, model, data, grid, block, stream, backend) {
 		_grid_ = {32, 4, 4};
   _block_ = {16, 16, 4};
 
-		_size_ = domain->getAxis(1).n * domain->getAxis(2).n * domain->getAxis(3).n;
-		CHECK_CUDA_ERROR(cudaMalloc((void **)&d_labels, sizeof(int)*_size_));
+		_nxy_ = domain->getAxis(1).n * domain->getAxis(2).n;
+		_nw_ = domain->getAxis(3).n;
+		_size_ = _nxy_ * _nw_;
+		d_labels = alloc_param<uint8_t>(_size_);
+		d_wmap = alloc_param<int>(_nw_);
+		d_index = alloc_param<int>(_size_);
+		d_cursor = alloc_param<int>(256);
 		launcher = Selector_launcher(&select_forward, _grid_, _block_, _stream_);
+		list_launcher = SelectList_launcher(&select_scatter, _grid_, _block_, _stream_);
 	};
 	
 	~Selector() {
-		CHECK_CUDA_ERROR(cudaFree(d_labels));
+		free_param(d_labels);
+		free_param(d_wmap);
+		free_param(d_index);
+		free_param(d_cursor);
 	};
 
-	void set_labels(int* labels) {
-		// labels are 3D -- (x,y,w)
-		CHECK_CUDA_ERROR(cudaMemcpyAsync(d_labels, labels, sizeof(int)*_size_, cudaMemcpyHostToDevice, _stream_));
+	// labels are (x,y) slices, one byte per point, and frequency iw reads slice wmap[iw]
+	// (RefSampler::get_ref_labels/get_ref_wmap); offsets are the prefix sums of the label
+	// counts over the (x,y,w) points. Only the distinct slices cross to the device, the
+	// points are grouped by label there for cu_scatter
+	void set_labels(const uint8_t* labels, const int* wmap, const int* offsets, int nlabels) {
+		int nslices = *std::max_element(wmap, wmap + _nw_) + 1;
+		upload_param(d_labels, labels, size_t(nslices)*_nxy_);
+		upload_param(d_wmap, wmap, _nw_);
+		_offsets_.assign(offsets, offsets + nlabels + 1);
+		upload_param(d_cursor, _offsets_.data(), nlabels);
+		if (_backend_ == Backend::HOST) select_build_index_host(d_labels, d_wmap, _nxy_, _size_, d_cursor, d_index);
+		else launch_select_build_index(d_labels, d_wmap, _nxy_, _size_, d_cursor, d_index, _stream_);
 	};
 	void set_value(int value) {_value_ = value;}
 
 	void cu_forward(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-		if (!add) data->zero();
-		launcher.run_fwd(model, data, _value_, d_labels);
+		if (_backend_ == Backend::HOST) select_forward_host(model, data, _value_, d_labels, d_wmap, add);
+		else launcher.run_fwd(model, data, _value_, d_labels, d_wmap, add);
 	};
 	void cu_adjoint(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
-		if (!add) model->zero();
-		launcher.run_fwd(data, model, _value_, d_labels);
+		if (_backend_ == Backend::HOST) select_forward_host(data, model, _value_, d_labels, d_wmap, add);
+		else launcher.run_fwd(data, model, _value_, d_labels, d_wmap, add);
+	};
+
+	// data (+)= model on the points of the current label only, the others are left untouched.
+	// Over all the labels it writes every point once, at a cost proportional to the points written
+	void cu_scatter(bool add, complex_vector* __restrict__ model, complex_vector* __restrict__ data) {
+		int count = _offsets_[_value_+1] - _offsets_[_value_];
+		if (count == 0) return;
+		int* index = d_index + _offsets_[_value_];
+		if (_backend_ == Backend::HOST) select_scatter_host(model, data, index, count, add);
+		else list_launcher.run_fwd(model, data, index, count, add);
 	};
 
 private:
 	int _value_;
-	int _size_;
-	int *d_labels;
+	int _size_, _nxy_, _nw_;
+	uint8_t *d_labels;
+	int *d_wmap, *d_index, *d_cursor;
+	std::vector<int> _offsets_;
 	Selector_launcher launcher;
+	SelectList_launcher list_launcher;
 
 };
 
@@ -0,0 +1,407 @@
+#include <WavefieldStore.h>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <tbb/task_arena.h>
+#include <filesystem>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "SZ3/api/sz.hpp"
+
+MemoryStore::MemoryStore(const std::shared_ptr<hypercube>& slice, int nz, const axis& z)
+: WavefieldStore(slice, nz) {
+  auto ax = slice->getAxes();
+  wfld = std::make_shared<complex5DReg>(std::make_shared<hypercube>(ax[0], ax[1], ax[2], ax[3], z));
+};
+
+void MemoryStore::put(int iz, const std::complex<float>* slice) {
+  std::copy(slice, slice + _size_, data(iz));
+};
+
+void MemoryStore::get(int iz, std::complex<float>* slice) {
+  std::copy(data(iz), data(iz) + _size_, slice);
+};
+
+SZ3Store::SZ3Store(const std::shared_ptr<hypercube>& slice, int nz, double error_bound, int max_pending)
+: WavefieldStore(slice, nz), _eb_(error_bound), entries(nz) {
+  _max_pending_ = max_pending > 0 ? max_pending : tbb::this_task_arena::max_concurrency();
+  tasks = std::make_unique<tbb::task_group>();
+};
+
+SZ3Store::~SZ3Store() {
+  tasks->wait();
+};
+
+void SZ3Store::put(int iz, const std::complex<float>* slice) {
+  {
+    // past the limit, this thread runs the queued compressions too (the only way on one core)
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending >= _max_pending_) {
+      lock.unlock();
+      tasks->wait();
+      lock.lock();
+    }
+    ++pending;
+    entries[iz].ready = false;
+  }
+  // split into the real and imaginary planes
+  std::vector<float> planes(2*_size_);
+  for (size_t i=0; i < _size_; ++i) {
+    planes[i] = slice[i].real();
+    planes[_size_ + i] = slice[i].imag();
+  }
+  auto p = std::make_shared<std::vector<float>>(std::move(planes));
+  tasks->run([this, iz, p] {compress(iz, *p);});
+};
+
+void SZ3Store::compress(int iz, const std::vector<float>& planes) {
+  auto ax = _slice_->getAxes();
+  SZ3::Config conf(size_t(2)*ax[2].n*ax[3].n, ax[1].n, ax[0].n);
+  conf.cmprAlgo = SZ3::ALGO_INTERP_LORENZO;
+  conf.errorBoundMode = SZ3::EB_REL;
+  conf.relErrorBound = _eb_;
+
+  auto start = std::chrono::steady_clock::now();
+  size_t out_size;
+  char* out = SZ_compress(conf, planes.data(), out_size);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Entry& e = entries[iz];
+  // a depth put again replaces the previous one
+  if (e.data) {
+    raw_bytes -= sizeof(std::complex<float>) * _size_;
+    stored_bytes -= e.bytes;
+  }
+  e.data.reset(out);
+  e.bytes = out_size;
+  e.ready = true;
+  raw_bytes += sizeof(std::complex<float>) * _size_;
+  stored_bytes += out_size;
+  compress_seconds += seconds;
+  --pending;
+};
+
+void SZ3Store::get(int iz, std::complex<float>* slice) {
+  const Entry& e = entries[iz];
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!e.ready && pending > 0) {
+      lock.unlock();
+      tasks->wait();
+      lock.lock();
+    }
+    if (!e.ready) throw std::out_of_range("SZ3Store: depth " + std::to_string(iz) + " was never stored.");
+  }
+
+  auto ax = _slice_->getAxes();
+  SZ3::Config conf(size_t(2)*ax[2].n*ax[3].n, ax[1].n, ax[0].n);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<float> planes(2*_size_);
+  float* out = planes.data();
+  SZ_decompress(conf, e.data.get(), e.bytes, out);
+  for (size_t i=0; i < _size_; ++i) slice[i] = {planes[i], planes[_size_ + i]};
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  decompress_seconds += seconds;
+  decompressed_bytes += sizeof(std::complex<float>) * _size_;
+};
+
+void SZ3Store::flush() {
+  tasks->wait();
+};
+
+size_t SZ3Store::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  // and the slices still waiting for their compression
+  return stored_bytes + pending * 2*sizeof(float) * _size_;
+};
+
+double SZ3Store::ratio() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stored_bytes == 0 ? 0. : double(raw_bytes) / stored_bytes;
+};
+
+double SZ3Store::compress_throughput() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return compress_seconds == 0. ? 0. : raw_bytes / compress_seconds / (1 << 20);
+};
+
+double SZ3Store::decompress_throughput() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return decompress_seconds == 0. ? 0. : decompressed_bytes / decompress_seconds / (1 << 20);
+};
+
+FileStore::FileStore(const std::shared_ptr<hypercube>& slice, int nz, const std::string& dir, int nbuffers)
+: WavefieldStore(slice, nz), buffers(std::max(nbuffers, 1)), stored(nz, 0) {
+  std::string path = (dir.empty() ? std::filesystem::temp_directory_path().string() : dir) + "/fwix_wfld_XXXXXX";
+  fd = mkstemp(path.data());
+  if (fd < 0) throw std::runtime_error("FileStore: cannot create a scratch file in " + path + ".");
+  unlink(path.c_str());
+  if (ftruncate(fd, off_t(sizeof(std::complex<float>) * _size_ * nz)) != 0) {
+    close(fd);
+    throw std::runtime_error("FileStore: cannot reserve " + std::to_string(sizeof(std::complex<float>) * _size_ * nz) + " bytes.");
+  }
+  for (auto& b : buffers) b.data.resize(_size_);
+  io = std::thread(&FileStore::worker, this);
+};
+
+FileStore::~FileStore() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  work.notify_all();
+  io.join();
+  close(fd);
+};
+
+int FileStore::find(int iz, State state) const {
+  for (size_t i=0; i < buffers.size(); ++i)
+    if (buffers[i].iz == iz && buffers[i].state == state) return i;
+  return -1;
+};
+
+int FileStore::grab(State state) const {
+  for (size_t i=0; i < buffers.size(); ++i)
+    if (buffers[i].state == state) return i;
+  return -1;
+};
+
+void FileStore::check() {
+  if (!error.empty()) throw std::runtime_error(error);
+};
+
+void FileStore::pwrite_all(const std::complex<float>* src, int iz) {
+  const char* p = reinterpret_cast<const char*>(src);
+  size_t left = sizeof(std::complex<float>) * _size_;
+  off_t offset = off_t(left) * iz;
+  while (left > 0) {
+    ssize_t n = pwrite(fd, p, left, offset);
+    if (n <= 0) throw std::runtime_error("FileStore: write failed: " + std::string(std::strerror(errno)) + ".");
+    p += n;
+    offset += n;
+    left -= n;
+  }
+};
+
+void FileStore::pread_all(std::complex<float>* dst, int iz) {
+  char* p = reinterpret_cast<char*>(dst);
+  size_t left = sizeof(std::complex<float>) * _size_;
+  off_t offset = off_t(left) * iz;
+  while (left > 0) {
+    ssize_t n = pread(fd, p, left, offset);
+    if (n <= 0) throw std::runtime_error("FileStore: read failed: " + std::string(std::strerror(errno)) + ".");
+    p += n;
+    offset += n;
+    left -= n;
+  }
+};
+
+void FileStore::worker() {
+  std::unique_lock<std::mutex> lock(m);
+  while (true) {
+    work.wait(lock, [&] {return stop || !queue.empty();});
+    if (queue.empty()) return;
+    int i = queue.front();
+    queue.pop_front();
+    Buffer& b = buffers[i];
+    bool writing = b.state == State::WRITING;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    std::string failed;
+    try {
+      if (writing) pwrite_all(b.data.data(), b.iz);
+      else pread_all(b.data.data(), b.iz);
+    }
+    catch (const std::exception& e) {
+      failed = e.what();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    lock.lock();
+    if (!failed.empty()) error = failed;
+    if (writing) {
+      stored[b.iz] = 1;
+      written += sizeof(std::complex<float>) * _size_;
+      write_seconds += seconds;
+      b.state = State::FREE;
+    }
+    else {
+      read += sizeof(std::complex<float>) * _size_;
+      read_seconds += seconds;
+      b.state = b.stale || !failed.empty() ? State::FREE : State::READY;
+      b.stale = false;
+    }
+    done.notify_all();
+  }
+};
+
+void FileStore::put(int iz, const std::complex<float>* slice) {
+  std::unique_lock<std::mutex> lock(m);
+  check();
+  // the depth read ahead is replaced
+  for (auto& b : buffers) {
+    if (b.iz != iz) continue;
+    if (b.state == State::READY) b.state = State::FREE;
+    else if (b.state == State::READING) b.stale = true;
+  }
+  // a free buffer, or else one holding a depth read ahead
+  int i;
+  done.wait(lock, [&] {
+    i = grab(State::FREE);
+    if (i < 0) i = grab(State::READY);
+    return i >= 0;
+  });
+  Buffer& b = buffers[i];
+  b.state = State::FILLING;
+  b.iz = iz;
+  stored[iz] = 0;
+  lock.unlock();
+
+  std::copy(slice, slice + _size_, b.data.data());
+
+  lock.lock();
+  b.state = State::WRITING;
+  queue.push_back(i);
+  work.notify_one();
+};
+
+void FileStore::get(int iz, std::complex<float>* slice) {
+  std::unique_lock<std::mutex> lock(m);
+  check();
+  if (last_get >= 0 && iz != last_get) direction = iz < last_get ? -1 : 1;
+  last_get = iz;
+
+  // wait for a read ahead of that depth in flight
+  done.wait(lock, [&] {return find(iz, State::READING) < 0;});
+  int i = find(iz, State::READY);
+  if (i >= 0) {
+    ++_hits_;
+    buffers[i].state = State::FILLING;
+    lock.unlock();
+    std::copy(buffers[i].data.begin(), buffers[i].data.end(), slice);
+    lock.lock();
+    buffers[i].state = State::FREE;
+    buffers[i].iz = -1;
+    done.notify_all();
+  }
+  else if ((i = find(iz, State::WRITING)) >= 0) {
+    // not written yet: the I/O thread only reads the buffer, which stays held while the lock is
+    std::copy(buffers[i].data.begin(), buffers[i].data.end(), slice);
+  }
+  else {
+    if (!stored[iz]) throw std::out_of_range("FileStore: depth " + std::to_string(iz) + " was never stored.");
+    ++_sync_reads_;
+    lock.unlock();
+    pread_all(slice, iz);
+    lock.lock();
+  }
+  read_ahead(iz);
+};
+
+// with the lock held
+void FileStore::read_ahead(int iz) {
+  for (int k=1; k < int(buffers.size()); ++k) {
+    int jz = iz + k*direction;
+    if (jz < 0 || jz >= _nz_ || !stored[jz]) return;
+    bool held = false;
+    for (auto& b : buffers) held |= b.iz == jz && b.state != State::FREE;
+    if (held) continue;
+    int i = grab(State::FREE);
+    if (i < 0) return;
+    buffers[i].iz = jz;
+    buffers[i].state = State::READING;
+    queue.push_back(i);
+  }
+  work.notify_one();
+};
+
+void FileStore::flush() {
+  std::unique_lock<std::mutex> lock(m);
+  done.wait(lock, [&] {
+    for (auto& b : buffers) if (b.state == State::WRITING || b.state == State::FILLING) return false;
+    return true;
+  });
+  check();
+};
+
+double FileStore::write_throughput() const {
+  std::lock_guard<std::mutex> lock(m);
+  return write_seconds == 0. ? 0. : written / write_seconds / (1 << 20);
+};
+
+double FileStore::read_throughput() const {
+  std::lock_guard<std::mutex> lock(m);
+  return read_seconds == 0. ? 0. : read / read_seconds / (1 << 20);
+};
+
+namespace {
+  // beta(s, r) = (s+r)! / (s! r!): the most steps reversed with s checkpoints and r repetitions
+  double beta(int s, int r) {
+    double b = 1.;
+    for (int i=1; i <= s; ++i) b = b * (r + i) / i;
+    return b;
+  }
+}
+
+CheckpointStore::CheckpointStore(const std::shared_ptr<hypercube>& slice, int nz, int nslots)
+: WavefieldStore(slice, nz), values(size_t(std::max(nslots, 1)) * slice->getN123()), held(std::max(nslots, 1), -1) {};
+
+void CheckpointStore::begin() {
+  std::fill(held.begin(), held.end(), -1);
+  // the wavefields entering the steps 0 ... nz-2
+  target = _nz_ - 2;
+  next = 0;
+};
+
+void CheckpointStore::plan(int pos) {
+  next = -1;
+  int free = std::count(held.begin(), held.end(), -1);
+  int l = target - pos;
+  if (free == 0 || l <= 1) return;
+  // the fewest repetitions r that reverse l steps with the checkpoint at pos and the free ones;
+  // the next one leaves the l - m steps past it to one checkpoint less and the same r
+  int s = free + 1, r = 0;
+  while (beta(s, r) < l) ++r;
+  int m = std::max(1., l - beta(s-1, r));
+  if (m < l) next = pos + m;
+};
+
+void CheckpointStore::put(int iz, const std::complex<float>* slice) {
+  if (iz != next) return;
+  int i = std::find(held.begin(), held.end(), -1) - held.begin();
+  std::copy(slice, slice + _size_, values.data() + i*_size_);
+  held[i] = iz;
+  plan(iz);
+};
+
+void CheckpointStore::get(int iz, std::complex<float>* slice) {
+  int i = std::find(held.begin(), held.end(), iz) - held.begin();
+  if (i == int(held.size())) throw std::out_of_range("CheckpointStore: depth " + std::to_string(iz) + " is not a checkpoint.");
+  std::copy(values.data() + i*_size_, values.data() + (i+1)*_size_, slice);
+};
+
+int CheckpointStore::restart(int iz) {
+  int c = -1;
+  for (auto& h : held) {
+    // the checkpoints above are no longer needed on the way down
+    if (h > iz) h = -1;
+    else c = std::max(c, h);
+  }
+  if (c < 0) throw std::out_of_range("CheckpointStore: no checkpoint below depth " + std::to_string(iz) + ".");
+  target = iz;
+  plan(c);
+  return c;
+};
+
+std::vector<int> CheckpointStore::checkpoints() const {
+  std::vector<int> depths;
+  for (int h : held) if (h >= 0) depths.push_back(h);
+  std::sort(depths.begin(), depths.end());
+  return depths;
+};
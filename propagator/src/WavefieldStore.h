@@ -0,0 +1,186 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <complex>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include <tbb/task_group.h>
+#include <complex5DReg.h>
+
+using namespace SEP;
+
+// History of the wavefields entering the depth steps of a one-way propagation: nz host slices
+// of the propagation domain [ns, nw, ny, nx].
+class WavefieldStore {
+public:
+  WavefieldStore(const std::shared_ptr<hypercube>& slice, int nz) 
+  : _slice_(slice), _nz_(nz), _size_(slice->getN123()) {};
+  virtual ~WavefieldStore() {};
+
+  // the slice of depth iz; it may be reused by the caller as soon as put returns
+  virtual void put(int iz, const std::complex<float>* slice) = 0;
+  virtual void get(int iz, std::complex<float>* slice) = 0;
+  // in-memory stores: where depth iz lives, to be written in place (nullptr otherwise)
+  virtual std::complex<float>* data(int iz) {return nullptr;};
+  // stores that keep only some depths: a new propagation starts at depth 0, whether depth iz is
+  // to be put, and the depth from which the caller has to propagate to get iz
+  virtual void begin() {};
+  virtual bool wants(int iz) const {return true;};
+  virtual int restart(int iz) {return iz;};
+  // returns once everything put so far is stored
+  virtual void flush() {};
+  // host memory held by the history
+  virtual size_t bytes() const = 0;
+
+  int nz() const {return _nz_;};
+  size_t slice_size() const {return _size_;};
+
+protected:
+  std::shared_ptr<hypercube> _slice_;
+  int _nz_;
+  size_t _size_;
+};
+
+// every slice as is, in one [nz, ns, nw, ny, nx] volume
+class MemoryStore : public WavefieldStore {
+public:
+  MemoryStore(const std::shared_ptr<hypercube>& slice, int nz, const axis& z);
+
+  void put(int iz, const std::complex<float>* slice);
+  void get(int iz, std::complex<float>* slice);
+  std::complex<float>* data(int iz) {return wfld->getVals() + iz*_size_;};
+  size_t bytes() const {return sizeof(std::complex<float>) * _size_ * _nz_;};
+
+  const std::shared_ptr<complex5DReg>& get_wfld() const {return wfld;};
+
+private:
+  std::shared_ptr<complex5DReg> wfld;
+};
+
+// Error-bounded SZ3 compression of each slice on the TBB pool, so the propagation does not wait
+// for it; get decompresses on demand. The real and imaginary parts are compressed as separate
+// [ns*nw, ny, nx] planes, which are smoother than the interleaved values. At most max_pending
+// slices wait for their compression: put waits for the queue beyond that
+class SZ3Store : public WavefieldStore {
+public:
+  // error_bound: relative to the value range of each slice
+  SZ3Store(const std::shared_ptr<hypercube>& slice, int nz, double error_bound, int max_pending = 0);
+  ~SZ3Store();
+
+  void put(int iz, const std::complex<float>* slice);
+  void get(int iz, std::complex<float>* slice);
+  void flush();
+  size_t bytes() const;
+
+  // uncompressed over compressed bytes of the slices stored so far
+  double ratio() const;
+  // megabytes of uncompressed slices per second of (one thread's) compression or decompression
+  double compress_throughput() const;
+  double decompress_throughput() const;
+
+private:
+  struct Entry {
+    std::unique_ptr<char[]> data;
+    size_t bytes = 0;
+    bool ready = false;
+  };
+
+  void compress(int iz, const std::vector<float>& planes);
+
+  double _eb_;
+  int _max_pending_;
+  std::vector<Entry> entries;
+  mutable std::mutex mutex;
+  int pending = 0;
+  size_t raw_bytes = 0, stored_bytes = 0;
+  double compress_seconds = 0., decompress_seconds = 0.;
+  size_t decompressed_bytes = 0;
+  std::unique_ptr<tbb::task_group> tasks;
+};
+
+// Slices in a scratch file on local disk, for histories that do not fit in memory even compressed.
+// An I/O thread writes the slices behind the propagation from nbuffers host buffers, and after every
+// get reads ahead the next depths in the direction of the gets (decreasing depth first, as in the
+// adjoint and imaging passes). The file is unlinked as soon as it is created.
+class FileStore : public WavefieldStore {
+public:
+  // dir: where the scratch file goes (empty = the system temporary directory)
+  FileStore(const std::shared_ptr<hypercube>& slice, int nz, const std::string& dir = "", int nbuffers = 4);
+  ~FileStore();
+
+  void put(int iz, const std::complex<float>* slice);
+  void get(int iz, std::complex<float>* slice);
+  void flush();
+  size_t bytes() const {return buffers.size() * _size_ * sizeof(std::complex<float>);};
+
+  // gets served by the read-ahead, and the ones that had to read the file
+  size_t prefetch_hits() const {return _hits_;};
+  size_t sync_reads() const {return _sync_reads_;};
+  // megabytes per second of the I/O thread
+  double write_throughput() const;
+  double read_throughput() const;
+
+private:
+  enum class State {FREE, FILLING, WRITING, READING, READY};
+  struct Buffer {
+    std::vector<std::complex<float>> data;
+    int iz = -1;
+    State state = State::FREE;
+    // a put of the same depth came while it was read ahead
+    bool stale = false;
+  };
+
+  void worker();
+  void read_ahead(int iz);
+  int find(int iz, State state) const;
+  // any buffer in that state
+  int grab(State state) const;
+  void pwrite_all(const std::complex<float>* src, int iz);
+  void pread_all(std::complex<float>* dst, int iz);
+  void check();
+
+  int fd = -1;
+  std::vector<Buffer> buffers;
+  std::vector<char> stored;
+  std::deque<int> queue;
+  int last_get = -1, direction = -1;
+  bool stop = false;
+  std::string error;
+  size_t _hits_ = 0, _sync_reads_ = 0, written = 0, read = 0;
+  double write_seconds = 0., read_seconds = 0.;
+  mutable std::mutex m;
+  std::condition_variable work, done;
+  std::thread io;
+};
+
+// Revolve-style checkpointing: only nslots of the depths are kept, and the others are recomputed by
+// the caller from the one returned by restart. Each checkpoint is placed by Griewank's binomial
+// rule for the free slots left, both during the propagation and while replaying from a checkpoint,
+// and the checkpoints above a requested depth are dropped: a sweep in decreasing depth then costs
+// the minimal number of repeated steps for nslots, about log(nz) repetitions with log(nz) slots
+class CheckpointStore : public WavefieldStore {
+public:
+  CheckpointStore(const std::shared_ptr<hypercube>& slice, int nz, int nslots);
+
+  void put(int iz, const std::complex<float>* slice);
+  // a checkpoint, as returned by restart
+  void get(int iz, std::complex<float>* slice);
+  void begin();
+  bool wants(int iz) const {return iz == next;};
+  int restart(int iz);
+  size_t bytes() const {return held.size() * _size_ * sizeof(std::complex<float>);};
+
+  // the depths currently held
+  std::vector<int> checkpoints() const;
+
+private:
+  // next checkpoint on the way from pos to target
+  void plan(int pos);
+
+  std::vector<std::complex<float>> values;
+  std::vector<int> held;
+  int next = -1, target = -1;
+};
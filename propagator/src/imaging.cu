@@ -0,0 +1,71 @@
+#include <complex_vector.h>
+#include <prop_kernels.cuh>
+#include <cuComplex.h>
+#include <KernelLauncher.cuh>
+#include <KernelLauncher.cu>
+
+template class KernelLauncher<cuFloatComplex*, bool>;
+
+// data (+)= model * image: the image point scatters the source wavefield into every source and frequency
+__global__ void img_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  size_t stride = size_t(NW)*NY*NX;
+
+  int ix0 = threadIdx.x + blockDim.x*blockIdx.x;
+  int iy0 = threadIdx.y + blockDim.y*blockIdx.y;
+  int iw0 = threadIdx.z + blockDim.z*blockIdx.z;
+
+  int jx = blockDim.x * gridDim.x;
+  int jy = blockDim.y * gridDim.y;
+  int jw = blockDim.z * gridDim.z;
+
+  for (int iw=iw0; iw < NW; iw += jw) {
+    for (int iy=iy0; iy < NY; iy += jy) {
+      for (int ix=ix0; ix < NX; ix += jx) {
+        cuFloatComplex r = image[iy*NX + ix];
+        size_t i = (size_t(iw)*NY + iy)*NX + ix;
+        for (int is=0; is < NS; ++is, i += stride) {
+          cuFloatComplex val = cuCmulf(model->mat[i], r);
+          data->mat[i] = add ? cuCaddf(data->mat[i], val) : val;
+        }
+      }
+    }
+  }
+};
+
+// image += sum over sources and frequencies of conj(model) * data. The sum is kept in registers
+// over the sources and the frequencies of the thread, then one atomic per point and thread along w,
+// so the image is zeroed by the caller and add is not used
+__global__ void img_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  size_t stride = size_t(NW)*NY*NX;
+
+  int ix0 = threadIdx.x + blockDim.x*blockIdx.x;
+  int iy0 = threadIdx.y + blockDim.y*blockIdx.y;
+  int iw0 = threadIdx.z + blockDim.z*blockIdx.z;
+
+  int jx = blockDim.x * gridDim.x;
+  int jy = blockDim.y * gridDim.y;
+  int jw = blockDim.z * gridDim.z;
+
+  for (int iy=iy0; iy < NY; iy += jy) {
+    for (int ix=ix0; ix < NX; ix += jx) {
+      cuFloatComplex sum = make_cuFloatComplex(0.f, 0.f);
+      for (int iw=iw0; iw < NW; iw += jw) {
+        size_t i = (size_t(iw)*NY + iy)*NX + ix;
+        for (int is=0; is < NS; ++is, i += stride)
+          sum = cuCaddf(sum, cuCmulf(cuConjf(model->mat[i]), data->mat[i]));
+      }
+      atomicAdd(&image[iy*NX + ix].x, sum.x);
+      atomicAdd(&image[iy*NX + ix].y, sum.y);
+    }
+  }
+};
@@ -0,0 +1,56 @@
+#include <complex_vector.h>
+#include <prop_kernels_host.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/blocked_range2d.h>
+
+void img_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  const cuFloatComplex* __restrict__ src = model->mat;
+  cuFloatComplex* __restrict__ out = data->mat;
+
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 0, NY),
+    [=](const tbb::blocked_range2d<int>& r) {
+    for (int is=0; is < NS; ++is) {
+      for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+        for (int iy=r.cols().begin(); iy < r.cols().end(); ++iy) {
+          const cuFloatComplex* img = image + size_t(iy)*NX;
+          size_t offset = ((size_t(is)*NW + iw)*NY + iy)*NX;
+          for (int ix=0; ix < NX; ++ix) {
+            cuFloatComplex val = cuCmulf(src[offset + ix], img[ix]);
+            out[offset + ix] = add ? cuCaddf(out[offset + ix], val) : val;
+          }
+        }
+      }
+    }
+  });
+};
+
+// each row of the image is owned by one task; accumulated as on the device, add is not used
+void img_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  const cuFloatComplex* __restrict__ src = model->mat;
+  const cuFloatComplex* __restrict__ rec = data->mat;
+
+  tbb::parallel_for(tbb::blocked_range<int>(0, NY),
+    [=](const tbb::blocked_range<int>& r) {
+    for (int iy=r.begin(); iy < r.end(); ++iy) {
+      cuFloatComplex* img = image + size_t(iy)*NX;
+      for (int is=0; is < NS; ++is) {
+        for (int iw=0; iw < NW; ++iw) {
+          size_t offset = ((size_t(is)*NW + iw)*NY + iy)*NX;
+          for (int ix=0; ix < NX; ++ix)
+            img[ix] = cuCaddf(img[ix], cuCmulf(cuConjf(src[offset + ix]), rec[offset + ix]));
+        }
+      }
+    }
+  });
+};
@@ -4,10 +4,11 @@
 #include <KernelLauncher.cuh>
 #include <KernelLauncher.cu>
 
-template class KernelLauncher<float*, float*, float*, int*>;
+template class KernelLauncher<float*, float*, float*, int*, bool>;
 
+// scatter: several traces may hit the same point, so the data is zeroed by the caller and add is not used
 __global__ void inj_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-  float* cx, float* cy, float* cz, int* ids) {
+  float* cx, float* cy, float* cz, int* ids, bool add) {
 
   int NX = data->n[0];
   int NY = data->n[1];
@@ -99,7 +100,7 @@ __global__ void inj_forward(complex_vector* __restrict__ model, complex_vector*
 };
 
 __global__ void inj_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-  float* cx, float* cy, float* cz, int* ids) {
+  float* cx, float* cy, float* cz, int* ids, bool add) {
 
   int NX = data->n[0];
   int NY = data->n[1];
@@ -184,7 +185,7 @@ __global__ void inj_adjoint(complex_vector* __restrict__ model, complex_vector*
       val = cuCaddf(val, cuCmulf(data->mat[cx0cy1cz1],w[6]));
       val = cuCaddf(val, cuCmulf(data->mat[cx1cy1cz1],w[7]));  
 
-      model->mat[ind] = cuCaddf(model->mat[ind], val);
+      model->mat[ind] = add ? cuCaddf(model->mat[ind], val) : val;
 
     }
   }
@@ -0,0 +1,92 @@
+#include <complex_vector.h>
+#include <prop_kernels_host.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/blocked_range2d.h>
+
+namespace {
+
+  // trilinear weights and the 8 flat indices of the cell containing the trace, at frequency iw
+  struct Stencil {
+    float w[8];
+    size_t idx[8];
+  };
+
+  inline Stencil make_stencil(const complex_vector* data, float cx, float cy, float cz, int id, int iw) {
+    int NX = data->n[0];
+    int NY = data->n[1];
+    int NW = data->n[2];
+    int NS = data->n[3];
+    float OX = data->o[0];
+    float OY = data->o[1];
+    float OZ = data->o[4];
+    float DX = data->d[0];
+    float DY = data->d[1];
+    float DZ = data->d[4];
+
+    int iy = (cy-OY)/DY;
+    float ly = 1.f - (cy - (OY + iy*DY)) / DY;
+    int ix = (cx-OX)/DX;
+    float lx = 1.f - (cx - (OX + ix*DX)) / DX;
+    int iz = (cz-OZ)/DZ;
+    float lz = 1.f - (cz - (OZ + iz*DZ)) / DZ;
+
+    Stencil st;
+    st.w[0] = lz * lx * ly;
+    st.w[1] = lz * (1 - lx) * ly;
+    st.w[2] = lz * lx * (1 - ly);
+    st.w[3] = lz * (1 - lx) * (1 - ly);
+    st.w[4] = (1 - lz) * lx * ly;
+    st.w[5] = (1 - lz) * (1 - lx) * ly;
+    st.w[6] = (1 - lz) * lx * (1 - ly);
+    st.w[7] = (1 - lz) * (1 - lx) * (1 - ly);
+
+    for (int k=0; k < 8; ++k) {
+      int dx = k & 1;
+      int dy = (k >> 1) & 1;
+      int dz = (k >> 2) & 1;
+      st.idx[k] = ((((size_t(iz + dz)*NS + id)*NW + iw)*NY + iy + dy)*NX) + ix + dx;
+    }
+    return st;
+  }
+}
+
+// scatter: several traces may hit the same point, so the data is zeroed by the caller and add is not used
+void inj_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add) {
+
+  int mNW = model->n[0];
+  int NTRACE = model->n[1];
+
+  // traces may share grid cells, so the scatter is parallel over frequencies only
+  tbb::parallel_for(tbb::blocked_range<int>(0, mNW),
+    [=](const tbb::blocked_range<int>& r) {
+    for (int iw=r.begin(); iw < r.end(); ++iw) {
+      for (int itrace=0; itrace < NTRACE; ++itrace) {
+        Stencil st = make_stencil(data, cx[itrace], cy[itrace], cz[itrace], ids[itrace], iw);
+        cuFloatComplex val = model->mat[size_t(itrace)*mNW + iw];
+        for (int k=0; k < 8; ++k)
+          data->mat[st.idx[k]] = cuCaddf(data->mat[st.idx[k]], cuCmulf(make_cuFloatComplex(st.w[k], 0.f), val));
+      }
+    }
+  });
+};
+
+void inj_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add) {
+
+  int mNW = model->n[0];
+  int NTRACE = model->n[1];
+
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NTRACE, 0, mNW),
+    [=](const tbb::blocked_range2d<int>& r) {
+    for (int itrace=r.rows().begin(); itrace < r.rows().end(); ++itrace) {
+      for (int iw=r.cols().begin(); iw < r.cols().end(); ++iw) {
+        Stencil st = make_stencil(data, cx[itrace], cy[itrace], cz[itrace], ids[itrace], iw);
+        cuFloatComplex val = make_cuFloatComplex(0.f, 0.f);
+        for (int k=0; k < 8; ++k)
+          val = cuCaddf(val, cuCmulf(data->mat[st.idx[k]], make_cuFloatComplex(st.w[k], 0.f)));
+        size_t ind = size_t(itrace)*mNW + iw;
+        model->mat[ind] = add ? cuCaddf(model->mat[ind], val) : val;
+      }
+    }
+  });
+};
@@ -1,21 +1,41 @@
 #include <complex_vector.h>
 #include <prop_kernels.cuh>
 #include <cuComplex.h>
+#include <cfloat>
 #include <KernelLauncher.cuh>
 #include <KernelLauncher.cu>
 
-template class KernelLauncher<float*, float*, float*, cuFloatComplex*, float, float>;
+template class KernelLauncher<float*, float*, float*, cuFloatComplex*, float, float, bool>;
+template class KernelLauncher<cuFloatComplex**, bool>;
+
+// exp(-i kz dz) for one (w, ky, kx); the inverse flips the sign of the attenuation
+__device__ __forceinline__ cuFloatComplex ps_factor(float w2, float kx, float ky, float sre, float sim, float dz, float eps, bool inverse) {
+  float re, im;
+  float a = w2*sre - (kx*kx + ky*ky);
+  float b = w2*(sim-eps*sre);
+  float c = sqrtf(a*a + b*b);
+  if (b <= 0) re = sqrtf((c+a)/2);
+  else re = -sqrtf((c+a)/2);
+  im = inverse ? sqrtf((c-a)/2) : -sqrtf((c-a)/2);
+
+  float att = expf(im*dz);
+  float sinn, coss;
+  sincosf(re*dz, &sinn, &coss);
+  return make_cuFloatComplex(att * coss, -att * sinn);
+};
 
-__global__ void ps_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-  float* __restrict__  w2, float* __restrict__  kx, float* __restrict__  ky, cuFloatComplex* __restrict__ slow_ref, float dz, float eps) {
+// The propagator depends only on (w, ky, kx): it is computed once per thread and point and
+// applied to all the sources, which are NW*NY*NX apart.
+// conj = false: out (+)= P in, conj = true: out (+)= conj(P) in
+__device__ __forceinline__ void ps_apply(const cuFloatComplex* __restrict__ in, cuFloatComplex* __restrict__ out, const int* n,
+  const float* __restrict__ w2, const float* __restrict__ kx, const float* __restrict__ ky, const cuFloatComplex* __restrict__ slow_ref,
+  float dz, float eps, bool conj, bool inverse, bool add) {
 
-  float a, b, c, re, im;
-  int flat_ind;
-  int NX = model->n[0];
-  int NY = model->n[1];
-  int NW = model->n[2];
-  int NS = model->n[3];
-  int dims[] = {NS, NW, NY, NX};
+  int NX = n[0];
+  int NY = n[1];
+  int NW = n[2];
+  int NS = n[3];
+  size_t stride = size_t(NW)*NY*NX;
 
   int ix0 = threadIdx.x + blockDim.x*blockIdx.x;
   int iy0 = threadIdx.y + blockDim.y*blockIdx.y;
@@ -25,57 +45,41 @@ __global__ void ps_forward(complex_vector* __restrict__ model, complex_vector* _
   int jy = blockDim.y * gridDim.y;
   int jw = blockDim.z * gridDim.z;
 
-  for (int is=0; is < NS; ++is) {
-
   for (int iw=iw0; iw < NW; iw += jw) {
     float sre = cuCrealf(slow_ref[iw]);
     float sim = cuCimagf(slow_ref[iw]);
     for (int iy=iy0; iy < NY; iy += jy) {
       for (int ix=ix0; ix < NX; ix += jx) {
-        a = w2[iw]*sre - (kx[ix]*kx[ix] + ky[iy]*ky[iy]);
-        b = w2[iw]*(sim-eps*sre);
-        c = sqrtf(a*a + b*b);
-        if (b <= 0) {
-          re = sqrtf((c+a)/2);
-          im = -sqrtf((c-a)/2);
-        }
-        else {
-          re = -sqrt((c+a)/2);
-				  im = -sqrt((c-a)/2);
-        }
-        
-        // convert 4d index to flat index
-
-          int nd_ind[] = {is, iw, iy, ix};
-          flat_ind = ND_TO_FLAT(nd_ind, dims);
+        cuFloatComplex p = ps_factor(w2[iw], kx[ix], ky[iy], sre, sim, dz, eps, inverse);
+        if (conj) p = cuConjf(p);
 
-          float att = exp(im*dz);
-          float coss = cos(re*dz);
-          float sinn = sin(re*dz);
-
-          float mre = cuCrealf(model->mat[flat_ind]);
-          float mim = cuCimagf(model->mat[flat_ind]);
-
-          re = att * (mre * coss + mim * sinn);
-          im = att * (-mre * sinn + mim * coss);
-
-          data->mat[flat_ind] = cuCaddf(data->mat[flat_ind], make_cuFloatComplex(re, im)); 
+        size_t i = (size_t(iw)*NY + iy)*NX + ix;
+        for (int is=0; is < NS; ++is, i += stride) {
+          cuFloatComplex val = cuCmulf(p, in[i]);
+          out[i] = add ? cuCaddf(out[i], val) : val;
         }
       }
     }
   }
 };
 
-__global__ void ps_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps) {
-  
-  float a, b, c, re, im;
-  int flat_ind;
+__global__ void ps_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* __restrict__  w2, float* __restrict__  kx, float* __restrict__  ky, cuFloatComplex* __restrict__ slow_ref, float dz, float eps, bool add) {
+  ps_apply(model->mat, data->mat, model->n, w2, kx, ky, slow_ref, dz, eps, false, false, add);
+};
 
-  int NX = model->n[0];
-  int NY = model->n[1];
-  int NW = model->n[2];
-  int NS = model->n[3];
-  int dims[] = {NS, NW, NY, NX};
+__global__ void ps_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add) {
+  ps_apply(data->mat, model->mat, model->n, w2, kx, ky, slow_ref, dz, eps, true, false, add);
+};
+
+__global__ void ps_inverse(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add) {
+  ps_apply(data->mat, model->mat, model->n, w2, kx, ky, slow_ref, dz, eps, true, true, add);
+}
+
+
+// tables[iw][iy*NX + ix] = exp(-i kz dz) for the frequencies flagged in build
+__global__ void ps_build_tables(cuFloatComplex** tables, int* build, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref,
+  float dz, float eps, int NX, int NY, int NW) {
 
   int ix0 = threadIdx.x + blockDim.x*blockIdx.x;
   int iy0 = threadIdx.y + blockDim.y*blockIdx.y;
@@ -85,56 +89,43 @@ __global__ void ps_adjoint(complex_vector* __restrict__ model, complex_vector* _
   int jy = blockDim.y * gridDim.y;
   int jw = blockDim.z * gridDim.z;
 
-  for (int is=0; is < NS; ++is) {
-
   for (int iw=iw0; iw < NW; iw += jw) {
+    if (!build[iw]) continue;
     float sre = cuCrealf(slow_ref[iw]);
     float sim = cuCimagf(slow_ref[iw]);
     for (int iy=iy0; iy < NY; iy += jy) {
       for (int ix=ix0; ix < NX; ix += jx) {
-        a = w2[iw]*sre - (kx[ix]*kx[ix] + ky[iy]*ky[iy]);
-        b = w2[iw]*(sim-eps*sre);
-        c = sqrtf(a*a + b*b);
-        if (b <= 0) {
-          re = sqrtf((c+a)/2);
-          im = -sqrtf((c-a)/2);
-        }
-        else {
-          re = -sqrt((c+a)/2);
-				  im = -sqrt((c-a)/2);
-        }
-
-          // convert 4d index to flat index
-          int nd_ind[] = {is, iw, iy, ix};
-          flat_ind = ND_TO_FLAT(nd_ind, dims);
-
-          float att = exp(im*dz);
-          float coss = cos(re*dz);
-          float sinn = sin(re*dz);
-
-          float dre = cuCrealf(data->mat[flat_ind]);
-          float dim = cuCimagf(data->mat[flat_ind]);
-
-          re = att * (dre * coss - dim * sinn);
-          im = att * (dre * sinn + dim * coss);
-
-          model->mat[flat_ind] = cuCaddf(model->mat[flat_ind], make_cuFloatComplex(re, im));
-        }
+        tables[iw][iy*NX + ix] = ps_factor(w2[iw], kx[ix], ky[iy], sre, sim, dz, eps, false);
       }
     }
   }
 };
 
-__global__ void ps_inverse(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps) {
-  
-  float a, b, c, re, im;
-  int flat_ind;
+void launch_ps_build_tables(cuFloatComplex** tables, int* build, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref,
+  float dz, float eps, int NX, int NY, int NW, dim3 grid, dim3 block, cudaStream_t stream) {
+  ps_build_tables<<<grid, block, 0, stream>>>(tables, build, w2, kx, ky, slow_ref, dz, eps, NX, NY, NW);
+  CHECK_CUDA_ERROR( cudaPeekAtLastError() );
+};
+
+// the inverse exp(+i kz dz) of the attenuated propagator P is 1/P = conj(P)/|P|^2, scaled by 1/|P|
+// twice: |P|^2 underflows long before |P| for strongly evanescent modes. Capped at FLT_MAX, and 0
+// where P itself underflowed
+__device__ __forceinline__ cuFloatComplex ps_table_inv(cuFloatComplex p) {
+  float a = hypotf(p.x, p.y);
+  if (a == 0.f) return make_cuFloatComplex(0.f, 0.f);
+  float r = fminf(1.f / a, FLT_MAX);
+  return make_cuFloatComplex(p.x / a * r, -p.y / a * r);
+};
+
+// same as ps_apply with the propagator read from the tables
+__device__ __forceinline__ void ps_table_apply(const cuFloatComplex* __restrict__ in, cuFloatComplex* __restrict__ out, const int* n,
+  cuFloatComplex* const* __restrict__ tables, bool conj, bool inverse, bool add) {
 
-  int NX = model->n[0];
-  int NY = model->n[1];
-  int NW = model->n[2];
-  int NS = model->n[3];
-  int dims[] = {NS, NW, NY, NX};
+  int NX = n[0];
+  int NY = n[1];
+  int NW = n[2];
+  int NS = n[3];
+  size_t stride = size_t(NW)*NY*NX;
 
   int ix0 = threadIdx.x + blockDim.x*blockIdx.x;
   int iy0 = threadIdx.y + blockDim.y*blockIdx.y;
@@ -144,42 +135,32 @@ __global__ void ps_inverse(complex_vector* __restrict__ model, complex_vector* _
   int jy = blockDim.y * gridDim.y;
   int jw = blockDim.z * gridDim.z;
 
-  for (int is=0; is < NS; ++is) {
-
   for (int iw=iw0; iw < NW; iw += jw) {
-    float sre = cuCrealf(slow_ref[iw]);
-    float sim = cuCimagf(slow_ref[iw]);
+    const cuFloatComplex* __restrict__ table = tables[iw];
     for (int iy=iy0; iy < NY; iy += jy) {
       for (int ix=ix0; ix < NX; ix += jx) {
-        a = w2[iw]*sre - (kx[ix]*kx[ix] + ky[iy]*ky[iy]);
-        b = w2[iw]*(sim-eps*sre);
-        c = sqrtf(a*a + b*b);
-        if (b <= 0) {
-          re = sqrtf((c+a)/2);
-          im = sqrtf((c-a)/2);
-        }
-        else {
-          re = -sqrt((c+a)/2);
-				  im = sqrt((c-a)/2);
-        }
-
-          // convert 4d index to flat index
-          int nd_ind[] = {is, iw, iy, ix};
-          flat_ind = ND_TO_FLAT(nd_ind, dims);
-
-          float att = exp(im*dz);
-          float coss = cos(re*dz);
-          float sinn = sin(re*dz);
-
-          float dre = cuCrealf(data->mat[flat_ind]);
-          float dim = cuCimagf(data->mat[flat_ind]);
-
-          re = att * (dre * coss - dim * sinn);
-          im = att * (dre * sinn + dim * coss);
-
-          model->mat[flat_ind] = cuCaddf(model->mat[flat_ind], make_cuFloatComplex(re, im));
+        cuFloatComplex p = table[iy*NX + ix];
+        if (inverse) p = cuConjf(ps_table_inv(p));
+        if (conj) p = cuConjf(p);
+
+        size_t i = (size_t(iw)*NY + iy)*NX + ix;
+        for (int is=0; is < NS; ++is, i += stride) {
+          cuFloatComplex val = cuCmulf(p, in[i]);
+          out[i] = add ? cuCaddf(out[i], val) : val;
         }
       }
     }
   }
-}
\ No newline at end of file
+};
+
+__global__ void ps_table_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(model->mat, data->mat, model->n, tables, false, false, add);
+};
+
+__global__ void ps_table_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(data->mat, model->mat, model->n, tables, true, false, add);
+};
+
+__global__ void ps_table_inverse(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(data->mat, model->mat, model->n, tables, true, true, add);
+};
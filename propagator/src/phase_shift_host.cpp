@@ -0,0 +1,138 @@
+#include <complex_vector.h>
+#include <prop_kernels_host.h>
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range2d.h>
+
+namespace {
+
+  // vertical wavenumber (re, im) as in the device kernels; inverse flips the sign of the attenuation
+  inline void vertical_wavenumber(float w2, float kx, float ky, float sre, float sim, float eps, bool inverse, float& re, float& im) {
+    float a = w2*sre - (kx*kx + ky*ky);
+    float b = w2*(sim-eps*sre);
+    float c = std::sqrt(a*a + b*b);
+    if (b <= 0) re = std::sqrt((c+a)/2);
+    else re = -std::sqrt((c+a)/2);
+    im = inverse ? std::sqrt((c-a)/2) : -std::sqrt((c-a)/2);
+  }
+
+  // row of exp(-i kz dz) (conj = false) or exp(+i kz dz) (conj = true) for one (w, ky)
+  inline void ps_row(cuFloatComplex* p, int NX, float w2, const float* kx, float ky, float sre, float sim, float dz, float eps, bool conj, bool inverse) {
+    for (int ix=0; ix < NX; ++ix) {
+      float re, im;
+      vertical_wavenumber(w2, kx[ix], ky, sre, sim, eps, inverse, re, im);
+      float att = std::exp(im*dz);
+      float sinn = std::sin(re*dz);
+      p[ix] = make_cuFloatComplex(att * std::cos(re*dz), conj ? att * sinn : -att * sinn);
+    }
+  }
+
+  // out (+)= P in, where row(iw, iy, buffer) returns the NX propagators of (w, ky).
+  // The row is obtained once and applied to all the sources.
+  template <class Row>
+  void ps_stream(const cuFloatComplex* __restrict__ in, cuFloatComplex* __restrict__ out, const int* n, bool add, Row row) {
+
+    int NX = n[0];
+    int NY = n[1];
+    int NW = n[2];
+    int NS = n[3];
+    size_t stride = size_t(NW)*NY*NX;
+
+    tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 0, NY),
+      [=](const tbb::blocked_range2d<int>& r) {
+      std::vector<cuFloatComplex> buffer(NX);
+      for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+        for (int iy=r.cols().begin(); iy < r.cols().end(); ++iy) {
+          const cuFloatComplex* __restrict__ p = row(iw, iy, buffer.data());
+
+          size_t offset = (size_t(iw)*NY + iy)*NX;
+          for (int is=0; is < NS; ++is, offset += stride) {
+            const cuFloatComplex* __restrict__ x = in + offset;
+            cuFloatComplex* __restrict__ y = out + offset;
+            if (add) for (int ix=0; ix < NX; ++ix) y[ix] = cuCaddf(y[ix], cuCmulf(p[ix], x[ix]));
+            else for (int ix=0; ix < NX; ++ix) y[ix] = cuCmulf(p[ix], x[ix]);
+          }
+        }
+      }
+    });
+  }
+
+  // conj = false: data (+)= exp(-i kz dz) model
+  // conj = true: model (+)= exp(+i kz dz) data
+  void ps_apply(const cuFloatComplex* __restrict__ in, cuFloatComplex* __restrict__ out, const int* n,
+    const float* w2, const float* kx, const float* ky, const cuFloatComplex* slow_ref, float dz, float eps, bool conj, bool inverse, bool add) {
+    int NX = n[0];
+    ps_stream(in, out, n, add, [=](int iw, int iy, cuFloatComplex* p) {
+      ps_row(p, NX, w2[iw], kx, ky[iy], cuCrealf(slow_ref[iw]), cuCimagf(slow_ref[iw]), dz, eps, conj, inverse);
+      return p;
+    });
+  }
+
+  // 1/P = conj(P)/|P|^2, scaled by 1/|P| twice: |P|^2 underflows long before |P| for strongly
+  // evanescent modes. Capped at FLT_MAX, and 0 where P itself underflowed
+  inline cuFloatComplex ps_table_inv(cuFloatComplex p) {
+    float a = hypotf(p.x, p.y);
+    if (a == 0.f) return make_cuFloatComplex(0.f, 0.f);
+    float r = fminf(1.f / a, FLT_MAX);
+    return make_cuFloatComplex(p.x / a * r, -p.y / a * r);
+  }
+
+  // same with the propagators read from the tables
+  void ps_table_apply(const cuFloatComplex* __restrict__ in, cuFloatComplex* __restrict__ out, const int* n,
+    cuFloatComplex* const* tables, bool conj, bool inverse, bool add) {
+    int NX = n[0];
+    ps_stream(in, out, n, add, [=](int iw, int iy, cuFloatComplex* p) -> const cuFloatComplex* {
+      const cuFloatComplex* t = tables[iw] + size_t(iy)*NX;
+      if (!conj) return t;
+      for (int ix=0; ix < NX; ++ix) p[ix] = inverse ? ps_table_inv(t[ix]) : cuConjf(t[ix]);
+      return p;
+    });
+  }
+}
+
+void ps_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add) {
+  ps_apply(model->mat, data->mat, model->n, w2, kx, ky, slow_ref, dz, eps, false, false, add);
+};
+
+void ps_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add) {
+  ps_apply(data->mat, model->mat, model->n, w2, kx, ky, slow_ref, dz, eps, true, false, add);
+};
+
+void ps_inverse_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add) {
+  ps_apply(data->mat, model->mat, model->n, w2, kx, ky, slow_ref, dz, eps, true, true, add);
+};
+
+void ps_table_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(model->mat, data->mat, model->n, tables, false, false, add);
+};
+
+void ps_table_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(data->mat, model->mat, model->n, tables, true, false, add);
+};
+
+void ps_table_inverse_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add) {
+  ps_table_apply(data->mat, model->mat, model->n, tables, true, true, add);
+};
+
+void ps_build_tables_host(cuFloatComplex** tables, int* build, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref,
+  float dz, float eps, int NX, int NY, int NW) {
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 0, NY),
+    [=](const tbb::blocked_range2d<int>& r) {
+    for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+      if (!build[iw]) continue;
+      for (int iy=r.cols().begin(); iy < r.cols().end(); ++iy)
+        ps_row(tables[iw] + size_t(iy)*NX, NX, w2[iw], kx, ky[iy], cuCrealf(slow_ref[iw]), cuCimagf(slow_ref[iw]), dz, eps, false, false);
+    }
+  });
+};
+
+void ps_slice_host(cuFloatComplex* p, int NX, int NY, float w2, const float* kx, const float* ky, cuFloatComplex slow_ref,
+  float dz, float eps) {
+  for (int iy=0; iy < NY; ++iy)
+    ps_row(p + size_t(iy)*NX, NX, w2, kx, ky[iy], cuCrealf(slow_ref), cuCimagf(slow_ref), dz, eps, false, false);
+};
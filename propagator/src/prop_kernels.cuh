@@ -6,16 +6,32 @@
 
 // phase shift
 __global__ void ps_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps);
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
 __global__ void ps_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps);
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
   __global__ void ps_inverse(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
-    float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps);
-typedef KernelLauncher<float*, float*, float*, cuFloatComplex*, float, float> PS_launcher;
+    float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
+typedef KernelLauncher<float*, float*, float*, cuFloatComplex*, float, float, bool> PS_launcher;
+// phase shift with precomputed tables (one per frequency)
+__global__ void ps_table_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+__global__ void ps_table_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+__global__ void ps_table_inverse(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+typedef KernelLauncher<cuFloatComplex**, bool> PSTable_launcher;
+void launch_ps_build_tables(cuFloatComplex** tables, int* build, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref,
+  float dz, float eps, int NX, int NY, int NW, dim3 grid, dim3 block, cudaStream_t stream);
 // selector
-__global__ void select_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, int* labels);
-typedef KernelLauncher<int, int*> Selector_launcher;
+__global__ void select_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, uint8_t* labels, int* wmap, bool add);
+typedef KernelLauncher<int, uint8_t*, int*, bool> Selector_launcher;
+// copies only the points listed in index (x,y,w flat), for every source
+__global__ void select_scatter(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int* index, int count, bool add);
+typedef KernelLauncher<int*, int, bool> SelectList_launcher;
+// index lists of the points grouped by label, cursor starts at the label offsets
+void launch_select_build_index(const uint8_t* labels, const int* wmap, int nxy, int size, int* cursor, int* index, cudaStream_t stream);
   // injection
-__global__ void inj_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids);
-__global__ void inj_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids);
-typedef KernelLauncher<float*, float*, float*, int*> Injection_launcher;
+__global__ void inj_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add);
+__global__ void inj_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add);
+typedef KernelLauncher<float*, float*, float*, int*, bool> Injection_launcher;
+// imaging condition at one depth, model: source wavefield, data: receiver wavefield, image: [ny, nx]
+__global__ void img_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add);
+__global__ void img_adjoint(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add);
+typedef KernelLauncher<cuFloatComplex*, bool> Imaging_launcher;
@@ -0,0 +1,31 @@
+#pragma once
+#include <complex_vector.h>
+#include <cuComplex.h>
+#include <cstdint>
+
+// host (TBB) counterparts of the kernels in prop_kernels.cuh, same arguments
+// phase shift
+void ps_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
+void ps_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
+void ps_inverse_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, 
+  float* w2, float* kx, float* ky, cuFloatComplex* slow_ref, float dz, float eps, bool add);
+void ps_table_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+void ps_table_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+void ps_table_inverse_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex** tables, bool add);
+void ps_build_tables_host(cuFloatComplex** tables, int* build, float* w2, float* kx, float* ky, cuFloatComplex* slow_ref,
+  float dz, float eps, int NX, int NY, int NW);
+// exp(-i kz dz) over one (ky, kx) slice of frequency w, serially (for callers already running in parallel)
+void ps_slice_host(cuFloatComplex* p, int NX, int NY, float w2, const float* kx, const float* ky, cuFloatComplex slow_ref,
+  float dz, float eps);
+// selector
+void select_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, uint8_t* labels, int* wmap, bool add);
+void select_scatter_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int* index, int count, bool add);
+void select_build_index_host(const uint8_t* labels, const int* wmap, int nxy, int size, int* cursor, int* index);
+// injection
+void inj_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add);
+void inj_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, float* cx, float* cy, float* cz, int* ids, bool add);
+// imaging condition
+void img_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add);
+void img_adjoint_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, cuFloatComplex* image, bool add);
@@ -19,10 +19,24 @@ class PhaseShift(Op.Operator):
 	def set_slow(self,slow):
 		self.cppMode.set_slow(slow)
 
+	def set_table_cache(self, budget, tolerance=0.):
+		self.cppMode.set_table_cache(budget, tolerance)
+
+	def get_table_cache(self):
+		return self.cppMode.get_table_cache()
+
 
 class RefSampler:
-	def __init__(self, slow, nref):
-		self.cppMode = pyCudaWEM.RefSampler(slow.cppMode, nref)
+	# method: "histogram" or "opencv"; cache_dir: where the results are kept across runs;
+	# lazy: number of depths clustered ahead in the background (0 = all up front)
+	def __init__(self, slow, nref, method="histogram", cache_dir="", lazy=0):
+		self.cppMode = pyCudaWEM.RefSampler(slow.cppMode, nref, getattr(pyCudaWEM.Clustering, method.upper()), cache_dir, lazy)
+
+	def cluster_error(self):
+		return self.cppMode.cluster_error()
+
+	def from_cache(self):
+		return self.cppMode.from_cache()
 
 	def get_ref_slow(self, iz, iref):
 		return self.cppMode.get_ref_slow(iz,iref)
@@ -31,9 +45,22 @@ class RefSampler:
 		return self.cppMode.get_ref_labels(iz)
 	
 
+class PropagationContext:
+	"""Frequency and wavenumber axes of a domain, shared by the operators built on it"""
+	def __init__(self, model):
+		self.cppMode = pyCudaWEM.PropagationContext(model.getHyper().cppMode)
+
+def _shared(ref, ctx):
+	return ref.cppMode, ctx.cppMode if ctx is not None else None
+
 class PSPI(Op.Operator):
-	def __init__(self, model, data, slow, par):
-		self.cppMode = pyCudaWEM.PSPI(model.getHyper().cppMode, slow.cppMode, par.cppMode)
+	# ref (an eager RefSampler) and ctx (a PropagationContext) may be shared by several operators
+	# of the same model; slow is then not used
+	def __init__(self, model, data, slow, par, ref=None, ctx=None):
+		if ref is not None:
+			self.cppMode = pyCudaWEM.PSPI(model.getHyper().cppMode, *_shared(ref, ctx), par.cppMode)
+		else:
+			self.cppMode = pyCudaWEM.PSPI(model.getHyper().cppMode, slow.cppMode, par.cppMode)
 		self.setDomainRange(model, data)
 
 	def forward(self,add,model,data):
@@ -45,10 +72,16 @@ class PSPI(Op.Operator):
 	def set_depth(self, iz):
 		self.cppMode.set_depth(iz)
 
+	def get_ps_tables(self):
+		return self.cppMode.get_ps_tables()
+
 
 class NSPS(Op.Operator):
-	def __init__(self, model, data, slow, par):
-		self.cppMode = pyCudaWEM.NSPS(model.getHyper().cppMode, slow.cppMode, par.cppMode)
+	def __init__(self, model, data, slow, par, ref=None, ctx=None):
+		if ref is not None:
+			self.cppMode = pyCudaWEM.NSPS(model.getHyper().cppMode, *_shared(ref, ctx), par.cppMode)
+		else:
+			self.cppMode = pyCudaWEM.NSPS(model.getHyper().cppMode, slow.cppMode, par.cppMode)
 		self.setDomainRange(model, data)
 
 	def forward(self,add,model,data):
@@ -76,8 +109,11 @@ class Injection(Op.Operator):
 
 
 class Downward(Op.Operator):
-	def __init__(self, model, data, slow, par):
-		self.cppMode = pyCudaWEM.Downward(model.getHyper().cppMode, slow.cppMode, par.cppMode)
+	def __init__(self, model, data, slow, par, ref=None, ctx=None):
+		if ref is not None:
+			self.cppMode = pyCudaWEM.Downward(model.getHyper().cppMode, *_shared(ref, ctx), par.cppMode)
+		else:
+			self.cppMode = pyCudaWEM.Downward(model.getHyper().cppMode, slow.cppMode, par.cppMode)
 		self.setDomainRange(model, data)
 
 	def forward(self,add,model,data):
@@ -96,8 +132,11 @@ class Downward(Op.Operator):
 		self.cppMode.set_depth(iz)
 
 class Upward(Op.Operator):
-	def __init__(self, model, data, slow, par):
-		self.cppMode = pyCudaWEM.Upward(model.getHyper().cppMode, slow.cppMode, par.cppMode)
+	def __init__(self, model, data, slow, par, ref=None, ctx=None):
+		if ref is not None:
+			self.cppMode = pyCudaWEM.Upward(model.getHyper().cppMode, *_shared(ref, ctx), par.cppMode)
+		else:
+			self.cppMode = pyCudaWEM.Upward(model.getHyper().cppMode, slow.cppMode, par.cppMode)
 		self.setDomainRange(model, data)
 
 	def forward(self,add,model,data):
@@ -109,3 +148,24 @@ class Upward(Op.Operator):
 	def set_depth(self, iz):
 		self.cppMode.set_depth(iz)
 
+class Imaging(Op.Operator):
+	"""Image (x,y,z) -> receiver wavefields at the surface, against the source wavefields of a forwarded Downward"""
+	def __init__(self, model, data, source):
+		self.cppMode = pyCudaWEM.Imaging(model.getHyper().cppMode, source.cppMode)
+		self.source = source
+		self.setDomainRange(model, data)
+
+	def forward(self,add,model,data):
+		self.cppMode.forward(add, model.cppMode, data.cppMode)
+
+	def adjoint(self,add,model,data):
+		self.cppMode.adjoint(add, model.cppMode, data.cppMode)
+
+
+def cgls(op, model, data, niter, tol=0.):
+	"""Least-squares inversion of op (PSPI, NSPS, Downward) with CGLS, without per-iteration host copies"""
+	return pyCudaWEM.cgls(op.cppMode, model.cppMode, data.cppMode, niter, tol)
+
+def lsqr(op, model, data, niter, tol=0.):
+	"""Least-squares inversion of op (PSPI, NSPS, Downward) with LSQR, without per-iteration host copies"""
+	return pyCudaWEM.lsqr(op.cppMode, model.cppMode, data.cppMode, niter, tol)
@@ -8,15 +8,61 @@
 #include "PhaseShift.h"
 #include "RefSampler.h"
 #include "OneStep.h"
+#include "PropagationContext.h"
 #include "Injection.h"
 #include "OneWay.h"
+#include "Imaging.h"
+#include "Solver.h"
 
 namespace py = pybind11;
 
 using namespace SEP;
 
+// least-squares solvers on the operator's resident vectors, one overload per operator type
+template <class Op>
+void def_solvers(py::module& m) {
+  m.def("cgls", [](std::shared_ptr<Op>& op, std::shared_ptr<complex4DReg>& model, std::shared_ptr<complex4DReg>& data, int niter, double tol) {
+        return CGLS<complex4DReg, complex4DReg>(op.get(), niter, tol).solve(model, data);
+      },
+      py::arg("op"), py::arg("model"), py::arg("data"), py::arg("niter"), py::arg("tol") = 0.,
+      "Solve min ||op m - d|| with CGLS; returns the residual norm per iteration");
+
+  m.def("lsqr", [](std::shared_ptr<Op>& op, std::shared_ptr<complex4DReg>& model, std::shared_ptr<complex4DReg>& data, int niter, double tol) {
+        return LSQR<complex4DReg, complex4DReg>(op.get(), niter, tol).solve(model, data);
+      },
+      py::arg("op"), py::arg("model"), py::arg("data"), py::arg("niter"), py::arg("tol") = 0.,
+      "Solve min ||op m - d|| with LSQR; returns the residual norm estimate per iteration");
+}
+
 PYBIND11_MODULE(pyCudaWEM, clsOps) {
 
+py::class_<PSTableCache>(clsOps, "PSTableCache")
+    .def("hits", &PSTableCache::hits)
+    .def("misses", &PSTableCache::misses)
+    .def("evictions", &PSTableCache::evictions)
+    .def("hit_rate", &PSTableCache::hit_rate)
+    .def("bytes", &PSTableCache::bytes)
+    .def("size", &PSTableCache::size)
+    .def("clear", &PSTableCache::clear);
+
+py::class_<WavefieldStore>(clsOps, "WavefieldStore")
+    .def("bytes", &WavefieldStore::bytes)
+    .def("flush", &WavefieldStore::flush);
+
+py::class_<SZ3Store, WavefieldStore>(clsOps, "SZ3Store")
+    .def("ratio", &SZ3Store::ratio)
+    .def("compress_throughput", &SZ3Store::compress_throughput, "MB/s per thread")
+    .def("decompress_throughput", &SZ3Store::decompress_throughput, "MB/s per thread");
+
+py::class_<FileStore, WavefieldStore>(clsOps, "FileStore")
+    .def("prefetch_hits", &FileStore::prefetch_hits)
+    .def("sync_reads", &FileStore::sync_reads)
+    .def("write_throughput", &FileStore::write_throughput, "MB/s")
+    .def("read_throughput", &FileStore::read_throughput, "MB/s");
+
+py::class_<CheckpointStore, WavefieldStore>(clsOps, "CheckpointStore")
+    .def("checkpoints", &CheckpointStore::checkpoints);
+
 py::class_<PhaseShift, std::shared_ptr<PhaseShift>>(clsOps, "PhaseShift")
     .def(py::init<std::shared_ptr<hypercube>, float, float &>(),
         "Initialize PhaseShift")
@@ -34,12 +80,28 @@ py::class_<PhaseShift, std::shared_ptr<PhaseShift>>(clsOps, "PhaseShift")
     .def("set_slow", [](PhaseShift &self, py::array_t<std::complex<float>, py::array::c_style> arr) {
             auto buf = arr.request();
             self.set_slow(static_cast<std::complex<float> *>(buf.ptr));
-        });
+        })
+
+    .def("set_table_cache", &PhaseShift::set_table_cache,
+        py::arg("budget"), py::arg("tolerance") = 0.f,
+        "Cache the phase-shift tables per (reference slowness, frequency) within budget bytes")
+
+    .def("get_table_cache", &PhaseShift::get_table_cache, py::return_value_policy::reference_internal);
+
+py::enum_<RefSampler::Clustering>(clsOps, "Clustering")
+    .value("HISTOGRAM", RefSampler::Clustering::HISTOGRAM)
+    .value("OPENCV", RefSampler::Clustering::OPENCV);
 
 py::class_<RefSampler, std::shared_ptr<RefSampler>>(clsOps, "RefSampler")
-    .def(py::init<std::shared_ptr<complex4DReg>&, int>(),
+    .def(py::init<std::shared_ptr<complex4DReg>&, int, RefSampler::Clustering, const std::string&, int>(),
+        py::arg("slow"), py::arg("nref"), py::arg("method") = RefSampler::Clustering::HISTOGRAM,
+        py::arg("cache_dir") = "", py::arg("lazy") = 0,
         "Initialize RefSampler")
 
+    .def("cluster_error", &RefSampler::cluster_error)
+    .def("from_cache", &RefSampler::from_cache)
+    .def("is_lazy", &RefSampler::is_lazy)
+
     .def("get_ref_slow", [](RefSampler &self, int iz, int iref) {
         return py::array_t<std::complex<float>>(
             {self._nw_}, // shape
@@ -48,16 +110,29 @@ py::class_<RefSampler, std::shared_ptr<RefSampler>>(clsOps, "RefSampler")
     })
 
     .def("get_ref_labels", [](RefSampler &self, int iz) {
-        return py::array_t<int>(
-            {self._nw_, self._ny_, self._nx_}, // shape
-            self.get_ref_labels(iz) // pointer to data
-        );
-    });
+        // expanded from the shared slices to every frequency
+        py::array_t<uint8_t> labels({self._nw_, self._ny_, self._nx_});
+        const uint8_t* slices = self.get_ref_labels(iz);
+        const int* wmap = self.get_ref_wmap(iz);
+        size_t n = size_t(self._ny_) * self._nx_;
+        for (int iw = 0; iw < self._nw_; ++iw)
+            std::copy(slices + wmap[iw] * n, slices + (wmap[iw] + 1) * n, labels.mutable_data() + iw * n);
+        return labels;
+    })
+
+    .def("get_ref_nslices", &RefSampler::get_ref_nslices);
+
+py::class_<PropagationContext, std::shared_ptr<PropagationContext>>(clsOps, "PropagationContext")
+    .def(py::init<std::shared_ptr<hypercube>&>(),
+        "Frequency and wavenumber axes shared by the propagators of one domain");
 
 py::class_<PSPI, std::shared_ptr<PSPI>>(clsOps, "PSPI")
     .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<complex4DReg>, std::shared_ptr<paramObj>>(),
         "Initialize PSPI")
 
+    .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<RefSampler>, std::shared_ptr<PropagationContext>, std::shared_ptr<paramObj>>(),
+        "Initialize PSPI with a reference sampler and propagation context shared with other operators")
+
     .def("forward",
         (void (PSPI::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
         PSPI::forward,
@@ -71,12 +146,18 @@ py::class_<PSPI, std::shared_ptr<PSPI>>(clsOps, "PSPI")
     .def("set_depth", 
         (void (PSPI::*)(int)) &
         PSPI::set_depth,
-        "Set depth of PSPI");
+        "Set depth of PSPI")
+
+    .def("get_ps_tables", &PSPI::get_ps_tables, py::return_value_policy::reference_internal,
+        "Phase-shift table cache statistics (None unless ps_cache_mb is set)");
 
 py::class_<NSPS, std::shared_ptr<NSPS>>(clsOps, "NSPS")
     .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<complex4DReg>, std::shared_ptr<paramObj>>(),
         "Initialize NSPS")
 
+    .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<RefSampler>, std::shared_ptr<PropagationContext>, std::shared_ptr<paramObj>>(),
+        "Initialize NSPS with a reference sampler and propagation context shared with other operators")
+
     .def("forward",
         (void (NSPS::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
         NSPS::forward,
@@ -90,7 +171,10 @@ py::class_<NSPS, std::shared_ptr<NSPS>>(clsOps, "NSPS")
     .def("set_depth", 
         (void (NSPS::*)(int)) &
         NSPS::set_depth,
-        "Set depth of NSPS");
+        "Set depth of NSPS")
+
+    .def("get_ps_tables", &NSPS::get_ps_tables, py::return_value_policy::reference_internal,
+        "Phase-shift table cache statistics (None unless ps_cache_mb is set)");
 
 
 py::class_<Injection, std::shared_ptr<Injection>>(clsOps, "Injection")
@@ -116,6 +200,9 @@ py::class_<Downward, std::shared_ptr<Downward>>(clsOps, "Downward")
     .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<complex4DReg>&, std::shared_ptr<paramObj>&>(),
         "Initialize Downward")
 
+    .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<RefSampler>, std::shared_ptr<PropagationContext>, std::shared_ptr<paramObj>>(),
+        "Initialize Downward with a reference sampler and propagation context shared with other operators")
+
     .def("forward",
         (void (Downward::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
         Downward::forward,
@@ -134,12 +221,21 @@ py::class_<Downward, std::shared_ptr<Downward>>(clsOps, "Downward")
     .def("adjoint",
         (void (Downward::*)(std::shared_ptr<complex4DReg>&)) &
         Downward::adjoint,
-        "Adjoint operator of Downward");
+        "Adjoint operator of Downward")
+
+    .def("get_store", &Downward::get_store, py::return_value_policy::reference_internal,
+        "Store of the wavefields of every depth (an SZ3Store, FileStore or CheckpointStore with wfld_store = sz3, file or checkpoint)")
+
+    .def("get_recompute_factor", &Downward::get_recompute_factor,
+        "Steps recomputed from the checkpoints since the last forward, per propagated step");
 
 py::class_<Upward, std::shared_ptr<Upward>>(clsOps, "Upward")
     .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<complex4DReg>&, std::shared_ptr<paramObj>&>(),
         "Initialize Upward")
 
+    .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<RefSampler>, std::shared_ptr<PropagationContext>, std::shared_ptr<paramObj>>(),
+        "Initialize Upward with a reference sampler and propagation context shared with other operators")
+
     .def("forward",
         (void (Upward::*)(bool, std::shared_ptr<complex4DReg>&, std::shared_ptr<complex4DReg>&)) &
         Upward::forward,
@@ -150,5 +246,23 @@ py::class_<Upward, std::shared_ptr<Upward>>(clsOps, "Upward")
         Upward::adjoint,
         "Adjoint operator of Upward");
 
+py::class_<Imaging, std::shared_ptr<Imaging>>(clsOps, "Imaging")
+    .def(py::init<std::shared_ptr<hypercube>&, std::shared_ptr<Downward>>(),
+        "Initialize Imaging against the source wavefields of a Downward")
+
+    .def("forward",
+        (void (Imaging::*)(bool, std::shared_ptr<complex3DReg>&, std::shared_ptr<complex4DReg>&)) &
+        Imaging::forward,
+        "Forward operator of Imaging")
+
+    .def("adjoint",
+        (void (Imaging::*)(bool, std::shared_ptr<complex3DReg>&, std::shared_ptr<complex4DReg>&)) &
+        Imaging::adjoint,
+        "Adjoint operator of Imaging");
+
+def_solvers<PSPI>(clsOps);
+def_solvers<NSPS>(clsOps);
+def_solvers<Downward>(clsOps);
+
 }
 
@@ -3,9 +3,11 @@
 #include <cuComplex.h>
 #include <KernelLauncher.cuh>
 #include <KernelLauncher.cu>
+#include <algorithm>
 
-template class KernelLauncher<int, int*>;
-__global__ void select_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, int* labels) {
+template class KernelLauncher<int, uint8_t*, int*, bool>;
+template class KernelLauncher<int*, int, bool>;
+__global__ void select_forward(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, uint8_t* labels, int* wmap, bool add) {
 
   int NX = model->n[0];
   int NY = model->n[1];
@@ -25,14 +27,73 @@ __global__ void select_forward(complex_vector* __restrict__ model, complex_vecto
     for (int iw=iw0; iw < NW; iw += jw) {
       for (int iy=iy0; iy < NY; iy += jy) {
         for (int ix=ix0; ix < NX; ix += jx) {
-          int i = ix + (iy + iw*NY)*NX;
-          if (labels[i] == value) {
-            int nd_ind[] = {is, iw, iy, ix};
-            int ind = ND_TO_FLAT(nd_ind, dims);
-            data->mat[ind] = cuCaddf(data->mat[ind], model->mat[ind]); 
-          }
+          int i = ix + (iy + wmap[iw]*NY)*NX;
+          int nd_ind[] = {is, iw, iy, ix};
+          int ind = ND_TO_FLAT(nd_ind, dims);
+          // without add the points of the other labels are zeroed here, instead of a separate pass
+          if (labels[i] == value) data->mat[ind] = add ? cuCaddf(data->mat[ind], model->mat[ind]) : model->mat[ind];
+          else if (!add) data->mat[ind] = make_cuFloatComplex(0.f, 0.f);
         }
       }
     }
   }
 };
+
+__global__ void select_scatter(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int* index, int count, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  size_t stride = size_t(NX)*NY*NW;
+
+  // the launch is 3D, the list is 1D
+  int tid = threadIdx.x + blockDim.x*(threadIdx.y + blockDim.y*threadIdx.z);
+  int bid = blockIdx.x + gridDim.x*(blockIdx.y + gridDim.y*blockIdx.z);
+  int nthreads = blockDim.x*blockDim.y*blockDim.z;
+  int k0 = tid + nthreads*bid;
+  int jk = nthreads*gridDim.x*gridDim.y*gridDim.z;
+
+  for (int k=k0; k < count; k += jk) {
+    size_t ind = index[k];
+    for (int is=0; is < NS; ++is, ind += stride)
+      data->mat[ind] = add ? cuCaddf(data->mat[ind], model->mat[ind]) : model->mat[ind];
+  }
+};
+
+// groups the points by label: each block counts its labels in shared memory and reserves one
+// range per label with a single atomic, so only a handful of global atomics per block.
+// The order within a label is arbitrary, the scatter does not depend on it
+__global__ void select_build_index(const uint8_t* __restrict__ labels, const int* __restrict__ wmap, int nxy, int size,
+  int* cursor, int* __restrict__ index) {
+
+  __shared__ int count[256];
+  __shared__ int base[256];
+
+  for (int start=blockIdx.x*blockDim.x; start < size; start += gridDim.x*blockDim.x) {
+    for (int l=threadIdx.x; l < 256; l += blockDim.x) count[l] = 0;
+    __syncthreads();
+
+    int i = start + threadIdx.x;
+    int label, slot;
+    if (i < size) {
+      label = labels[wmap[i / nxy]*nxy + i % nxy];
+      slot = atomicAdd(&count[label], 1);
+    }
+    __syncthreads();
+
+    for (int l=threadIdx.x; l < 256; l += blockDim.x)
+      if (count[l] > 0) base[l] = atomicAdd(&cursor[l], count[l]);
+    __syncthreads();
+
+    if (i < size) index[base[label] + slot] = i;
+    __syncthreads();
+  }
+};
+
+void launch_select_build_index(const uint8_t* labels, const int* wmap, int nxy, int size, int* cursor, int* index, cudaStream_t stream) {
+  int block = 256;
+  int grid = std::min((size + block - 1) / block, 1024);
+  select_build_index<<<grid, block, 0, stream>>>(labels, wmap, nxy, size, cursor, index);
+  CHECK_CUDA_ERROR( cudaPeekAtLastError() );
+};
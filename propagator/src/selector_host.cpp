@@ -0,0 +1,89 @@
+#include <complex_vector.h>
+#include <prop_kernels_host.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/blocked_range2d.h>
+#include <vector>
+#include <algorithm>
+
+void select_forward_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int value, uint8_t* labels, int* wmap, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  const cuFloatComplex* __restrict__ in = model->mat;
+  cuFloatComplex* __restrict__ out = data->mat;
+
+  tbb::parallel_for(tbb::blocked_range2d<int>(0, NW, 0, NY),
+    [=](const tbb::blocked_range2d<int>& r) {
+    for (int is=0; is < NS; ++is) {
+      for (int iw=r.rows().begin(); iw < r.rows().end(); ++iw) {
+        for (int iy=r.cols().begin(); iy < r.cols().end(); ++iy) {
+          const uint8_t* lab = labels + (size_t(wmap[iw])*NY + iy)*NX;
+          size_t offset = ((size_t(is)*NW + iw)*NY + iy)*NX;
+          for (int ix=0; ix < NX; ++ix) {
+            if (lab[ix] == value) out[offset + ix] = add ? cuCaddf(out[offset + ix], in[offset + ix]) : in[offset + ix];
+            else if (!add) out[offset + ix] = make_cuFloatComplex(0.f, 0.f);
+          }
+        }
+      }
+    }
+  });
+};
+
+void select_scatter_host(complex_vector* __restrict__ model, complex_vector* __restrict__ data, int* index, int count, bool add) {
+
+  int NX = model->n[0];
+  int NY = model->n[1];
+  int NW = model->n[2];
+  int NS = model->n[3];
+  size_t stride = size_t(NX)*NY*NW;
+  const cuFloatComplex* __restrict__ in = model->mat;
+  cuFloatComplex* __restrict__ out = data->mat;
+
+  tbb::parallel_for(tbb::blocked_range<int>(0, count),
+    [=](const tbb::blocked_range<int>& r) {
+    for (int is=0; is < NS; ++is) {
+      size_t offset = is*stride;
+      for (int k=r.begin(); k < r.end(); ++k) {
+        size_t ind = offset + index[k];
+        out[ind] = add ? cuCaddf(out[ind], in[ind]) : in[ind];
+      }
+    }
+  });
+};
+
+// counting sort like the device kernel: each block counts its labels, a prefix over the blocks gives
+// each block its range per label, then the blocks scatter in parallel. Blocks keep their points in
+// order, so the points of each label stay in increasing order as in a serial sort
+void select_build_index_host(const uint8_t* labels, const int* wmap, int nxy, int size, int* cursor, int* index) {
+  constexpr int GRAIN = 1 << 16;
+  int nblocks = (size + GRAIN - 1) / GRAIN;
+  std::vector<int> base(size_t(nblocks) * 256, 0);
+  auto label = [=](int i) {return labels[size_t(wmap[i / nxy])*nxy + i % nxy];};
+
+  tbb::parallel_for(tbb::blocked_range<int>(0, nblocks),
+    [&](const tbb::blocked_range<int>& r) {
+    for (int b=r.begin(); b < r.end(); ++b) {
+      int* count = base.data() + size_t(b)*256;
+      for (int i=b*GRAIN; i < std::min(size, (b+1)*GRAIN); ++i) ++count[label(i)];
+    }
+  });
+
+  for (int l=0; l < 256; ++l) {
+    for (int b=0; b < nblocks; ++b) {
+      int c = base[size_t(b)*256 + l];
+      base[size_t(b)*256 + l] = cursor[l];
+      cursor[l] += c;
+    }
+  }
+
+  tbb::parallel_for(tbb::blocked_range<int>(0, nblocks),
+    [&](const tbb::blocked_range<int>& r) {
+    for (int b=r.begin(); b < r.end(); ++b) {
+      int* next = base.data() + size_t(b)*256;
+      for (int i=b*GRAIN; i < std::min(size, (b+1)*GRAIN); ++i) index[next[label(i)]++] = i;
+    }
+  });
+};
@@ -8,13 +8,36 @@
 #include <OneStep.h>
 #include <Injection.h>
 #include <OneWay.h>
+#include <Imaging.h>
 
 #include <jsonParamObj.h>
 #include <random>
+#include <filesystem>
+#include <cstring>
+#include <algorithm>
 
 bool verbose = false;
 double tolerance = 1e-5;
 
+// laterally varying slowness in [1, 2), the upper half of the frequencies 10% slower, so every
+// depth has several labels and two distinct frequency slices
+std::shared_ptr<complex4DReg> random_slowness(int nx, int ny, int nw, int nz) {
+  auto slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> distrib(1.f, 2.f);
+  auto vals = slow4d->getVals();
+  for (int iz = 0; iz < nz; ++iz)
+    for (int iy = 0; iy < ny; ++iy)
+      for (int ix = 0; ix < nx; ++ix) {
+        float s = distrib(gen);
+        for (int iw = 0; iw < nw; ++iw) {
+          float sw = iw < nw / 2 ? s : 1.1f * s;
+          vals[ix + nx * (iy + ny * (iw + nw * iz))] = {sw, 0.05f * sw};
+        }
+      }
+  return slow4d;
+}
+
 class PS_Test : public testing::Test {
  protected:
   void SetUp() override {
@@ -70,6 +93,114 @@ TEST_F(PS_Test, dotTest) {
   ASSERT_TRUE(err.second <= tolerance);
 }
 
+TEST_F(PS_Test, table_cache) {
+  std::vector<std::complex<float>> slow(n3, {1.f, 0.f});
+  auto cached = std::make_unique<PhaseShift>(space4d->getHyper(), .1f, 0.f);
+  cached->set_table_cache(size_t(1) << 30);
+  auto in = space4d->clone();
+  auto out = space4d->clone();
+  auto expected = space4d->clone();
+  in->random();
+  // the same slowness at every "depth": built once, then looked up
+  for (int iz = 0; iz < 3; ++iz) {
+    cached->set_slow(slow.data());
+    cached->forward(false, in, out);
+  }
+  ps->forward(false, in, expected);
+  out->scaleAdd(expected, 1, -1);
+  ASSERT_TRUE(out->norm(2) / expected->norm(2) <= 1e-6);
+
+  auto tables = cached->get_table_cache();
+  ASSERT_EQ(tables->misses(), n3);
+  ASSERT_EQ(tables->hits(), 2 * n3);
+  ASSERT_EQ(tables->bytes(), n3 * n1 * n2 * sizeof(std::complex<float>));
+  auto err = cached->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(PS_Test, sources_share_propagator) {
+  // the same wavefield in every source slot propagates to the same result
+  auto in = space4d->clone();
+  auto out = space4d->clone();
+  in->random();
+  for (int i4 = 1; i4 < n4; ++i4)
+    for (int i3 = 0; i3 < n3; ++i3)
+      for (int i2 = 0; i2 < n2; ++i2)
+        for (int i1 = 0; i1 < n1; ++i1)
+          (*in->_mat)[i4][i3][i2][i1] = (*in->_mat)[0][i3][i2][i1];
+  ps->set_grid({32, 4, 4});
+  ps->set_block({16, 16, 4});
+  ps->forward(false, in, out);
+  for (int i4 = 1; i4 < n4; ++i4)
+    for (int i3 = 0; i3 < n3; ++i3)
+      for (int i2 = 0; i2 < n2; ++i2)
+        for (int i1 = 0; i1 < n1; ++i1)
+          ASSERT_EQ((*out->_mat)[i4][i3][i2][i1], (*out->_mat)[0][i3][i2][i1]);
+}
+
+class PS_Host_Test : public testing::Test {
+ protected:
+  void SetUp() override {
+    n1 = 100;
+    n2 = 100;
+    n3 = 10;
+    n4 = 10;
+
+    std::vector<std::complex<float>> slow(n3, {1.f, 0.f});
+    auto hyper = std::make_shared<hypercube>(n1, n2, n3, n4);
+    space4d = std::make_shared<complex4DReg>(hyper);
+    space4d->set(1.f);
+    ps = std::make_unique<PhaseShift>(hyper, .1f, 0.f, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+    ps->set_slow(slow.data());
+    ps_device = std::make_unique<PhaseShift>(hyper, .1f, 0.f);
+    ps_device->set_slow(slow.data());
+  }
+
+  std::unique_ptr<PhaseShift> ps, ps_device;
+  std::shared_ptr<complex4DReg> space4d;
+  int n1, n2, n3, n4;
+};
+
+TEST_F(PS_Host_Test, matches_device) { 
+  auto out = space4d->clone();
+  auto out_device = space4d->clone();
+  space4d->random();
+  ps->forward(false, space4d, out);
+  ps_device->forward(false, space4d, out_device);
+  out->scaleAdd(out_device, 1, -1);
+  ASSERT_TRUE(out->norm(2) / out_device->norm(2) <= tolerance);
+}
+
+TEST_F(PS_Host_Test, table_cache) {
+  std::vector<std::complex<float>> slow(n3, {1.f, 0.f});
+  // room for two sets of tables: the third slowness evicts the first one
+  ps->set_table_cache(2 * n3 * n1 * n2 * sizeof(std::complex<float>));
+  auto in = space4d->clone();
+  auto out = space4d->clone();
+  auto expected = space4d->clone();
+  in->random();
+  for (float s : {1.f, 1.5f, 2.f}) {
+    for (auto& v : slow) v = s;
+    ps->set_slow(slow.data());
+    ps_device->set_slow(slow.data());
+    ps->inverse(false, out, in);
+    ps_device->inverse(false, expected, in);
+    out->scaleAdd(expected, 1, -1);
+    ASSERT_TRUE(out->norm(2) / expected->norm(2) <= 1e-5);
+  }
+  auto tables = ps->get_table_cache();
+  ASSERT_EQ(tables->size(), 2 * n3);
+  ASSERT_EQ(tables->evictions(), n3);
+  ASSERT_EQ(tables->hit_rate(), 0.);
+}
+
+TEST_F(PS_Host_Test, dotTest) {
+  auto err = ps->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
 class PSPI_Test : public testing::Test {
  protected:
   void SetUp() override {
@@ -95,9 +226,11 @@ class PSPI_Test : public testing::Test {
     dim3 block = {16, 16, 4};
     pspi = std::make_unique<PSPI>(domain, slow4d, par, nullptr, nullptr, grid, block);
     pspi->set_depth(5);
+    host_pspi = std::make_unique<PSPI>(domain, slow4d, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+    host_pspi->set_depth(5);
   }
 
-  std::unique_ptr<PSPI> pspi;
+  std::unique_ptr<PSPI> pspi, host_pspi;
   std::shared_ptr<complex4DReg> space4d;
   int nx, ny, nz, nw, ns;
 };
@@ -146,6 +279,127 @@ TEST_F(PSPI_Test, dotTest) {
   ASSERT_TRUE(err.second <= tolerance);
 }
 
+TEST_F(PSPI_Test, host_matches_device) { 
+  auto out = space4d->clone();
+  auto out_host = space4d->clone();
+  space4d->random();
+  pspi->forward(false, space4d, out);
+  host_pspi->forward(false, space4d, out_host);
+  out_host->scaleAdd(out, 1, -1);
+  ASSERT_TRUE(out_host->norm(2) / out->norm(2) <= tolerance);
+}
+
+TEST_F(PSPI_Test, host_dotTest) { 
+  auto err = host_pspi->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(PSPI_Test, scratch_peak) { 
+  // one step borrows at most two wavefields of scratch, also when accumulating
+  auto out = space4d->clone();
+  space4d->random();
+  for (auto op : {pspi.get(), host_pspi.get()}) {
+    auto ws = op->get_workspace();
+    ws->reset_peak();
+    op->forward(false, space4d, out);
+    op->adjoint(true, space4d, out);
+    ASSERT_LE(ws->peak_bytes(), 2 * op->getDomainSizeInBytes());
+  }
+}
+
+TEST_F(PSPI_Test, overwrite_output) { 
+  // add = false must not depend on what the output held before (no zero pass)
+  auto out = space4d->clone();
+  auto garbage = space4d->clone();
+  space4d->random();
+  garbage->random();
+  for (auto op : {pspi.get(), host_pspi.get()}) {
+    op->forward(false, space4d, out);
+    op->data_vec->upload(garbage->getVals());
+    op->cu_forward(false, op->model_vec, op->data_vec);
+    auto out2 = space4d->clone();
+    op->data_vec->download(out2->getVals());
+    out2->scaleAdd(out, 1, -1);
+    ASSERT_TRUE(out2->norm(2) / out->norm(2) <= tolerance);
+  }
+}
+
+TEST_F(PSPI_Test, host_blocked) { 
+  // the slice-blocked host step matches the volume sweeps, forward and adjoint, for PSPI and NSPS
+  auto domain = space4d->getHyper();
+  Json::Value root;
+  root["nref"] = 3;
+  root["host_blocked"] = 0;
+  auto par = std::make_shared<jsonParamObj>(root);
+  auto ref = OneStep::make_sampler(random_slowness(nx, ny, nw, nz), par);
+  std::vector<std::pair<std::unique_ptr<OneStep>, std::unique_ptr<OneStep>>> ops;
+  ops.emplace_back(std::make_unique<PSPI>(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST), nullptr);
+  ops.emplace_back(std::make_unique<NSPS>(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST), nullptr);
+  root["host_blocked"] = 1;
+  par = std::make_shared<jsonParamObj>(root);
+  ops[0].second = std::make_unique<PSPI>(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  ops[1].second = std::make_unique<NSPS>(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+
+  space4d->random();
+  for (auto& [sweep, blocked] : ops) {
+    sweep->set_depth(5);
+    blocked->set_depth(5);
+    auto out = space4d->clone();
+    auto out_blocked = space4d->clone();
+    sweep->forward(false, space4d, out);
+    blocked->forward(false, space4d, out_blocked);
+    out_blocked->scaleAdd(out, 1, -1);
+    ASSERT_TRUE(out_blocked->norm(2) / out->norm(2) <= tolerance);
+
+    sweep->adjoint(false, out, space4d);
+    blocked->adjoint(false, out_blocked, space4d);
+    out_blocked->scaleAdd(out, 1, -1);
+    ASSERT_TRUE(out_blocked->norm(2) / out->norm(2) <= tolerance);
+  }
+}
+
+TEST_F(PSPI_Test, shared_sampler) { 
+  // a second operator on the same model reuses the clustering and the axes of the first
+  auto domain = space4d->getHyper();
+  auto ref = host_pspi->get_ref();
+  auto ctx = std::make_shared<PropagationContext>(domain, Backend::HOST);
+  Json::Value root;
+  root["nref"] = 3;
+  auto par = std::make_shared<jsonParamObj>(root);
+  auto shared = std::make_unique<PSPI>(domain, ref, ctx, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  shared->set_depth(5);
+  ASSERT_EQ(shared->get_ref(), ref);
+
+  auto out = space4d->clone();
+  auto out_shared = space4d->clone();
+  space4d->random();
+  host_pspi->forward(false, space4d, out);
+  shared->forward(false, space4d, out_shared);
+  out_shared->scaleAdd(out, 1, -1);
+  ASSERT_TRUE(out_shared->norm(2) / out->norm(2) <= tolerance);
+
+  // the arrays of a host context cannot serve a device operator
+  ASSERT_THROW(PSPI(domain, ref, ctx, par), std::invalid_argument);
+}
+
+TEST_F(PSPI_Test, shared_lazy_sampler) { 
+  // the ring of a lazy sampler follows the depths of one propagator, a second one is refused
+  auto domain = space4d->getHyper();
+  Json::Value root;
+  root["nref"] = 3;
+  root["ref_lazy"] = 2;
+  auto par = std::make_shared<jsonParamObj>(root);
+  auto ref = OneStep::make_sampler(random_slowness(nx, ny, nw, nz), par);
+  ASSERT_TRUE(ref->is_lazy());
+  auto first = std::make_unique<PSPI>(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  ASSERT_THROW(PSPI(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST), std::invalid_argument);
+  ASSERT_EQ(ref->users(), 1);
+
+  // free again once the first one is gone
+  first.reset();
+  ASSERT_NO_THROW(PSPI(domain, ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST));
+}
 
 class Selector_Test : public testing::Test {
  protected:
@@ -177,7 +431,7 @@ class Selector_Test : public testing::Test {
 
 TEST_F(Selector_Test, dotTest) { 
   for (int iz = 0; iz < 3; ++iz) {
-    select->set_labels(ref->get_ref_labels(iz));
+    select->set_labels(ref->get_ref_labels(iz), ref->get_ref_wmap(iz), ref->get_ref_offsets(iz), nref);
     for (int iref = 0; iref < nref; ++iref) {
       select->set_value(iref);
       auto err = select->dotTest(verbose);
@@ -187,6 +441,156 @@ TEST_F(Selector_Test, dotTest) {
   }
 };
 
+TEST_F(Selector_Test, host_dotTest) { 
+  auto host_select = std::make_unique<Selector>(space4d->getHyper(), nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  host_select->set_labels(ref->get_ref_labels(0), ref->get_ref_wmap(0), ref->get_ref_offsets(0), nref);
+  for (int iref = 0; iref < nref; ++iref) {
+    host_select->set_value(iref);
+    auto err = host_select->dotTest(verbose);
+    ASSERT_TRUE(err.first <= tolerance);
+    ASSERT_TRUE(err.second <= tolerance);
+  }
+};
+
+TEST_F(Selector_Test, scatter_matches_mask) { 
+  auto input = space4d->clone();
+  input->random();
+  for (auto backend : {Backend::DEVICE, Backend::HOST}) {
+    auto op = std::make_unique<Selector>(space4d->getHyper(), nullptr, nullptr, 1, 1, nullptr, backend);
+    op->set_labels(ref->get_ref_labels(1), ref->get_ref_wmap(1), ref->get_ref_offsets(1), nref);
+    op->model_vec->upload(input->getVals());
+
+    // masked selection of every label, accumulated
+    auto masked = space4d->clone();
+    for (int iref = 0; iref < nref; ++iref) {
+      op->set_value(iref);
+      op->cu_forward(iref > 0, op->model_vec, op->data_vec);
+    }
+    op->data_vec->download(masked->getVals());
+
+    // the lists partition the volume: overwriting per label rebuilds the same result
+    op->data_vec->zero();
+    auto scattered = space4d->clone();
+    for (int iref = 0; iref < nref; ++iref) {
+      op->set_value(iref);
+      op->cu_scatter(false, op->model_vec, op->data_vec);
+    }
+    op->data_vec->download(scattered->getVals());
+
+    scattered->scaleAdd(masked, 1, -1);
+    ASSERT_TRUE(scattered->norm(2) <= tolerance * masked->norm(2));
+    masked->scaleAdd(input, 1, -1);
+    ASSERT_TRUE(masked->norm(2) <= tolerance * input->norm(2));
+  }
+};
+
+TEST(RefSampler_Test, histogram_matches_opencv) {
+  int nx = 100, ny = 100, nw = 5, nz = 10, nref = 3;
+  auto slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+  // three blocks drifting with depth, plus noise
+  std::mt19937 gen(1);
+  std::normal_distribution<float> noise(0.f, 0.01f);
+  auto vals = slow4d->getVals();
+  for (int iz = 0; iz < nz; ++iz)
+    for (int iw = 0; iw < nw; ++iw)
+      for (int iy = 0; iy < ny; ++iy)
+        for (int ix = 0; ix < nx; ++ix) {
+          float s = (ix < 30 ? 1.f : ix < 70 ? 1.5f : 2.f) + 0.01f * iz;
+          vals[ix + nx * (iy + ny * (iw + nw * iz))] = {s + noise(gen), 0.05f * s};
+        }
+
+  auto hist = std::make_shared<RefSampler>(slow4d, nref);
+  auto ocv = std::make_shared<RefSampler>(slow4d, nref, RefSampler::Clustering::OPENCV);
+  ASSERT_TRUE(hist->cluster_error() <= 1.01 * ocv->cluster_error());
+  for (int iz = 0; iz < nz; ++iz) ASSERT_EQ(hist->get_ref_offsets(iz)[nref], nx * ny * nw);
+};
+
+TEST(RefSampler_Test, disk_cache) {
+  int nx = 50, ny = 40, nw = 5, nz = 4, nref = 3;
+  auto slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+  slow4d->random();
+  auto dir = std::filesystem::temp_directory_path() / "fwix_refsampler_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  auto first = std::make_shared<RefSampler>(slow4d, nref, RefSampler::Clustering::HISTOGRAM, dir.string());
+  auto second = std::make_shared<RefSampler>(slow4d, nref, RefSampler::Clustering::HISTOGRAM, dir.string());
+  ASSERT_FALSE(first->from_cache());
+  ASSERT_TRUE(second->from_cache());
+  for (int iz = 0; iz < nz; ++iz) {
+    ASSERT_EQ(std::memcmp(first->get_ref_labels(iz), second->get_ref_labels(iz), first->get_ref_nslices(iz) * nx * ny), 0);
+    ASSERT_EQ(std::memcmp(first->get_ref_offsets(iz), second->get_ref_offsets(iz), sizeof(int) * (nref + 1)), 0);
+    for (int iref = 0; iref < nref; ++iref)
+      ASSERT_EQ(std::memcmp(first->get_ref_slow(iz, iref), second->get_ref_slow(iz, iref), sizeof(std::complex<float>) * nw), 0);
+  }
+
+  // another nref or another model is another entry
+  ASSERT_FALSE(std::make_shared<RefSampler>(slow4d, nref + 1, RefSampler::Clustering::HISTOGRAM, dir.string())->from_cache());
+  slow4d->getVals()[0] += 1.f;
+  ASSERT_FALSE(std::make_shared<RefSampler>(slow4d, nref, RefSampler::Clustering::HISTOGRAM, dir.string())->from_cache());
+  std::filesystem::remove_all(dir);
+};
+
+TEST(RefSampler_Test, lazy_ring) {
+  int nx = 50, ny = 40, nw = 5, nz = 8, nref = 3;
+  auto slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+  slow4d->random();
+  auto lazy = std::make_shared<RefSampler>(slow4d, nref, RefSampler::Clustering::HISTOGRAM, "", 3);
+  ASSERT_TRUE(lazy->is_lazy());
+
+  // down then up, as Downward forward and adjoint: evicted depths come back with the same labels
+  std::vector<std::vector<uint8_t>> labels(nz);
+  for (int iz = 0; iz < nz; ++iz) {
+    auto ptr = lazy->get_ref_labels(iz);
+    labels[iz].assign(ptr, ptr + lazy->get_ref_nslices(iz) * nx * ny);
+    ASSERT_EQ(lazy->get_ref_offsets(iz)[nref], nx * ny * nw);
+  }
+  for (int iz = nz - 1; iz >= 0; --iz)
+    ASSERT_EQ(std::memcmp(lazy->get_ref_labels(iz), labels[iz].data(), labels[iz].size()), 0);
+
+  auto eager = std::make_shared<RefSampler>(slow4d, nref);
+  ASSERT_TRUE(lazy->cluster_error() <= 1.01 * eager->cluster_error());
+};
+
+TEST(RefSampler_Test, shared_frequency_slices) {
+  int nx = 50, ny = 40, nw = 6, nz = 3, nref = 3;
+  auto slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+  slow4d->random();
+  // depth 0 does not depend on frequency, depth 1 has two bands, depth 2 is all distinct
+  size_t n = nx * ny;
+  auto vals = slow4d->getVals();
+  for (int iw = 1; iw < nw; ++iw) std::copy(vals, vals + n, vals + iw * n);
+  for (int iw = 0; iw < nw; ++iw) {
+    auto band = vals + (nw + (iw < nw / 2 ? 0 : nw / 2)) * n;
+    if (vals + (nw + iw) * n != band) std::copy(band, band + n, vals + (nw + iw) * n);
+  }
+
+  auto ref = std::make_shared<RefSampler>(slow4d, nref);
+  ASSERT_EQ(ref->get_ref_nslices(0), 1);
+  ASSERT_EQ(ref->get_ref_nslices(1), 2);
+  ASSERT_EQ(ref->get_ref_nslices(2), nw);
+  ASSERT_EQ(ref->get_ref_wmap(1)[nw - 1], 1);
+  for (int iz = 0; iz < nz; ++iz) ASSERT_EQ(ref->get_ref_offsets(iz)[nref], nx * ny * nw);
+
+  // the selector expands the shared slices to every frequency
+  auto domain = std::make_shared<hypercube>(nx, ny, nw, 1);
+  auto input = std::make_shared<complex4DReg>(domain);
+  input->random();
+  for (auto backend : {Backend::DEVICE, Backend::HOST}) {
+    auto op = std::make_unique<Selector>(domain, nullptr, nullptr, 1, 1, nullptr, backend);
+    op->set_labels(ref->get_ref_labels(0), ref->get_ref_wmap(0), ref->get_ref_offsets(0), nref);
+    op->model_vec->upload(input->getVals());
+    auto output = input->clone();
+    for (int iref = 0; iref < nref; ++iref) {
+      op->set_value(iref);
+      op->cu_scatter(false, op->model_vec, op->data_vec);
+    }
+    op->data_vec->download(output->getVals());
+    output->scaleAdd(input, 1, -1);
+    ASSERT_TRUE(output->norm(2) <= tolerance * input->norm(2));
+  }
+};
+
 class Injection_Test : public testing::Test {
  protected:
   void SetUp() override {
@@ -230,9 +634,10 @@ class Injection_Test : public testing::Test {
     }
     
     injection = std::make_unique<Injection>(domain, range, cx, cy, cz, ids);
+    host_injection = std::make_unique<Injection>(domain, range, cx, cy, cz, ids, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
   }
 
-  std::unique_ptr<Injection> injection;
+  std::unique_ptr<Injection> injection, host_injection;
   int nx, ny, nz, nw, ns;
   std::shared_ptr<complex5DReg> wfld;
   std::shared_ptr<complex2DReg> traces;
@@ -249,6 +654,12 @@ TEST_F(Injection_Test, dotTest) {
   ASSERT_TRUE(err.second <= tolerance);
 }
 
+TEST_F(Injection_Test, host_dotTest) { 
+  auto err = host_injection->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
 class UpDown_Test : public testing::Test {
  protected:
   void SetUp() override {
@@ -275,11 +686,21 @@ class UpDown_Test : public testing::Test {
     auto par = std::make_shared<jsonParamObj>(root);
 
     down = std::make_unique<Downward>(domain, slow4d, par);
-    // up = std::make_unique<Upward>(domain, slow4d, par);
+    host_down = std::make_unique<Downward>(domain, slow4d, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+    up = std::make_unique<Upward>(domain, slow4d, par);
+  }
+
+  // a Downward on the random model every store test shares, the store picked by root
+  std::unique_ptr<Downward> make_down(Json::Value root) {
+    root["nref"] = 3;
+    auto par = std::make_shared<jsonParamObj>(root);
+    if (!ref) ref = OneStep::make_sampler(random_slowness(nx, ny, nw, nz), par);
+    return std::make_unique<Downward>(wfld1->getHyper(), ref, nullptr, par);
   }
 
-  std::unique_ptr<Downward> down;
+  std::unique_ptr<Downward> down, host_down;
   std::unique_ptr<Upward> up;
+  std::shared_ptr<RefSampler> ref;
   int nx, ny, nz, nw, ns;
   std::shared_ptr<complex4DReg> wfld1, wfld2;
 };
@@ -310,24 +731,208 @@ TEST_F(UpDown_Test, down_adj_wfld) {
   down->adjoint(false, wfld1, wfld2);
   ASSERT_EQ(std::real(wfld->dot(wfld)), 0.);
 }
-// TEST_F(UpDown_Test, up_fwd) { 
-//   for (int i=0; i < 3; ++i)
-//     ASSERT_NO_THROW(up->forward(false, wfld1, wfld2));
-// }
+TEST_F(UpDown_Test, up_fwd) { 
+  for (int i=0; i < 3; ++i)
+    ASSERT_NO_THROW(up->forward(false, wfld1, wfld2));
+}
 
-// TEST_F(UpDown_Test, up_adj) { 
-//   for (int i=0; i < 3; ++i)
-//     ASSERT_NO_THROW(up->adjoint(false, wfld1, wfld2));
-// }
+TEST_F(UpDown_Test, up_adj) { 
+  for (int i=0; i < 3; ++i)
+    ASSERT_NO_THROW(up->adjoint(false, wfld1, wfld2));
+}
 
 TEST_F(UpDown_Test, down_dotTest) { 
   auto err = down->dotTest(verbose);
   ASSERT_TRUE(err.first <= tolerance);
   ASSERT_TRUE(err.second <= tolerance);
 }
-// TEST_F(UpDown_Test, up_dotTest) { 
-//   up->dotTest(verbose);
-// }
+TEST_F(UpDown_Test, host_down_dotTest) { 
+  auto err = host_down->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+TEST_F(UpDown_Test, host_frequency_major) { 
+  // every (s,w) slice through all the depths on its own: same wavefields as depth by depth
+  Json::Value root;
+  root["nref"] = 3;
+  auto depth_par = std::make_shared<jsonParamObj>(root);
+  root["schedule"] = "frequency";
+  auto par = std::make_shared<jsonParamObj>(root);
+  // several references per depth, looked up through two frequency slices
+  auto ref = OneStep::make_sampler(random_slowness(nx, ny, nw, nz), par);
+  auto depth = std::make_unique<Downward>(wfld1->getHyper(), ref, nullptr, depth_par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+  auto freq = std::make_unique<Downward>(wfld1->getHyper(), ref, nullptr, par, nullptr, nullptr, 1, 1, nullptr, Backend::HOST);
+
+  wfld1->random();
+  auto out = wfld2->clone();
+  depth->forward(false, wfld1, wfld2);
+  freq->forward(false, wfld1, out);
+  out->scaleAdd(wfld2, 1, -1);
+  ASSERT_TRUE(out->norm(2) / wfld2->norm(2) <= tolerance);
+  auto wfld = freq->get_wfld()->clone();
+  wfld->scaleAdd(depth->get_wfld(), 1, -1);
+  ASSERT_TRUE(wfld->norm(2) / depth->get_wfld()->norm(2) <= tolerance);
+
+  auto err = freq->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(UpDown_Test, sz3_store) { 
+  // the compressed wavefields are within the error bound of the ones kept in memory
+  Json::Value root;
+  root["wfld_store"] = "sz3";
+  root["wfld_eb"] = 1e-4;
+  auto mem = make_down(Json::Value());
+  auto sz3 = make_down(root);
+  ASSERT_EQ(sz3->get_wfld(), nullptr);
+
+  wfld1->random();
+  mem->forward(false, wfld1, wfld2);
+  sz3->forward(false, wfld1, wfld2);
+  auto store = dynamic_cast<SZ3Store*>(sz3->get_store());
+  store->flush();
+
+  auto slice = wfld1->clone();
+  size_t n = slice->getHyper()->getN123();
+  for (int iz=0; iz < nz-1; ++iz) {
+    sz3->load_wfld(iz, sz3->model_vec);
+    sz3->model_vec->download(slice->getVals());
+    // the bound is relative to the range of the real and imaginary planes together
+    auto exact = mem->get_wfld()->getVals() + iz*n;
+    float lo = exact[0].real(), hi = lo, err = 0.f;
+    for (size_t i=0; i < n; ++i) {
+      lo = std::min({lo, exact[i].real(), exact[i].imag()});
+      hi = std::max({hi, exact[i].real(), exact[i].imag()});
+      err = std::max({err, std::abs(slice->getVals()[i].real() - exact[i].real()), 
+        std::abs(slice->getVals()[i].imag() - exact[i].imag())});
+    }
+    ASSERT_LE(err, 1.01 * 1e-4 * (hi - lo));
+  }
+  ASSERT_LT(store->bytes(), mem->get_wfld()->getHyper()->getN123() * sizeof(std::complex<float>));
+  if (verbose) std::cout << "ratio " << store->ratio() << " compress " << store->compress_throughput() 
+    << " MB/s decompress " << store->decompress_throughput() << " MB/s\n";
+}
+
+TEST_F(UpDown_Test, sz3_ratio) { 
+  // a smooth wavefield compresses, unlike the random one above
+  SZ3Store store(wfld1->getHyper(), 2, 1e-4);
+  auto vals = wfld1->getVals();
+  for (int is=0; is < ns; ++is)
+    for (int iw=0; iw < nw; ++iw)
+      for (int iy=0; iy < ny; ++iy)
+        for (int ix=0; ix < nx; ++ix) {
+          float x = float(ix - nx/2) / nx, y = float(iy - ny/2) / ny;
+          float phase = 2.f * float(M_PI) * (iw + 1) * (x + 0.5f * y) + is;
+          vals[ix + nx * (iy + ny * (iw + nw * is))] = std::exp(-8.f * (x*x + y*y)) * std::polar(1.f, phase);
+        }
+  store.put(0, vals);
+  store.flush();
+  ASSERT_GT(store.ratio(), 1.);
+}
+
+TEST_F(UpDown_Test, file_store) { 
+  // written behind to disk, read back ahead in decreasing depth
+  Json::Value root;
+  root["wfld_store"] = "file";
+  root["wfld_buffers"] = 3;
+  auto mem = make_down(Json::Value());
+  auto file = make_down(root);
+
+  wfld1->random();
+  mem->forward(false, wfld1, wfld2);
+  file->forward(false, wfld1, wfld2);
+  auto store = dynamic_cast<FileStore*>(file->get_store());
+  store->flush();
+
+  auto slice = wfld1->clone();
+  size_t n = slice->getHyper()->getN123();
+  for (int iz=nz-2; iz >= 0; --iz) {
+    file->load_wfld(iz, file->model_vec);
+    file->model_vec->download(slice->getVals());
+    ASSERT_TRUE(std::equal(slice->getVals(), slice->getVals() + n, mem->get_wfld()->getVals() + iz*n));
+  }
+  ASSERT_GT(store->prefetch_hits(), 0);
+  ASSERT_LE(store->bytes(), 3 * n * sizeof(std::complex<float>));
+}
+
+TEST_F(UpDown_Test, checkpoint_store) { 
+  // three of the nine wavefields kept, the others recomputed from them
+  Json::Value root;
+  root["wfld_store"] = "checkpoint";
+  root["wfld_checkpoints"] = 3;
+  auto mem = make_down(Json::Value());
+  auto ckpt = make_down(root);
+
+  wfld1->random();
+  mem->forward(false, wfld1, wfld2);
+  ckpt->forward(false, wfld1, wfld2);
+
+  auto slice = wfld1->clone();
+  size_t n = slice->getHyper()->getN123();
+  for (int iz=nz-2; iz >= 0; --iz) {
+    ckpt->load_wfld(iz, ckpt->model_vec);
+    ckpt->model_vec->download(slice->getVals());
+    ASSERT_TRUE(std::equal(slice->getVals(), slice->getVals() + n, mem->get_wfld()->getVals() + iz*n));
+  }
+  ASSERT_GT(ckpt->get_recompute_factor(), 0.);
+  ASSERT_LE(ckpt->get_store()->bytes(), 3 * n * sizeof(std::complex<float>));
+}
+
+TEST_F(UpDown_Test, up_dotTest) { 
+  auto err = up->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(UpDown_Test, imaging_dotTest) { 
+  Json::Value root;
+  root["nref"] = 3;
+  auto par = std::make_shared<jsonParamObj>(root);
+  auto source = std::make_shared<Downward>(wfld1->getHyper(), random_slowness(nx, ny, nw, nz), par);
+  wfld1->random();
+  source->forward(false, wfld1, wfld2);
+
+  auto img = std::make_shared<hypercube>(nx, ny, nz);
+  auto imaging = std::make_unique<Imaging>(img, source);
+  auto err = imaging->dotTest(verbose);
+  ASSERT_TRUE(err.first <= tolerance);
+  ASSERT_TRUE(err.second <= tolerance);
+}
+
+TEST_F(UpDown_Test, imaging_checkpoint) { 
+  // the same image from the stored and from the recomputed source wavefields
+  Json::Value root;
+  root["nref"] = 3;
+  auto par = std::make_shared<jsonParamObj>(root);
+  root["wfld_store"] = "checkpoint";
+  auto ckpt_par = std::make_shared<jsonParamObj>(root);
+  auto ref = OneStep::make_sampler(random_slowness(nx, ny, nw, nz), par);
+  auto source = std::make_shared<Downward>(wfld1->getHyper(), ref, nullptr, par);
+  auto ckpt_source = std::make_shared<Downward>(wfld1->getHyper(), ref, nullptr, ckpt_par);
+
+  wfld1->random();
+  source->forward(false, wfld1, wfld2);
+  ckpt_source->forward(false, wfld1, wfld2);
+
+  auto hyper = std::make_shared<hypercube>(nx, ny, nz);
+  auto imaging = std::make_unique<Imaging>(hyper, source);
+  auto ckpt_imaging = std::make_unique<Imaging>(hyper, ckpt_source);
+  auto img1 = std::make_shared<complex3DReg>(hyper);
+  auto img2 = std::make_shared<complex3DReg>(hyper);
+  wfld2->random();
+  imaging->adjoint(false, img1, wfld2);
+  ckpt_imaging->adjoint(false, img2, wfld2);
+  ASSERT_GT(std::real(img1->dot(img1)), 0.);
+  ASSERT_NEAR(std::real(img1->dot(img2)), std::real(img1->dot(img1)), 1e-4 * std::real(img1->dot(img1)));
+
+  // and the forward, against the source replayed from its checkpoints
+  imaging->forward(false, img1, wfld1);
+  auto rec = wfld1->clone();
+  ckpt_imaging->forward(false, img1, rec);
+  ASSERT_NEAR(std::real(wfld1->dot(rec)), std::real(wfld1->dot(wfld1)), 1e-4 * std::real(wfld1->dot(wfld1)));
+  ASSERT_GT(ckpt_source->get_recompute_factor(), 0.);
+}
 
 int main(int argc, char **argv) {
   // Parse command-line arguments
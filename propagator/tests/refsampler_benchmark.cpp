@@ -0,0 +1,76 @@
+#include <complex4DReg.h>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <random>
+
+#include  <RefSampler.h>
+
+using namespace SEP;
+
+// startup time and cluster error of the reference sampling, histogram Lloyd against cv::kmeans
+class RefSamplerBenchmark : public benchmark::Fixture {
+ protected:
+  void SetUp(::benchmark::State& state) override {
+    int nx = state.range(3);
+    int ny = state.range(2);
+    int nw = state.range(1);
+    nref = state.range(0);
+    int nz = 20;
+
+    // a few layers with a smooth gradient, attenuation proportional to the slowness, and noise
+    slow4d = std::make_shared<complex4DReg>(nx, ny, nw, nz);
+    std::mt19937 gen(1);
+    std::normal_distribution<float> noise(0.f, 0.01f);
+    auto vals = slow4d->getVals();
+    for (int iz=0; iz < nz; ++iz)
+      for (int iw=0; iw < nw; ++iw)
+        for (int iy=0; iy < ny; ++iy)
+          for (int ix=0; ix < nx; ++ix) {
+            float s = (ix < nx/3 ? 0.5f : ix < 2*nx/3 ? 0.4f : 0.3f) + 0.001f*iz + 0.05f*iy/ny;
+            vals[ix + nx*(iy + size_t(ny)*(iw + size_t(nw)*iz))] = {s + noise(gen), 0.02f*s};
+          }
+  }
+
+  void run(::benchmark::State& state, RefSampler::Clustering method) {
+    double error = 0.;
+    for (auto _ : state) {
+      auto start = std::chrono::high_resolution_clock::now();
+      auto ref = std::make_unique<RefSampler>(slow4d, nref, method);
+      auto end = std::chrono::high_resolution_clock::now();
+      auto elapsed_seconds =
+        std::chrono::duration_cast<std::chrono::duration<double>>(
+          end - start);
+      state.SetIterationTime(elapsed_seconds.count());
+      error = ref->cluster_error();
+    }
+    state.counters["cluster_error"] = error;
+  }
+
+  std::shared_ptr<complex4DReg> slow4d;
+  int nref;
+};
+
+BENCHMARK_DEFINE_F(RefSamplerBenchmark, histogram)(benchmark::State& state){
+  run(state, RefSampler::Clustering::HISTOGRAM);
+};
+BENCHMARK_DEFINE_F(RefSamplerBenchmark, opencv)(benchmark::State& state){
+  run(state, RefSampler::Clustering::OPENCV);
+};
+
+BENCHMARK_REGISTER_F(RefSamplerBenchmark, histogram)
+-> Args({3, 10, 500, 500}) 
+-> Args({5, 10, 500, 500}) 
+-> Args({10, 10, 500, 500}) 
+-> Iterations(2)
+-> Threads(1)
+-> UseManualTime();
+
+BENCHMARK_REGISTER_F(RefSamplerBenchmark, opencv)
+-> Args({3, 10, 500, 500}) 
+-> Args({5, 10, 500, 500}) 
+-> Args({10, 10, 500, 500}) 
+-> Iterations(2)
+-> Threads(1)
+-> UseManualTime();
+
+BENCHMARK_MAIN();